@@ -0,0 +1,50 @@
+/*
+    arena.cpp: bump allocator for decoded data that lives as long as its owner
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "arena.h"
+
+#include <algorithm>
+
+uint8_t* Arena::allocate(std::size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (blocks_.empty() || used_ + size > blocks_.back().size) {
+        auto block_size = std::max(block_size_, size);
+        blocks_.push_back(Block{std::unique_ptr<uint8_t[]>(new uint8_t[block_size]), block_size});
+        used_ = 0;
+    }
+
+    auto p = blocks_.back().data.get() + used_;
+    used_ += size;
+
+    return p;
+}
+
+std::size_t Arena::capacity() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::size_t size = 0;
+    for (auto& block : blocks_) {
+        size += block.size;
+    }
+
+    return size;
+}
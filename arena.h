@@ -0,0 +1,55 @@
+/*
+    arena.h: bump allocator for decoded data that lives as long as its owner
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// allocations are never freed individually, only all at once with the
+// arena. allocate() may be called from several threads
+class Arena {
+public:
+    explicit Arena(std::size_t block_size = 64 * 1024) : block_size_{block_size}, used_{0} { }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    uint8_t* allocate(std::size_t size);
+
+    // bytes held in blocks, used or not
+    std::size_t capacity() const;
+
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        std::size_t size;
+    };
+
+    std::size_t block_size_;
+    std::vector<Block> blocks_;
+    std::size_t used_;
+    mutable std::mutex mutex_;
+};
+
+#endif
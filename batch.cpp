@@ -0,0 +1,258 @@
+/*
+    batch.cpp: shared helpers for batch mode
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
+
+#include "memory_budget.h"
+
+BatchOptions::BatchOptions() :
+    list{nullptr},
+    errors{nullptr},
+    queue_depth{64},
+    queue_size{16},
+    decode_threads{std::max(1u, std::thread::hardware_concurrency())},
+    diff_threads{std::max(1u, std::thread::hardware_concurrency())},
+    write_threads{1},
+    memory_limit{0},
+    journal{nullptr},
+    journal_sync{64},
+    cache{nullptr},
+    auto_base{nullptr},
+    processes{0},
+    stats{false}
+{
+}
+
+std::string BatchOptions::error_report_path() const
+{
+    return errors ? std::string{errors} : output_dir + "/errors.tsv";
+}
+
+const char* batch_usage = "--batch <output dir> [--list <file>] [--errors <file>] [--queue-depth n] [--queue-size n] "
+    "[--decode-threads n] [--diff-threads n] [--write-threads n] [--memory-limit bytes[K|M|G]] "
+    "[--journal <file>] [--journal-sync n] [--cache <dir>] [--auto-base <index>] [--processes n] [--stats]";
+
+bool parse_batch_option(int& arg, int argv, char* argc[], BatchOptions& options)
+{
+    std::string option{argc[arg]};
+    if (option == "--stats") {
+        options.stats = true;
+        return true;
+    }
+
+    if (arg + 1 >= argv) {
+        return false;
+    }
+
+    auto count = [&]() {
+        return static_cast<unsigned>(std::max(1, std::atoi(argc[arg + 1])));
+    };
+
+    if (option == "--batch") {
+        options.output_dir = argc[arg + 1];
+    } else if (option == "--list") {
+        options.list = argc[arg + 1];
+    } else if (option == "--errors") {
+        options.errors = argc[arg + 1];
+    } else if (option == "--queue-depth") {
+        options.queue_depth = count();
+    } else if (option == "--queue-size") {
+        options.queue_size = count();
+    } else if (option == "--decode-threads") {
+        options.decode_threads = count();
+    } else if (option == "--diff-threads") {
+        options.diff_threads = count();
+    } else if (option == "--write-threads") {
+        options.write_threads = count();
+    } else if (option == "--memory-limit") {
+        options.memory_limit = parse_memory_size(argc[arg + 1]);
+        if (!options.memory_limit) {
+            return false;
+        }
+    } else if (option == "--journal") {
+        options.journal = argc[arg + 1];
+    } else if (option == "--journal-sync") {
+        options.journal_sync = count();
+    } else if (option == "--cache") {
+        options.cache = argc[arg + 1];
+    } else if (option == "--auto-base") {
+        options.auto_base = argc[arg + 1];
+    } else if (option == "--processes") {
+        options.processes = count();
+    } else {
+        return false;
+    }
+
+    ++arg;
+    return true;
+}
+
+std::vector<std::string> read_path_list(const char* filename)
+{
+    std::ifstream ifs;
+    std::istream* s = &std::cin;
+    if (std::string{filename} != "-") {
+        ifs.open(filename);
+        if (!ifs) {
+            throw std::runtime_error(std::string{"Unable to open "} + filename);
+        }
+        s = &ifs;
+    }
+
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(*s, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            paths.push_back(line);
+        }
+    }
+
+    return paths;
+}
+
+std::string flatten_path(const std::string& input)
+{
+    std::size_t start = 0;
+    while (input.compare(start, 2, "./") == 0) {
+        start += 2;
+    }
+
+    // '_' and '%' are escaped so that each '_' left stands for a '/'; a
+    // leading '/' is kept as one, so absolute and relative paths differ
+    std::string name;
+    for (auto i = start; i < input.size(); ++i) {
+        auto c = input[i];
+        if (c == '/') {
+            name += '_';
+        } else if (c == '_') {
+            name += "%5F";
+        } else if (c == '%') {
+            name += "%25";
+        } else {
+            name += c;
+        }
+    }
+
+    return name;
+}
+
+std::string batch_output_path(const std::string& dir, const std::string& input)
+{
+    return dir + "/" + flatten_path(input) + ".xml";
+}
+
+void check_output_paths(const std::string& dir, const std::vector<std::string>& inputs)
+{
+    std::map<std::string, const std::string*> outputs;
+    for (auto& input : inputs) {
+        auto inserted = outputs.insert(std::make_pair(batch_output_path(dir, input), &input));
+        if (!inserted.second) {
+            throw std::runtime_error("Inputs " + *inserted.first->second + " and " + input + " would both be written to " + inserted.first->first);
+        }
+    }
+}
+
+Expected<void> write_file_atomically(const std::string& path, const std::string& contents)
+{
+    // unique, since other threads or processes may be writing the same
+    // path at once
+    static std::atomic<unsigned> count{0};
+    auto temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(count++) + ".tmp";
+
+    {
+        std::ofstream ofs(temporary, std::ios::binary);
+        if (!ofs.write(contents.data(), contents.size()) || !ofs.flush()) {
+            std::remove(temporary.c_str());
+            return Error{"Unable to write " + temporary};
+        }
+    }
+
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        auto error = errno;
+        std::remove(temporary.c_str());
+        return Error{"Unable to rename " + temporary + ": " + std::strerror(error)};
+    }
+
+    return Expected<void>{};
+}
+
+ErrorReport::ErrorReport(const std::string& path) : path_{path}, ofs_{path}, count_{0}
+{
+    if (!ofs_) {
+        throw std::runtime_error("Unable to create " + path);
+    }
+
+    ofs_ << "file\toffset\twhere\treason\n";
+    ofs_.flush();
+}
+
+// tabs and line breaks would split a record
+static std::string field(const std::string& s)
+{
+    auto f = s;
+    for (auto& c : f) {
+        if (c == '\t' || c == '\n' || c == '\r') {
+            c = ' ';
+        }
+    }
+    return f;
+}
+
+void ErrorReport::add(const std::string& file, const Error& error)
+{
+    std::ostringstream oss;
+    oss << field(file) << "\t";
+    if (error.offset >= 0) {
+        oss << error.offset;
+    }
+    oss << "\t" << field(error.where) << "\t" << field(error.reason) << "\n";
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ofs_ << oss.str();
+    ++count_;
+}
+
+bool ErrorReport::summarize(std::ostream& s)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ofs_.flush();
+
+    if (count_) {
+        s << count_ << (count_ == 1 ? " input" : " inputs") << " failed; see " << path_ << "\n";
+    }
+
+    return count_ == 0;
+}
@@ -0,0 +1,126 @@
+/*
+    batch.h: shared helpers for batch mode
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+
+// how a batch run is spread over the pipeline: files are read
+// queue_depth at a time, each later stage has its own workers, and at
+// most queue_size items wait between any two stages
+struct BatchOptions {
+    BatchOptions();
+
+    std::string output_dir;
+    const char* list;
+
+    // where failed inputs are recorded; errors.tsv in the output
+    // directory unless given
+    const char* errors;
+    std::string error_report_path() const;
+
+    unsigned queue_depth;
+    unsigned queue_size;
+    unsigned decode_threads;
+    unsigned diff_threads;
+    unsigned write_threads;
+
+    // bytes that items between being read and written may hold; 0 for
+    // no limit
+    uint64_t memory_limit;
+
+    // where finished inputs are recorded, so a later run skips them;
+    // none unless given. Records are synced every journal_sync inputs
+    const char* journal;
+    unsigned journal_sync;
+
+    // directory of earlier results to reuse, which single diffs consult
+    // too; none unless given
+    const char* cache;
+
+    // sketch index of reference files, each input being diffed against
+    // the one it most resembles instead of a base given on the command
+    // line; single diffs consult it too
+    const char* auto_base;
+
+    // forked worker processes to diff in instead of the pipeline, so an
+    // input that crashes one fails alone; 0 for the pipeline
+    unsigned processes;
+
+    // per-stage counters on stderr at the end of the run
+    bool stats;
+};
+
+// consumes the batch option at argc[arg] and its value, if it is one,
+// leaving arg on the last argument used
+bool parse_batch_option(int& arg, int argv, char* argc[], BatchOptions& options);
+
+// the usage line for the options above
+extern const char* batch_usage;
+
+// one path per line, from a file or "-" for stdin; blank lines are
+// skipped. Throws std::runtime_error if the list cannot be read
+std::vector<std::string> read_path_list(const char* filename);
+
+// input's path with directory separators turned into '_', and '_' and
+// '%' escaped as %5F and %25, so inputs with the same name in different
+// directories do not collide when their results share a directory. A
+// leading "./" is dropped, as it names the same file
+std::string flatten_path(const std::string& input);
+
+// where batch mode writes the MML for input: its flattened path, under dir
+std::string batch_output_path(const std::string& dir, const std::string& input);
+
+// throws std::runtime_error naming the inputs if two of them would be
+// written to the same output, such as one listed twice
+void check_output_paths(const std::string& dir, const std::vector<std::string>& inputs);
+
+// writes through a temporary file and a rename, so an interrupted run
+// never leaves a truncated result behind
+Expected<void> write_file_atomically(const std::string& path, const std::string& contents);
+
+// the sidecar listing every input that failed, one tab-separated record
+// per line: file, offset, resource or tag, reason. Records may be added
+// from any thread
+class ErrorReport {
+public:
+    // throws std::runtime_error if the report cannot be created
+    explicit ErrorReport(const std::string& path);
+
+    void add(const std::string& file, const Error& error);
+
+    // notes on s how many inputs failed, if any; true if none did
+    bool summarize(std::ostream& s);
+
+private:
+    std::string path_;
+    std::ofstream ofs_;
+    std::size_t count_;
+    std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,583 @@
+/*
+    batch_reader.cpp: reads many files at once for batch mode
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "batch_reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "memory_budget.h"
+
+// liburing is not assumed; the ring is driven with the raw system calls
+class BatchReader::Ring {
+public:
+    // throws std::runtime_error if the kernel lacks io_uring or any of
+    // the operations used
+    Ring(unsigned queue_depth, MemoryBudget* budget, unsigned reserve);
+    ~Ring();
+
+    bool full() const { return busy_ == slots_.size(); }
+    bool empty() const { return busy_ == 0; }
+
+    // every busy slot is waiting for memory, so nothing will complete
+    // until some is released
+    bool stalled() const { return busy_ && parked_.size() == busy_; }
+
+    void open(std::size_t index, const std::string& path);
+
+    // submits queued operations, then waits for at least one to finish;
+    // files that have been read are appended to ready
+    void wait(std::deque<BatchFile>& ready);
+
+    // starts reading parked files, in the order they were sized, for as
+    // long as the budget admits them
+    void admit(std::deque<BatchFile>& ready);
+
+private:
+    enum class State {
+        Free,
+        Opening,
+        Sizing,
+        Admitting,
+        Reading,
+        Closing
+    };
+
+    // the kernel holds pointers into a slot while its operation is in
+    // flight, so slots never move
+    struct Slot {
+        State state;
+        int fd;
+        struct statx stx;
+        std::size_t done;
+        BatchFile file;
+    };
+
+    void release();
+
+    io_uring_sqe* get_sqe(std::size_t slot);
+    void complete(std::size_t slot, int32_t result, std::deque<BatchFile>& ready);
+    void start_reading(std::size_t slot, std::deque<BatchFile>& ready);
+    void read(std::size_t slot);
+    void finish(std::size_t slot, int error, std::deque<BatchFile>& ready);
+
+    int fd_;
+
+    uint8_t* sq_ring_;
+    std::size_t sq_ring_size_;
+    uint8_t* cq_ring_;
+    std::size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    std::size_t sqes_size_;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    unsigned to_submit_;
+
+    std::vector<Slot> slots_;
+    std::size_t busy_;
+
+    MemoryBudget* budget_;
+    unsigned reserve_;
+    std::deque<std::size_t> parked_;
+};
+
+// reads are split so a single request never exceeds what read(2) will
+// transfer at once
+static const std::size_t max_read = 1 << 30;
+
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+BatchReader::Ring::Ring(unsigned queue_depth, MemoryBudget* budget, unsigned reserve) :
+    sq_ring_{nullptr},
+    cq_ring_{nullptr},
+    sqes_{nullptr},
+    to_submit_{0},
+    slots_(std::max(queue_depth, 1u)),
+    busy_{0},
+    budget_{budget},
+    reserve_{reserve}
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    fd_ = io_uring_setup(slots_.size(), &params);
+    if (fd_ < 0) {
+        throw std::runtime_error(std::string{"io_uring_setup: "} + std::strerror(errno));
+    }
+
+    // every file needs openat, statx, read and close
+    std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+    if (io_uring_register(fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        close(fd_);
+        throw std::runtime_error(std::string{"io_uring_register: "} + std::strerror(errno));
+    }
+
+    for (auto op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            close(fd_);
+            throw std::runtime_error("io_uring lacks file operations");
+        }
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    auto map = [this](std::size_t size, off_t offset) {
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (p == MAP_FAILED) {
+            auto error = errno;
+            release();
+            throw std::runtime_error(std::string{"Unable to map io_uring: "} + std::strerror(error));
+        }
+        return static_cast<uint8_t*>(p);
+    };
+
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = map(cq_ring_size_, IORING_OFF_CQ_RING);
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+    sq_head_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+
+    for (auto& slot : slots_) {
+        slot.state = State::Free;
+        slot.fd = -1;
+    }
+}
+
+BatchReader::Ring::~Ring()
+{
+    release();
+
+    for (auto& slot : slots_) {
+        if (slot.state != State::Free && slot.state != State::Closing && slot.fd >= 0) {
+            close(slot.fd);
+        }
+    }
+}
+
+// anything still in flight is cancelled when the ring closes
+void BatchReader::Ring::release()
+{
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    close(fd_);
+}
+
+io_uring_sqe* BatchReader::Ring::get_sqe(std::size_t slot)
+{
+    // each busy slot has exactly one operation queued or in flight, and
+    // there are no more slots than submission entries, so this never
+    // overtakes the kernel
+    auto tail = *sq_tail_;
+    auto sqe = &sqes_[tail & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = slot;
+
+    sq_array_[tail & sq_mask_] = tail & sq_mask_;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+
+    return sqe;
+}
+
+void BatchReader::Ring::open(std::size_t index, const std::string& path)
+{
+    auto it = std::find_if(slots_.begin(), slots_.end(), [](const Slot& slot) {
+        return slot.state == State::Free;
+    });
+    if (it == slots_.end()) {
+        throw std::logic_error("No free io_uring slot");
+    }
+
+    auto& slot = *it;
+    slot.state = State::Opening;
+    slot.fd = -1;
+    slot.done = 0;
+    slot.file.index = index;
+    slot.file.path = path;
+    slot.file.data.clear();
+    slot.file.error = 0;
+    slot.file.charged = 0;
+    slot.file.oversized = false;
+    ++busy_;
+
+    auto sqe = get_sqe(it - slots_.begin());
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(slot.file.path.c_str());
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+void BatchReader::Ring::start_reading(std::size_t index, std::deque<BatchFile>& ready)
+{
+    auto& slot = slots_[index];
+    if (slot.file.oversized) {
+        finish(index, 0, ready);
+        return;
+    }
+
+    slot.file.data.resize(slot.stx.stx_size);
+    if (slot.file.data.empty()) {
+        finish(index, 0, ready);
+    } else {
+        read(index);
+    }
+}
+
+void BatchReader::Ring::admit(std::deque<BatchFile>& ready)
+{
+    while (!parked_.empty()) {
+        auto index = parked_.front();
+        auto& slot = slots_[index];
+
+        uint64_t reserved = slot.stx.stx_size * reserve_;
+        if (budget_->fits(reserved)) {
+            if (!budget_->try_acquire(reserved)) {
+                break;
+            }
+            slot.file.charged = reserved;
+        } else {
+            if (!budget_->try_acquire(budget_->limit())) {
+                break;
+            }
+            slot.file.charged = budget_->limit();
+            slot.file.oversized = true;
+        }
+
+        parked_.pop_front();
+        start_reading(index, ready);
+    }
+}
+
+void BatchReader::Ring::read(std::size_t index)
+{
+    auto& slot = slots_[index];
+    slot.state = State::Reading;
+
+    auto sqe = get_sqe(index);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot.fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(slot.file.data.data() + slot.done);
+    sqe->len = std::min(slot.file.data.size() - slot.done, max_read);
+    sqe->off = slot.done;
+}
+
+// hands the file over and closes it; the slot is reused once the close
+// completes
+void BatchReader::Ring::finish(std::size_t index, int error, std::deque<BatchFile>& ready)
+{
+    auto& slot = slots_[index];
+    if (error) {
+        slot.file.data.clear();
+        slot.file.error = error;
+    }
+    ready.push_back(std::move(slot.file));
+
+    if (slot.fd < 0) {
+        slot.state = State::Free;
+        --busy_;
+        return;
+    }
+
+    slot.state = State::Closing;
+
+    auto sqe = get_sqe(index);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot.fd;
+}
+
+void BatchReader::Ring::complete(std::size_t index, int32_t result, std::deque<BatchFile>& ready)
+{
+    auto& slot = slots_[index];
+
+    switch (slot.state) {
+    case State::Opening:
+        if (result < 0) {
+            finish(index, -result, ready);
+            break;
+        }
+
+        slot.fd = result;
+        slot.state = State::Sizing;
+        {
+            auto sqe = get_sqe(index);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = slot.fd;
+            sqe->addr = reinterpret_cast<uintptr_t>("");
+            sqe->len = STATX_SIZE;
+            sqe->statx_flags = AT_EMPTY_PATH;
+            sqe->off = reinterpret_cast<uintptr_t>(&slot.stx);
+        }
+        break;
+
+    case State::Sizing:
+        if (result < 0) {
+            finish(index, -result, ready);
+            break;
+        }
+
+        if (budget_) {
+            slot.state = State::Admitting;
+            parked_.push_back(index);
+        } else {
+            start_reading(index, ready);
+        }
+        break;
+
+    case State::Reading:
+        if (result == -EINTR || result == -EAGAIN) {
+            read(index);
+        } else if (result < 0) {
+            finish(index, -result, ready);
+        } else if (result == 0) {
+            // the file shrank since it was sized
+            slot.file.data.resize(slot.done);
+            finish(index, 0, ready);
+        } else {
+            slot.done += result;
+            if (slot.done < slot.file.data.size()) {
+                read(index);
+            } else {
+                finish(index, 0, ready);
+            }
+        }
+        break;
+
+    case State::Closing:
+        slot.state = State::Free;
+        slot.fd = -1;
+        --busy_;
+        break;
+
+    case State::Admitting:
+    case State::Free:
+        break;
+    }
+}
+
+void BatchReader::Ring::wait(std::deque<BatchFile>& ready)
+{
+    auto result = io_uring_enter(fd_, to_submit_, 1, IORING_ENTER_GETEVENTS);
+    if (result < 0 && errno != EINTR) {
+        throw std::runtime_error(std::string{"io_uring_enter: "} + std::strerror(errno));
+    }
+    if (result > 0) {
+        to_submit_ -= result;
+    }
+
+    auto head = *cq_head_;
+    auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        auto& cqe = cqes_[head & cq_mask_];
+        complete(cqe.user_data, cqe.res, ready);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    if (budget_) {
+        admit(ready);
+    }
+}
+
+BatchReader::BatchReader(std::vector<std::string> paths, unsigned queue_depth, MemoryBudget* budget, unsigned reserve) :
+    paths_{std::move(paths)},
+    next_path_{0},
+    budget_{budget},
+    reserve_{reserve}
+{
+    try {
+        ring_.reset(new Ring{queue_depth, budget, reserve});
+    } catch (const std::runtime_error&) {
+        // fall back to pread
+    }
+}
+
+BatchReader::~BatchReader()
+{
+}
+
+bool BatchReader::next(BatchFile& file)
+{
+    if (ring_) {
+        while (ready_.empty()) {
+            while (!ring_->full() && next_path_ < paths_.size()) {
+                ring_->open(next_path_, paths_[next_path_]);
+                ++next_path_;
+            }
+
+            if (ring_->empty()) {
+                return false;
+            }
+
+            if (ring_->stalled()) {
+                // nothing is in flight, so wait for the rest of the
+                // pipeline to release memory rather than for the ring
+                auto generation = budget_->generation();
+                ring_->admit(ready_);
+                if (ring_->stalled()) {
+                    budget_->wait_for_release(generation);
+                }
+                continue;
+            }
+
+            ring_->wait(ready_);
+        }
+
+        file = std::move(ready_.front());
+        ready_.pop_front();
+        return true;
+    }
+
+    if (next_path_ == paths_.size()) {
+        return false;
+    }
+
+    file.index = next_path_;
+    file.path = paths_[next_path_++];
+    read_with_pread(file);
+    return true;
+}
+
+void BatchReader::read_with_pread(BatchFile& file)
+{
+    file.data.clear();
+    file.error = 0;
+    file.charged = 0;
+    file.oversized = false;
+
+    auto fd = ::open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        file.error = errno;
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        file.error = errno;
+        close(fd);
+        return;
+    }
+
+    if (budget_) {
+        uint64_t reserved = st.st_size * reserve_;
+        if (budget_->fits(reserved)) {
+            budget_->acquire(reserved);
+            file.charged = reserved;
+        } else {
+            budget_->acquire(budget_->limit());
+            file.charged = budget_->limit();
+            file.oversized = true;
+            close(fd);
+            return;
+        }
+    }
+
+    file.data.resize(st.st_size);
+
+    std::size_t done = 0;
+    while (done < file.data.size()) {
+        auto result = pread(fd, file.data.data() + done, std::min(file.data.size() - done, max_read), done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            file.error = errno;
+            file.data.clear();
+            break;
+        }
+        if (result == 0) {
+            file.data.resize(done);
+            break;
+        }
+        done += result;
+    }
+
+    close(fd);
+}
+
+Expected<void> recharge(MemoryBudget& budget, BatchFile& file, uint64_t usage, const std::atomic<std::size_t>& passed)
+{
+    if (usage <= file.charged) {
+        budget.release(file.charged - usage);
+        file.charged = usage;
+        return Expected<void>{};
+    }
+
+    if (!budget.grow(usage - file.charged, [&]() { return passed > 0; })) {
+        std::ostringstream oss;
+        oss << "Input needs " << usage << " bytes, more than the memory limit leaves";
+        return Error{oss.str()};
+    }
+
+    file.charged = usage;
+    return Expected<void>{};
+}
@@ -0,0 +1,94 @@
+/*
+    batch_reader.h: reads many files at once for batch mode
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_READER_H
+#define BATCH_READER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+
+// a file read whole; error is an errno value, and data is empty if it is
+// nonzero
+struct BatchFile {
+    // position in the list of paths
+    std::size_t index;
+    std::string path;
+    std::vector<uint8_t> data;
+    int error;
+
+    // taken from the memory budget for this file, to be released once it
+    // has been dealt with
+    uint64_t charged;
+
+    // too large for the budget to hold; data is left empty, and the
+    // caller should map the file from path instead
+    bool oversized;
+};
+
+class MemoryBudget;
+
+// reads a list of files, keeping up to queue_depth of them open and in
+// flight at once through io_uring, or one at a time with pread where the
+// kernel does not support it. Files are returned in the order they finish.
+// With a budget, a file is only read once reserve times its size can be
+// taken from it, leaving room for what decoding it adds; one that would
+// never fit is taken once nothing else is held, charged the whole limit,
+// and returned unread
+class BatchReader {
+public:
+    BatchReader(std::vector<std::string> paths, unsigned queue_depth, MemoryBudget* budget = nullptr, unsigned reserve = 1);
+    ~BatchReader();
+
+    BatchReader(const BatchReader&) = delete;
+    BatchReader& operator=(const BatchReader&) = delete;
+
+    bool using_io_uring() const { return static_cast<bool>(ring_); }
+
+    // false once every file has been returned
+    bool next(BatchFile& file);
+
+private:
+    class Ring;
+
+    void read_with_pread(BatchFile& file);
+
+    std::vector<std::string> paths_;
+    std::size_t next_path_;
+
+    MemoryBudget* budget_;
+    unsigned reserve_;
+
+    std::unique_ptr<Ring> ring_;
+    std::deque<BatchFile> ready_;
+};
+
+// sets file's charge to usage, the bytes a pipeline stage now holds for
+// it, without going over the budget's limit. Only the items the stage has
+// passed on, of which there are passed, are waited on to release memory,
+// since those it has yet to take may be waiting for this worker; fails
+// once none are left
+Expected<void> recharge(MemoryBudget& budget, BatchFile& file, uint64_t usage, const std::atomic<std::size_t>& passed);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+    binhex.cpp: BinHex 4.0 decoding
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "binhex.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <boost/crc.hpp>
+#include <boost/endian/conversion.hpp>
+
+using namespace boost::endian;
+
+namespace {
+
+const char banner[] = "(This file must be converted with BinHex";
+
+// the banner may follow mail headers and the like, but not by much
+const std::size_t banner_search_limit = 64 * 1024;
+
+const uint8_t skip = 0xfe;
+const uint8_t invalid = 0xff;
+
+struct DecodeTable {
+    DecodeTable() {
+        static const char alphabet[] = "!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+
+        std::fill(std::begin(values), std::end(values), invalid);
+        for (auto i = 0; i < 64; ++i) {
+            values[static_cast<uint8_t>(alphabet[i])] = i;
+        }
+        values['\r'] = values['\n'] = values['\t'] = values[' '] = skip;
+    }
+
+    uint8_t values[256];
+};
+
+const DecodeTable decode_table;
+
+const uint8_t* find_banner(Span file)
+{
+    auto end = file.data + std::min(file.size, banner_search_limit);
+    auto found = std::search(file.data, end, banner, banner + sizeof(banner) - 1);
+    return found == end ? nullptr : found;
+}
+
+uint16_t crc16(const uint8_t* p, std::size_t size)
+{
+    boost::crc_optimal<16, 0x1021, 0, 0, false, false> crc;
+    crc.process_bytes(p, size);
+    return crc.checksum();
+}
+
+}
+
+bool is_binhex(Span file)
+{
+    return find_banner(file) != nullptr;
+}
+
+Expected<Span> decode_binhex(Span file, std::vector<uint8_t>& out, Span* data_fork)
+{
+    auto p = find_banner(file);
+    if (!p) {
+        return Error{"BinHex banner not found"};
+    }
+
+    auto end = file.data + file.size;
+    p = std::find(p, end, ':');
+    if (p == end) {
+        return Error{"BinHex data not found"};
+    }
+    ++p;
+
+    // run length expansion (0x90 n repeats the last byte n - 1 more
+    // times; 0x90 0 is a literal 0x90) happens as each byte is decoded;
+    // text is 4:3, so only runs can outgrow the buffer
+    out.resize((end - p) * 3 / 4 + 3);
+    auto o = out.data();
+    auto o_end = out.data() + out.size();
+
+    uint8_t last = 0;
+    bool marker = false;
+    auto expand = [&](uint8_t b) {
+        if (marker) {
+            marker = false;
+            if (b == 0) {
+                *o++ = last = 0x90;
+            } else if (b > 1) {
+                // keep room for the run and for the rest of the text
+                // decoding without further runs
+                std::size_t needed = b - 1 + (end - p) * 3 / 4 + 3;
+                if (static_cast<std::size_t>(o_end - o) < needed) {
+                    auto offset = o - out.data();
+                    out.resize(std::max(out.size() * 2, offset + needed));
+                    o = out.data() + offset;
+                    o_end = out.data() + out.size();
+                }
+                std::memset(o, last, b - 1);
+                o += b - 1;
+            }
+        } else if (b == 0x90) {
+            marker = true;
+        } else {
+            *o++ = last = b;
+        }
+    };
+
+    uint32_t bits = 0;
+    auto sextets = 0;
+    for (;; ++p) {
+        if (p == end) {
+            return Error{"BinHex data not terminated", p - file.data};
+        }
+
+        auto value = decode_table.values[*p];
+        if (value < 64) {
+            bits = (bits << 6) | value;
+            if (++sextets == 4) {
+                expand(bits >> 16);
+                expand(bits >> 8);
+                expand(bits);
+                bits = 0;
+                sextets = 0;
+            }
+        } else if (value == skip) {
+            continue;
+        } else if (*p == ':') {
+            break;
+        } else {
+            return Error{"Invalid character in BinHex data", p - file.data};
+        }
+    }
+
+    // a final partial group holds one or two more bytes
+    if (sextets >= 2) {
+        bits <<= 6 * (4 - sextets);
+        expand(bits >> 16);
+        if (sextets == 3) {
+            expand(bits >> 8);
+        }
+    }
+
+    out.resize(o - out.data());
+
+    // name length and name, version, type, creator, flags, data and
+    // resource fork lengths, then the header CRC
+    if (out.empty() || out.size() < out[0] + 22u) {
+        return Error{"BinHex header truncated"};
+    }
+
+    std::size_t header_size = out[0] + 20;
+    auto header = out.data();
+    if (crc16(header, header_size) != load_big_u16(header + header_size)) {
+        return Error{"BinHex header CRC mismatch"};
+    }
+
+    uint64_t data_length = load_big_u32(header + header_size - 8);
+    uint64_t resource_length = load_big_u32(header + header_size - 4);
+    auto data_offset = header_size + 2;
+    auto resource_offset = data_offset + data_length + 2;
+    if (resource_offset + resource_length + 2 > out.size()) {
+        return Error{"BinHex forks truncated"};
+    }
+
+    if (crc16(out.data() + data_offset, data_length) != load_big_u16(out.data() + data_offset + data_length)) {
+        return Error{"BinHex data fork CRC mismatch"};
+    }
+
+    if (crc16(out.data() + resource_offset, resource_length) != load_big_u16(out.data() + resource_offset + resource_length)) {
+        return Error{"BinHex resource fork CRC mismatch"};
+    }
+
+    if (data_fork) {
+        *data_fork = Span{out.data() + data_offset, static_cast<std::size_t>(data_length)};
+    }
+
+    return Span{out.data() + resource_offset, static_cast<std::size_t>(resource_length)};
+}
@@ -0,0 +1,37 @@
+/*
+    binhex.h: BinHex 4.0 decoding
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BINHEX_H
+#define BINHEX_H
+
+#include <cstdint>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+// true if the file carries the BinHex 4.0 banner
+bool is_binhex(Span file);
+
+// decodes a whole BinHex 4.0 file into out, checking the header and fork
+// CRCs, and returns the resource fork's place within out (and the data
+// fork's, if asked), or what was wrong with the input
+Expected<Span> decode_binhex(Span file, std::vector<uint8_t>& out, Span* data_fork = nullptr);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+    cache.cpp: on-disk cache of diff results
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "hash.h"
+
+ResultCache::ResultCache(const std::string& dir, const std::string& version) : dir_{dir}, version_{hash64(version)}
+{
+    for (auto& d : {dir, dir + "/fragments"}) {
+        if (mkdir(d.c_str(), 0777) < 0 && errno != EEXIST) {
+            throw std::runtime_error("Unable to create " + d + ": " + std::strerror(errno));
+        }
+    }
+}
+
+uint64_t ResultCache::key(uint64_t base_hash, uint64_t modified_hash) const
+{
+    uint64_t hashes[] = {base_hash, modified_hash};
+    return hash64(hashes, sizeof(hashes), version_);
+}
+
+std::string ResultCache::path(uint64_t key) const
+{
+    char name[22];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".xml", key);
+    return dir_ + "/" + name;
+}
+
+bool ResultCache::fetch(uint64_t key, std::ostream& out) const
+{
+    std::ifstream ifs(path(key), std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+
+    // an empty entry is a valid diff, but rdbuf() would fail on it
+    if (ifs.peek() == std::ifstream::traits_type::eof()) {
+        return true;
+    }
+
+    return static_cast<bool>(out << ifs.rdbuf());
+}
+
+Expected<void> ResultCache::store(uint64_t key, const std::string& mml) const
+{
+    return write_file_atomically(path(key), mml);
+}
+
+uint64_t ResultCache::fragment_key(uint64_t what, uint64_t base_hash, uint64_t modified_hash) const
+{
+    uint64_t hashes[] = {what, base_hash, modified_hash};
+    return hash64(hashes, sizeof(hashes), version_);
+}
+
+std::string ResultCache::fragment_path(uint64_t key) const
+{
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016" PRIx64, key);
+    return dir_ + "/fragments/" + name;
+}
+
+bool ResultCache::fetch_fragment(uint64_t key, std::string& data) const
+{
+    std::ifstream ifs(fragment_path(key), std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+
+    data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return !ifs.bad();
+}
+
+Expected<void> ResultCache::store_fragment(uint64_t key, const std::string& data) const
+{
+    return write_file_atomically(fragment_path(key), data);
+}
@@ -0,0 +1,60 @@
+/*
+    cache.h: on-disk cache of diff results
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "expected.h"
+
+// finished diffs in a directory, one file each, named after a key built
+// from everything that decides the output: the tool's output format
+// version, such as "resdiff output 1", and the contents of both inputs.
+// Entries are written atomically, so several runs may share the directory
+class ResultCache {
+public:
+    // version must be bumped whenever the tool's MML output changes, or
+    // stale entries will be served; creates dir if need be, throwing
+    // std::runtime_error if it cannot
+    ResultCache(const std::string& dir, const std::string& version);
+
+    uint64_t key(uint64_t base_hash, uint64_t modified_hash) const;
+
+    // copies the entry for key to out; false if there is none
+    bool fetch(uint64_t key, std::ostream& out) const;
+
+    Expected<void> store(uint64_t key, const std::string& mml) const;
+
+    // pieces of results, for a tool that can build a result from parts
+    // that depend on less than its whole input. what names the part
+    uint64_t fragment_key(uint64_t what, uint64_t base_hash, uint64_t modified_hash) const;
+    bool fetch_fragment(uint64_t key, std::string& data) const;
+    Expected<void> store_fragment(uint64_t key, const std::string& data) const;
+
+private:
+    std::string path(uint64_t key) const;
+    std::string fragment_path(uint64_t key) const;
+
+    std::string dir_;
+    uint64_t version_;
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+    container.cpp: locating the resource fork in Macintosh file containers
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "container.h"
+
+#include <boost/crc.hpp>
+#include <boost/endian/conversion.hpp>
+
+#include "binhex.h"
+
+using namespace boost::endian;
+
+namespace {
+
+const uint32_t apple_single_magic = 0x00051600;
+const uint32_t apple_double_magic = 0x00051607;
+const uint32_t apple_data_fork_entry = 1;
+const uint32_t apple_resource_fork_entry = 2;
+
+bool has_macbinary_magic(const uint8_t* header)
+{
+    return !header[0] && header[1] <= 63 && !header[74] && header[123] <= 0x81;
+}
+
+// AppleSingle and AppleDouble share a layout: magic, version, 16 bytes of
+// filler, an entry count, then id, offset and length for each entry
+Expected<ContainerForks> apple_forks(Span file, Container container)
+{
+    if (file.size < 26) {
+        return Error{"AppleSingle header not long enough", 0};
+    }
+
+    auto num_entries = load_big_u16(file.data + 24);
+    if (26 + num_entries * 12u > file.size) {
+        return Error{"AppleSingle entries extend past end of file", 26};
+    }
+
+    ContainerForks forks{container, Span{nullptr, 0}, Span{nullptr, 0}, false};
+    auto found_resource_fork = false;
+
+    for (auto i = 0; i < num_entries; ++i) {
+        auto entry = file.data + 26 + i * 12;
+        auto id = load_big_u32(entry);
+        if (id != apple_data_fork_entry && id != apple_resource_fork_entry) {
+            continue;
+        }
+
+        uint64_t offset = load_big_u32(entry + 4);
+        uint64_t length = load_big_u32(entry + 8);
+        if (offset + length > file.size) {
+            return Error{"Fork extends past end of file", entry - file.data};
+        }
+
+        Span fork{file.data + offset, static_cast<std::size_t>(length)};
+        if (id == apple_data_fork_entry) {
+            forks.data = fork;
+        } else {
+            forks.resource = fork;
+            found_resource_fork = true;
+        }
+    }
+
+    if (!found_resource_fork) {
+        return Error{"AppleSingle file has no resource fork", 24};
+    }
+
+    return forks;
+}
+
+// a bare fork has no magic, so check that its header describes data and a
+// map that fit, in order, within the file
+bool is_resource_fork(Span file)
+{
+    if (file.size < 16 + 30) {
+        return false;
+    }
+
+    uint64_t data_offset = load_big_u32(file.data);
+    uint64_t map_offset = load_big_u32(file.data + 4);
+    uint64_t data_length = load_big_u32(file.data + 8);
+    uint64_t map_length = load_big_u32(file.data + 12);
+
+    return data_offset >= 16 &&
+        map_length >= 30 &&
+        data_offset + data_length <= map_offset &&
+        map_offset + map_length <= file.size;
+}
+
+}
+
+const char* container_name(Container container)
+{
+    switch (container) {
+    case Container::MacBinary:
+        return "MacBinary";
+    case Container::BinHex:
+        return "BinHex";
+    case Container::AppleSingle:
+        return "AppleSingle";
+    case Container::AppleDouble:
+        return "AppleDouble";
+    case Container::ResourceFork:
+        return "resource fork";
+    }
+
+    return "unknown";
+}
+
+bool is_macbinary(const uint8_t* header)
+{
+    if (!has_macbinary_magic(header)) {
+        return false;
+    }
+
+    boost::crc_optimal<16, 0x1021, 0, 0, false, false> crc;
+    crc.process_bytes(header, 124);
+    return crc.checksum() == ((header[124] << 8) | header[125]);
+}
+
+ForkExtent macbinary_resource_fork(const uint8_t* header)
+{
+    uint64_t data_length = load_big_u32(header + 83);
+    uint64_t resource_length = load_big_u32(header + 87);
+
+    return ForkExtent{macbinary_header_size + ((data_length + 0x7f) & ~0x7fULL), resource_length};
+}
+
+Expected<ContainerForks> find_forks(Span file, std::vector<uint8_t>& buffer)
+{
+    if (file.size >= 4 && load_big_u32(file.data) == apple_single_magic) {
+        return apple_forks(file, Container::AppleSingle);
+    }
+
+    if (file.size >= 4 && load_big_u32(file.data) == apple_double_magic) {
+        return apple_forks(file, Container::AppleDouble);
+    }
+
+    if (file.size >= macbinary_header_size && is_macbinary(file.data)) {
+        auto fork = macbinary_resource_fork(file.data);
+        uint64_t data_length = load_big_u32(file.data + 83);
+        if (fork.offset + fork.length > file.size ||
+            macbinary_header_size + data_length > file.size)
+        {
+            return Error{"Fork extends past end of file", 83};
+        }
+
+        return ContainerForks{
+            Container::MacBinary,
+            Span{file.data + macbinary_header_size, static_cast<std::size_t>(data_length)},
+            Span{file.data + fork.offset, static_cast<std::size_t>(fork.length)},
+            true
+        };
+    }
+
+    // MacBinary always starts with a zero byte, BinHex never does
+    if (file.size && file.data[0] && is_binhex(file)) {
+        ContainerForks forks{Container::BinHex, Span{nullptr, 0}, Span{nullptr, 0}, true};
+        auto resource = decode_binhex(file, buffer, &forks.data);
+        if (!resource) {
+            return resource.error();
+        }
+
+        forks.resource = *resource;
+        return forks;
+    }
+
+    if (is_resource_fork(file)) {
+        return ContainerForks{Container::ResourceFork, Span{nullptr, 0}, file, false};
+    }
+
+    if (file.size >= macbinary_header_size && has_macbinary_magic(file.data)) {
+        return Error{"Header CRC mismatch", 124};
+    }
+
+    return Error{"Unrecognized file format"};
+}
@@ -0,0 +1,68 @@
+/*
+    container.h: locating the resource fork in Macintosh file containers
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+enum class Container {
+    MacBinary,
+    BinHex,
+    AppleSingle,
+    AppleDouble,
+    ResourceFork
+};
+
+const char* container_name(Container container);
+
+const std::size_t macbinary_header_size = 128;
+
+// true if header is a MacBinary II header with a valid CRC
+bool is_macbinary(const uint8_t* header);
+
+struct ForkExtent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// where the resource fork follows a MacBinary header
+ForkExtent macbinary_resource_fork(const uint8_t* header);
+
+struct ContainerForks {
+    Container container;
+
+    // empty where the container carries none, as with AppleDouble
+    Span data;
+    Span resource;
+
+    // MacBinary and BinHex headers carry a CRC, which has been checked
+    bool header_checked;
+};
+
+// identifies the container by its magic number and returns its forks;
+// BinHex is decoded into buffer, the others are returned in place. Fails
+// if the format is not recognized or a fork lies outside the file
+Expected<ContainerForks> find_forks(Span file, std::vector<uint8_t>& buffer);
+
+#endif
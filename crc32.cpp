@@ -0,0 +1,75 @@
+/*
+    crc32.cpp: CRC-32 (as used by zip and zlib)
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "crc32.h"
+
+namespace {
+
+// tables[k][b] is the CRC of byte b followed by k zero bytes, so eight
+// input bytes can be folded in with eight independent lookups
+struct Tables {
+    Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (auto j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+            }
+            tables[0][i] = crc;
+        }
+
+        for (auto i = 0; i < 256; ++i) {
+            for (auto k = 1; k < 8; ++k) {
+                tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xff];
+            }
+        }
+    }
+
+    uint32_t tables[8][256];
+};
+
+const Tables tables;
+
+}
+
+uint32_t crc32(const void* data, std::size_t length, uint32_t crc)
+{
+    auto& t = tables.tables;
+    auto p = static_cast<const uint8_t*>(data);
+
+    crc = ~crc;
+
+    while (length >= 8) {
+        auto lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+        auto hi = p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<uint32_t>(p[7]) << 24);
+
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+            t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+            t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+        p += 8;
+        length -= 8;
+    }
+
+    while (length--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+
+    return ~crc;
+}
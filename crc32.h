@@ -0,0 +1,29 @@
+/*
+    crc32.h: CRC-32 (as used by zip and zlib)
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+
+// slice-by-8; pass the previous result as crc to continue a running CRC
+uint32_t crc32(const void* data, std::size_t length, uint32_t crc = 0);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+    daemon.cpp: serves diffs against resident bases over a Unix socket
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+using namespace boost::endian;
+
+// more than any engine; a longer frame is taken for garbage
+static const uint32_t max_request_size = 256 * 1024 * 1024;
+
+enum ResponseStatus : uint8_t {
+    response_ok,
+    response_error,
+};
+
+static bool read_fully(int fd, void* data, std::size_t size)
+{
+    auto p = static_cast<uint8_t*>(data);
+    while (size) {
+        auto n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_fully(int fd, const void* data, std::size_t size)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    while (size) {
+        auto n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool respond(int fd, ResponseStatus status, const std::string& body)
+{
+    uint8_t header[5];
+    store_little_u32(header, body.size() + 1);
+    header[4] = status;
+    return write_fully(fd, header, sizeof(header)) && write_fully(fd, body.data(), body.size());
+}
+
+static Expected<std::string> handle(const std::vector<uint8_t>& request, const DaemonHandlers& handlers)
+{
+    if (request.empty()) {
+        return Error{"Empty request"};
+    }
+
+    if (request[0] == 'r') {
+        auto reloaded = handlers.reload();
+        if (!reloaded) {
+            return reloaded.error();
+        }
+        return std::string{};
+    }
+
+    if (request[0] != 'd') {
+        return Error{"Unknown request '" + std::string(1, request[0]) + "'"};
+    }
+
+    if (request.size() < 3 || request.size() < 3u + load_little_u16(&request[1])) {
+        return Error{"Request truncated"};
+    }
+
+    auto name_size = load_little_u16(&request[1]);
+    std::string base(reinterpret_cast<const char*>(&request[3]), name_size);
+    Span modified{request.data() + 3 + name_size, request.size() - 3 - name_size};
+
+    try {
+        return handlers.diff(base, modified);
+    } catch (const std::exception& e) {
+        return Error{e.what()};
+    }
+}
+
+// answers requests until the client hangs up or sends garbage
+static void serve(int fd, const DaemonHandlers& handlers)
+{
+    std::vector<uint8_t> request;
+    for (;;) {
+        uint8_t header[4];
+        if (!read_fully(fd, header, sizeof(header))) {
+            return;
+        }
+
+        auto size = load_little_u32(header);
+        if (size > max_request_size) {
+            respond(fd, response_error, "Request too large");
+            return;
+        }
+
+        request.resize(size);
+        if (!read_fully(fd, request.data(), size)) {
+            return;
+        }
+
+        auto result = handle(request, handlers);
+        auto sent = result ? respond(fd, response_ok, *result) : respond(fd, response_error, result.error().message());
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+int run_daemon(const std::string& path, unsigned threads, const DaemonHandlers& handlers)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << path << ": socket path too long\n";
+        return -1;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    // a socket left by a daemon that did not shut down cleanly
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0)
+    {
+        std::cerr << path << ": " << std::strerror(errno) << "\n";
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+
+    // the signals are taken by sigwait() below, not by whichever thread
+    // the kernel picks; workers inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigset_t old_mask;
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+
+    std::atomic<bool> stopping{false};
+    std::mutex clients_mutex;
+    std::set<int> clients;
+
+    std::vector<std::thread> workers;
+    for (auto i = 0u; i < std::max(1u, threads); ++i) {
+        workers.emplace_back([&]() {
+            while (!stopping) {
+                auto fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    continue;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock{clients_mutex};
+                    if (stopping) {
+                        close(fd);
+                        break;
+                    }
+                    clients.insert(fd);
+                }
+
+                serve(fd, handlers);
+
+                std::lock_guard<std::mutex> lock{clients_mutex};
+                clients.erase(fd);
+                close(fd);
+            }
+        });
+    }
+
+    for (;;) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+
+        if (signal == SIGHUP) {
+            auto reloaded = handlers.reload();
+            if (!reloaded) {
+                std::cerr << "Reload failed: " << reloaded.error().message() << "\n";
+            }
+            continue;
+        }
+
+        break;
+    }
+
+    // wakes workers blocked in accept() and in reads from clients
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        stopping = true;
+        for (auto fd : clients) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    shutdown(listener, SHUT_RDWR);
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    close(listener);
+    unlink(path.c_str());
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    return 0;
+}
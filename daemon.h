@@ -0,0 +1,124 @@
+/*
+    daemon.h: serves diffs against resident bases over a Unix socket
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+#include "sketch.h"
+
+// what a daemon does for each request. Both may be called from several
+// threads at once
+struct DaemonHandlers {
+    // MML turning the base named, or the nearest one if the name is
+    // empty, into modified
+    std::function<Expected<std::string>(const std::string& base, Span modified)> diff;
+
+    // reads the bases afresh
+    std::function<Expected<void>()> reload;
+};
+
+// serves requests on a Unix socket at path until SIGINT or SIGTERM, with
+// threads workers each taking connections in turn; SIGHUP reloads.
+// Requests and responses are frames: a little-endian u32 length, then
+// that many bytes. A request is 'd', a little-endian u16 length and the
+// base name, then the modified file; or 'r' to reload. A response is 0
+// and the MML, or 1 and an error message. A connection may carry any
+// number of requests, answered in order
+int run_daemon(const std::string& path, unsigned threads, const DaemonHandlers& handlers);
+
+// bases parsed once and kept for every request. A reload reads them all
+// into a new set and swaps it in, so requests under way finish with the
+// set they started with, and a reload that fails leaves the old set
+template <typename T>
+class ResidentBases {
+public:
+    // parses the base at path, and sketches it
+    using Loader = std::function<Expected<std::unique_ptr<T>>(const std::string& path, Sketch& sketch)>;
+
+    struct Set {
+        std::vector<std::string> names;
+        std::vector<std::unique_ptr<T>> bases;
+        SketchIndex index;
+
+        // the base named, or the one nearest sketch if name is empty;
+        // nullptr if there is none
+        T* find(const std::string& name, const Sketch& sketch) const
+        {
+            if (name.empty()) {
+                auto i = index.nearest(sketch);
+                return i < 0 ? nullptr : bases[i].get();
+            }
+
+            for (auto i = 0u; i < names.size(); ++i) {
+                if (names[i] == name) {
+                    return bases[i].get();
+                }
+            }
+
+            return nullptr;
+        }
+    };
+
+    ResidentBases(std::vector<std::string> paths, Loader loader) : paths_{std::move(paths)}, loader_{std::move(loader)} { }
+
+    Expected<void> reload()
+    {
+        std::lock_guard<std::mutex> lock{reload_mutex_};
+
+        std::shared_ptr<Set> set{new Set};
+        for (auto& path : paths_) {
+            if (std::find(set->names.begin(), set->names.end(), path) != set->names.end()) {
+                continue;
+            }
+
+            Sketch sketch;
+            auto base = loader_(path, sketch);
+            if (!base) {
+                return Error{path + ": " + base.error().message()};
+            }
+
+            set->names.push_back(path);
+            set->bases.push_back(std::move(*base));
+            set->index.add(path, sketch);
+        }
+
+        std::atomic_store(&set_, std::shared_ptr<const Set>{set});
+        return Expected<void>{};
+    }
+
+    std::shared_ptr<const Set> current() const { return std::atomic_load(&set_); }
+
+private:
+    std::vector<std::string> paths_;
+    Loader loader_;
+    std::mutex reload_mutex_;
+    std::shared_ptr<const Set> set_;
+};
+
+#endif
@@ -0,0 +1,498 @@
+/*
+    dcmp.cpp: decompression of System 7 compressed resources
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "dcmp.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/endian/conversion.hpp>
+
+using namespace boost::endian;
+
+namespace {
+
+const uint32_t compressed_signature = 0xa89f6572;
+const std::size_t compressed_header_size = 18;
+
+// two-byte constants for 'dcmp' (0) codes 0x4b through 0xfd, mostly
+// common 68k instruction words
+const uint16_t dcmp0_table[] = {
+    0x0000, 0x4eba, 0x0008, 0x4e75, 0x000c, 0x4ead, 0x2053, 0x2f0b,
+    0x6100, 0x0010, 0x7000, 0x2f00, 0x486e, 0x2050, 0x206e, 0x2f2e,
+    0xfffc, 0x48e7, 0x3f3c, 0x0004, 0xfff8, 0x2f0c, 0x2006, 0x4eed,
+    0x4e56, 0x2068, 0x4e5e, 0x0001, 0x588f, 0x4fef, 0x0002, 0x0018,
+    0x6000, 0xffff, 0x508f, 0x4e90, 0x0006, 0x266e, 0x0014, 0xfff4,
+    0x4cee, 0x000a, 0x000e, 0x41ee, 0x4cdf, 0x48c0, 0xfff0, 0x2d40,
+    0x0012, 0x302e, 0x7001, 0x2f28, 0x2054, 0x6700, 0x0020, 0x001c,
+    0x205f, 0x1800, 0x266f, 0x4878, 0x0016, 0x41fa, 0x303c, 0x2840,
+    0x7200, 0x286e, 0x200c, 0x6600, 0x206b, 0x2f07, 0x558f, 0x0028,
+    0xfffe, 0xffec, 0x22d8, 0x200b, 0x000f, 0x598f, 0x2f3c, 0xff00,
+    0x0118, 0x81e1, 0x4a00, 0x4eb0, 0xffe8, 0x48c7, 0x0003, 0x0022,
+    0x0007, 0x001a, 0x6706, 0x6708, 0x4ef9, 0x0024, 0x2078, 0x0800,
+    0x6604, 0x002a, 0x4ed0, 0x3028, 0x265f, 0x6704, 0x0030, 0x43ee,
+    0x3f00, 0x201f, 0x001e, 0xfff6, 0x202e, 0x42a7, 0x2007, 0xfffa,
+    0x6002, 0x3d40, 0x0c40, 0x6606, 0x0026, 0x2d48, 0x2f01, 0x70ff,
+    0x6004, 0x1880, 0x4a40, 0x0040, 0x002c, 0x2f08, 0x0011, 0xffe4,
+    0x2140, 0x2640, 0xfff2, 0x426e, 0x4eb9, 0x3d7c, 0x0038, 0x000d,
+    0x6006, 0x422e, 0x203c, 0x670c, 0x2d68, 0x6608, 0x4a2e, 0x4aae,
+    0x002e, 0x4840, 0x225f, 0x2200, 0x670a, 0x3007, 0x4267, 0x0032,
+    0x2028, 0x0009, 0x487a, 0x0200, 0x2f2b, 0x0005, 0x226e, 0x6602,
+    0xe580, 0x670e, 0x660a, 0x0050, 0x3e00, 0x660c, 0x2e00, 0xffee,
+    0x206d, 0x2040, 0xffe0, 0x5340, 0x6008, 0x0480, 0x0068, 0x0b7c,
+    0x4400, 0x41e8, 0x4841,
+};
+
+// two-byte constants for 'dcmp' (1) codes 0xd5 through 0xfd
+const uint16_t dcmp1_table[] = {
+    0x0000, 0x0001, 0x0002,
+    0x0003, 0x2e01, 0x3e01, 0x0101, 0x1e01, 0xffff, 0x0e01, 0x3100,
+    0x1112, 0x0107, 0x3332, 0x1239, 0xed10, 0x0127, 0x2322, 0x0137,
+    0x0706, 0x0117, 0x0123, 0x00ff, 0x002f, 0x070e, 0xfd3c, 0x0135,
+    0x0115, 0x0102, 0x0007, 0x003e, 0x05d5, 0x0201, 0x0607, 0x0708,
+    0x3001, 0x0133, 0x0010, 0x1716, 0x373e, 0x3637,
+};
+
+// the table 'dcmp' (2) uses when the resource does not carry its own
+const uint16_t dcmp2_default_table[] = {
+    0x0000, 0x0008, 0x4eba, 0x206e, 0x4e75, 0x000c, 0x0004, 0x7000,
+    0x0010, 0x0002, 0x486e, 0xfffc, 0x6000, 0x0001, 0x48e7, 0x2f2e,
+    0x4e56, 0x0006, 0x4e5e, 0x2f00, 0x6100, 0xfff8, 0x2f0b, 0xffff,
+    0x0014, 0x000a, 0x0018, 0x205f, 0x000e, 0x2050, 0x3f3c, 0xfff4,
+    0x4cee, 0x302e, 0x6700, 0x4cdf, 0x266e, 0x0012, 0x001c, 0x4267,
+    0xfff0, 0x303c, 0x2f0c, 0x0003, 0x4ed0, 0x0020, 0x7001, 0x0016,
+    0x2d40, 0x48c0, 0x2078, 0x7200, 0x588f, 0x6600, 0x4fef, 0x42a7,
+    0x6706, 0xfffa, 0x558f, 0x286e, 0x3f00, 0xfffe, 0x2f3c, 0x6704,
+    0x598f, 0x206b, 0x0024, 0x201f, 0x41fa, 0x81e1, 0x6604, 0x6708,
+    0x001a, 0x4eb9, 0x508f, 0x202e, 0x0007, 0x4eb0, 0xfff2, 0x3d40,
+    0x001e, 0x2068, 0x6606, 0xfff6, 0x4ef9, 0x0800, 0x0c40, 0x3d7c,
+    0xffec, 0x0005, 0x203c, 0xffe8, 0xdefc, 0x4a2e, 0x0030, 0x0028,
+    0x2f08, 0x200b, 0x6002, 0x426e, 0x2d48, 0x2053, 0x2040, 0x1800,
+    0x6004, 0x41ee, 0x2f28, 0x2f01, 0x670a, 0x4840, 0x2007, 0x6608,
+    0x0118, 0x2f07, 0x3028, 0x3f2e, 0x302b, 0x226e, 0x2f2b, 0x002c,
+    0x670c, 0x225f, 0x6006, 0x00ff, 0x3007, 0xffee, 0x5340, 0x0040,
+    0xffe4, 0x4a40, 0x660a, 0x000f, 0x4ead, 0x70ff, 0x22d8, 0x486b,
+    0x0022, 0x204b, 0x670e, 0x4aae, 0x4e90, 0xffe0, 0xffc0, 0x002a,
+    0x2740, 0x6702, 0x51c8, 0x02b6, 0x487a, 0x2278, 0xb06e, 0xffe6,
+    0x0009, 0x322e, 0x3e00, 0x4841, 0xffea, 0x43ee, 0x4e71, 0x7400,
+    0x2f2c, 0x206c, 0x003c, 0x0026, 0x0050, 0x1880, 0x301f, 0x2200,
+    0x660c, 0xffda, 0x0038, 0x6602, 0x302c, 0x200c, 0x2d6e, 0x4240,
+    0xffe2, 0xa9f0, 0xff00, 0x377c, 0xe580, 0xffdc, 0x4868, 0x594f,
+    0x0034, 0x3e1f, 0x6008, 0x2f06, 0xffde, 0x600a, 0x7002, 0x0032,
+    0xffcc, 0x0080, 0x2251, 0x101f, 0x317c, 0xa029, 0xffd8, 0x5240,
+    0x0100, 0x6710, 0xa023, 0xffce, 0xffd4, 0x2006, 0x4878, 0x002e,
+    0x504f, 0x43fa, 0x6712, 0x7600, 0x41e8, 0x4a6e, 0x20d9, 0x005a,
+    0x7fff, 0x51ca, 0x005c, 0x2e00, 0x0240, 0x48c7, 0x6714, 0x0c80,
+    0x2e9f, 0xffd6, 0x8000, 0x1000, 0x4842, 0x4a6b, 0xffd2, 0x0048,
+    0x4a47, 0x4ed1, 0x206f, 0x0041, 0x600c, 0x2a78, 0x422e, 0x3200,
+    0x6574, 0x6716, 0x0044, 0x486d, 0x2008, 0x486c, 0x0b7c, 0x2640,
+    0x0400, 0x0068, 0x206d, 0x000d, 0x2a40, 0x000b, 0x003e, 0x0220,
+};
+
+static_assert(sizeof(dcmp0_table) / sizeof(dcmp0_table[0]) == 0xfe - 0x4b, "dcmp 0 table size");
+static_assert(sizeof(dcmp1_table) / sizeof(dcmp1_table[0]) == 0xfe - 0xd5, "dcmp 1 table size");
+static_assert(sizeof(dcmp2_default_table) / sizeof(dcmp2_default_table[0]) == 256, "dcmp 2 default table size");
+
+// 'dcmp' (0) and (1) can repeat a value any number of times, so nothing
+// in the compressed data bounds their output; no resource needs more than
+// the 16 MB a resource fork's 24-bit data offsets can address
+const std::size_t max_decompressed_size = 16 * 1024 * 1024;
+
+// what the extended header says, once it has been checked
+struct CompressedHeader {
+    std::size_t header_size;
+    uint8_t version;
+    int16_t dcmp;
+    std::size_t size;
+};
+
+class Decompressor {
+public:
+    Decompressor(const uint8_t* in, const uint8_t* in_end, uint8_t* out, std::size_t out_size) :
+        in_{in}, in_end_{in_end}, out_begin_{out}, out_{out}, out_end_{out + out_size} { }
+
+    void dcmp0();
+    void dcmp1();
+    void dcmp2(const uint16_t* table, std::size_t table_size, bool tagged);
+
+    bool complete() const { return out_ == out_end_; }
+    const uint8_t* position() const { return in_; }
+
+private:
+    struct Literal {
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    // malformed data is rare enough that the decoding loops stay simple
+    // and throw; decompress_resource() turns it into an Error
+    [[noreturn]] void fail(const char* what) {
+        throw std::runtime_error(std::string{"Compressed resource: "} + what);
+    }
+
+    uint8_t byte() {
+        if (in_ >= in_end_) {
+            fail("unexpected end of data");
+        }
+        return *in_++;
+    }
+
+    const uint8_t* bytes(std::size_t count) {
+        if (static_cast<std::size_t>(in_end_ - in_) < count) {
+            fail("unexpected end of data");
+        }
+        auto p = in_;
+        in_ += count;
+        return p;
+    }
+
+    // one byte for 0..127, two for a signed 14-bit value, or 0xff and a
+    // signed 32-bit value
+    int32_t varint() {
+        auto head = byte();
+        if (head == 0xff) {
+            return load_big_s32(bytes(4));
+        } else if (head >= 0x80) {
+            return static_cast<int16_t>((((head - 0xc0) & 0xff) << 8) | byte());
+        } else {
+            return head;
+        }
+    }
+
+    uint8_t* reserve(std::size_t count) {
+        if (static_cast<std::size_t>(out_end_ - out_) < count) {
+            fail("data longer than header claims");
+        }
+        auto p = out_;
+        out_ += count;
+        return p;
+    }
+
+    void put(const uint8_t* p, std::size_t count) {
+        std::memcpy(reserve(count), p, count);
+    }
+
+    void put16(uint16_t value) {
+        store_big_u16(reserve(2), value);
+    }
+
+    void put32(uint32_t value) {
+        store_big_u32(reserve(4), value);
+    }
+
+    // literals flagged for reuse are remembered by position in the output
+    void literal(std::size_t count, bool remember) {
+        if (remember) {
+            literals_.push_back(Literal{static_cast<std::size_t>(out_ - out_begin_), count});
+        }
+        put(bytes(count), count);
+    }
+
+    void backreference(std::size_t index) {
+        if (index >= literals_.size()) {
+            fail("reference to unknown literal");
+        }
+        // the source is complete output, so it cannot overlap the copy
+        auto& literal = literals_[index];
+        put(out_begin_ + literal.offset, literal.size);
+    }
+
+    void repeat(uint32_t value, std::size_t width, int32_t count) {
+        if (count <= 0) {
+            fail("invalid repeat count");
+        }
+        for (auto i = 0; i < count; ++i) {
+            if (width == 1) {
+                *reserve(1) = value;
+            } else {
+                put16(value);
+            }
+        }
+    }
+
+    const uint8_t* in_;
+    const uint8_t* in_end_;
+    uint8_t* out_begin_;
+    uint8_t* out_;
+    uint8_t* out_end_;
+    std::vector<Literal> literals_;
+};
+
+void Decompressor::dcmp0()
+{
+    for (;;) {
+        auto code = byte();
+
+        if (code < 0x20) {
+            // literal words; 0x10 and up are remembered
+            std::size_t count = code & 0x0f;
+            if (count == 0) {
+                count = byte();
+            }
+            literal(count * 2, code >= 0x10);
+        } else if (code < 0x22) {
+            backreference(0x28 + (((code - 0x20) << 8) | byte()));
+        } else if (code == 0x22) {
+            backreference(0x28 + load_big_u16(bytes(2)));
+        } else if (code < 0x4b) {
+            backreference(code - 0x23);
+        } else if (code < 0xfe) {
+            put16(dcmp0_table[code - 0x4b]);
+        } else if (code == 0xfe) {
+            auto kind = byte();
+            if (kind == 0x00) {
+                // a run of segment loader jump table entries for one
+                // segment; the first entry's offset was already written
+                auto segment = varint();
+                auto count = varint();
+                if (count <= 0) {
+                    fail("invalid jump table count");
+                }
+                for (auto i = 0; i < count; ++i) {
+                    if (i) {
+                        put16(varint());
+                    }
+                    put16(0x3f3c);
+                    put16(segment);
+                    put16(0xa9f0);
+                }
+            } else if (kind == 0x02 || kind == 0x03) {
+                auto value = varint();
+                repeat(value, kind == 0x02 ? 1 : 2, varint() + 1);
+            } else if (kind == 0x04) {
+                // words stored as signed byte differences from the last
+                uint16_t value = varint();
+                auto count = varint();
+                if (count < 0) {
+                    fail("invalid difference count");
+                }
+                put16(value);
+                for (auto i = 0; i < count; ++i) {
+                    value += static_cast<int8_t>(byte());
+                    put16(value);
+                }
+            } else if (kind == 0x06) {
+                // longs stored as varint differences from the last
+                uint32_t value = varint();
+                auto count = varint();
+                if (count < 0) {
+                    fail("invalid difference count");
+                }
+                put32(value);
+                for (auto i = 0; i < count; ++i) {
+                    value += varint();
+                    put32(value);
+                }
+            } else {
+                fail("unknown extended code");
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+void Decompressor::dcmp1()
+{
+    for (;;) {
+        auto code = byte();
+
+        if (code < 0x20) {
+            // literal bytes; 0x10 and up are remembered
+            literal((code & 0x0f) + 1, code >= 0x10);
+        } else if (code < 0xd0) {
+            backreference(code - 0x20);
+        } else if (code == 0xd0 || code == 0xd1) {
+            literal(byte(), code == 0xd1);
+        } else if (code == 0xd2) {
+            backreference(0xb0 + byte());
+        } else if (code >= 0xd5 && code < 0xfe) {
+            put16(dcmp1_table[code - 0xd5]);
+        } else if (code == 0xfe) {
+            if (byte() != 0x02) {
+                fail("unknown extended code");
+            }
+            auto value = byte();
+            repeat(value, 1, varint() + 1);
+        } else if (code == 0xff) {
+            return;
+        } else {
+            fail("unknown code");
+        }
+    }
+}
+
+void Decompressor::dcmp2(const uint16_t* table, std::size_t table_size, bool tagged)
+{
+    // output is words, each either a table index byte or a literal; an
+    // odd final byte is always literal
+    auto odd = (out_end_ - out_begin_) & 1;
+
+    auto reference = [&] {
+        auto index = byte();
+        if (index >= table_size) {
+            fail("reference past end of table");
+        }
+        put16(table[index]);
+    };
+
+    while (in_ < in_end_) {
+        if (odd && in_end_ - in_ == 1) {
+            put(bytes(1), 1);
+            break;
+        }
+
+        if (!tagged) {
+            reference();
+            continue;
+        }
+
+        auto tag = byte();
+        for (auto bit = 0x80; bit && in_ < in_end_; bit >>= 1) {
+            if (tag & bit) {
+                reference();
+            } else {
+                auto count = std::min<std::size_t>(2, in_end_ - in_);
+                put(bytes(count), count);
+            }
+        }
+    }
+}
+
+}
+
+bool is_compressed_resource(Span resource)
+{
+    return resource.size >= compressed_header_size &&
+        load_big_u32(resource.data) == compressed_signature;
+}
+
+static Expected<CompressedHeader> read_header(Span resource)
+{
+    CompressedHeader header;
+    header.header_size = load_big_u16(resource.data + 4);
+    header.version = resource.data[6];
+    header.size = load_big_u32(resource.data + 8);
+
+    if (header.header_size < compressed_header_size || header.header_size > resource.size) {
+        return Error{"Compressed resource: invalid header length", 4};
+    }
+
+    if (header.version == 8) {
+        header.dcmp = load_big_s16(resource.data + 14);
+    } else if (header.version == 9) {
+        header.dcmp = load_big_s16(resource.data + 12);
+    } else {
+        return Error{"Compressed resource: unknown header version", 6};
+    }
+
+    if (!(header.dcmp == 0 || header.dcmp == 1 || (header.dcmp == 2 && header.version == 9))) {
+        std::ostringstream oss;
+        oss << "Compressed resource: unsupported 'dcmp' (" << header.dcmp << ")";
+        return Error{oss.str(), header.version == 8 ? 14 : 12};
+    }
+
+    // 'dcmp' (2) writes at most two bytes for each byte it reads
+    auto limit = header.dcmp == 2 ? 2 * (resource.size - header.header_size) : max_decompressed_size;
+    if (header.size > limit) {
+        return Error{"Compressed resource: decompressed size " + std::to_string(header.size) + " out of range", 8};
+    }
+
+    return header;
+}
+
+Expected<std::size_t> decompressed_size(Span resource)
+{
+    auto header = read_header(resource);
+    if (!header) {
+        return header.error();
+    }
+
+    return header->size;
+}
+
+Expected<void> decompress_resource(Span resource, uint8_t* out)
+{
+    auto header = read_header(resource);
+    if (!header) {
+        return header.error();
+    }
+
+    auto dcmp = header->dcmp;
+    auto size = header->size;
+
+    auto in = resource.data + header->header_size;
+    auto in_end = resource.data + resource.size;
+
+    if (dcmp == 0 || dcmp == 1) {
+        Decompressor decompressor(in, in_end, out, size);
+        try {
+            if (dcmp == 0) {
+                decompressor.dcmp0();
+            } else {
+                decompressor.dcmp1();
+            }
+        } catch (const std::runtime_error& e) {
+            return Error{e.what(), decompressor.position() - resource.data};
+        }
+
+        if (!decompressor.complete()) {
+            return Error{"Compressed resource: data shorter than header claims", static_cast<int64_t>(resource.size)};
+        }
+    } else {
+        // parameters: two unknown bytes, table size less one, flags; the
+        // size only counts for a table carried in the resource
+        std::size_t table_count = resource.data[16] + 1;
+        auto flags = resource.data[17];
+        const bool custom_table = flags & 0x01;
+        const bool tagged = flags & 0x02;
+
+        std::vector<uint16_t> custom;
+        const uint16_t* table = dcmp2_default_table;
+        if (custom_table) {
+            if (static_cast<std::size_t>(in_end - in) < table_count * 2) {
+                return Error{"Compressed resource: table extends past end of data", in - resource.data};
+            }
+
+            for (auto i = 0u; i < table_count; ++i) {
+                custom.push_back(load_big_u16(in + i * 2));
+            }
+            table = custom.data();
+            in += table_count * 2;
+        } else {
+            table_count = 256;
+        }
+
+        Decompressor decompressor(in, in_end, out, size);
+        try {
+            decompressor.dcmp2(table, table_count, tagged);
+        } catch (const std::runtime_error& e) {
+            return Error{e.what(), decompressor.position() - resource.data};
+        }
+
+        if (!decompressor.complete()) {
+            return Error{"Compressed resource: data shorter than header claims", static_cast<int64_t>(resource.size)};
+        }
+    }
+
+    return Expected<void>{};
+}
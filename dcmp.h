@@ -0,0 +1,45 @@
+/*
+    dcmp.h: decompression of System 7 compressed resources
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DCMP_H
+#define DCMP_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+// resources with the compressed attribute start with an extended header
+// naming the 'dcmp' that unpacks them
+const uint8_t resource_compressed_attribute = 0x01;
+
+bool is_compressed_resource(Span resource);
+
+// the size the header gives, once the header has been checked and the
+// size found plausible for the 'dcmp' named, so it is safe to allocate
+Expected<std::size_t> decompressed_size(Span resource);
+
+// unpacks 'dcmp' 0, 1 or 2 compressed data into out, which must have room
+// for decompressed_size(); 'dcmp' (2) may carry its own table or use the
+// system's. Fails if the data is malformed or uses an unsupported 'dcmp'.
+// Error offsets are relative to the resource
+Expected<void> decompress_resource(Span resource, uint8_t* out);
+
+#endif
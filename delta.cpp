@@ -0,0 +1,163 @@
+/*
+    delta.cpp: binary deltas between versions of a resource
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "delta.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#include "varint.h"
+
+// the shortest run worth looking for; shorter matches cost about as much
+// to encode as the bytes themselves
+static const std::size_t block_size = 16;
+
+static const uint32_t rolling_base = 257;
+
+static uint32_t block_hash(const uint8_t* p)
+{
+    uint32_t h = 0;
+    for (auto i = 0u; i < block_size; ++i) {
+        h = h * rolling_base + p[i];
+    }
+
+    return h;
+}
+
+// a run is its length, doubled, plus one if it is copied; copies are
+// followed by their offset in reference, literals by their bytes
+static void put_literal(std::string& out, const uint8_t* p, std::size_t size)
+{
+    if (size) {
+        put_varint(out, size << 1);
+        out.append(reinterpret_cast<const char*>(p), size);
+    }
+}
+
+static void put_copy(std::string& out, std::size_t offset, std::size_t size)
+{
+    put_varint(out, size << 1 | 1);
+    put_varint(out, offset);
+}
+
+std::string make_delta(Span reference, Span target)
+{
+    std::string delta;
+    put_varint(delta, target.size);
+
+    // the first of each distinct block of reference, at block boundaries
+    std::unordered_map<uint32_t, std::size_t> blocks;
+    for (std::size_t offset = 0; offset + block_size <= reference.size; offset += block_size) {
+        blocks.emplace(block_hash(reference.data + offset), offset);
+    }
+
+    // the factor the byte leaving the window was multiplied by
+    uint32_t leaving = 1;
+    for (auto i = 1u; i < block_size; ++i) {
+        leaving *= rolling_base;
+    }
+
+    std::size_t literal = 0;
+    std::size_t i = 0;
+    uint32_t h = target.size >= block_size ? block_hash(target.data) : 0;
+    while (i + block_size <= target.size) {
+        auto found = blocks.find(h);
+        if (found != blocks.end() && std::memcmp(reference.data + found->second, target.data + i, block_size) == 0) {
+            auto r = found->second;
+            auto t = i;
+
+            // take back what the literal run already has, then go on
+            while (r > 0 && t > literal && reference.data[r - 1] == target.data[t - 1]) {
+                --r;
+                --t;
+            }
+
+            auto size = i + block_size - t;
+            while (r + size < reference.size && t + size < target.size && reference.data[r + size] == target.data[t + size]) {
+                ++size;
+            }
+
+            put_literal(delta, target.data + literal, t - literal);
+            put_copy(delta, r, size);
+
+            i = literal = t + size;
+            if (i + block_size <= target.size) {
+                h = block_hash(target.data + i);
+            }
+            continue;
+        }
+
+        if (i + block_size < target.size) {
+            h = (h - target.data[i] * leaving) * rolling_base + target.data[i + block_size];
+        }
+        ++i;
+    }
+
+    put_literal(delta, target.data + literal, target.size - literal);
+    return delta;
+}
+
+Expected<void> apply_delta(Span reference, Span delta, std::vector<uint8_t>& out)
+{
+    auto p = delta.data;
+    auto end = delta.data + delta.size;
+
+    uint64_t size;
+    if (!get_varint(p, end, size)) {
+        return Error{"Delta truncated"};
+    }
+
+    auto start = out.size();
+    while (p != end) {
+        uint64_t run;
+        if (!get_varint(p, end, run)) {
+            return Error{"Delta truncated", p - delta.data};
+        }
+
+        auto length = run >> 1;
+        if (out.size() - start + length > size) {
+            return Error{"Delta overruns its size", p - delta.data};
+        }
+
+        if (run & 1) {
+            uint64_t offset;
+            if (!get_varint(p, end, offset)) {
+                return Error{"Delta truncated", p - delta.data};
+            }
+
+            if (offset > reference.size || length > reference.size - offset) {
+                return Error{"Delta copies from outside its reference", p - delta.data};
+            }
+
+            out.insert(out.end(), reference.data + offset, reference.data + offset + length);
+        } else {
+            if (static_cast<uint64_t>(end - p) < length) {
+                return Error{"Delta truncated", p - delta.data};
+            }
+
+            out.insert(out.end(), p, p + length);
+            p += length;
+        }
+    }
+
+    if (out.size() - start != size) {
+        return Error{"Delta shorter than its size"};
+    }
+
+    return Expected<void>{};
+}
@@ -0,0 +1,39 @@
+/*
+    delta.h: binary deltas between versions of a resource
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+// instructions that rebuild target from reference: the size of target,
+// then runs that are either copied from reference or given literally.
+// Runs are found by hashing every window of target against the blocks of
+// reference, so data that moved is still found. All sizes and offsets are
+// varints
+std::string make_delta(Span reference, Span target);
+
+// appends what delta rebuilds from reference to out
+Expected<void> apply_delta(Span reference, Span delta, std::vector<uint8_t>& out);
+
+#endif
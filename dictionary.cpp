@@ -0,0 +1,333 @@
+/*
+    dictionary.cpp: every string in a corpus of engines, for lookups
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dictionary.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include <boost/endian/conversion.hpp>
+
+#include "batch.h"
+#include "hash.h"
+
+using namespace boost::endian;
+
+static const char dictionary_magic[4] = {'R','S','D','1'};
+static const std::size_t dictionary_header_size = 28;
+static const std::size_t occurrence_size = 12;
+
+uint32_t DictionaryWriter::add_engine(const std::string& name)
+{
+    engines_.push_back(name);
+    return engines_.size() - 1;
+}
+
+void DictionaryWriter::add(uint32_t engine, int32_t stringset, uint32_t index, const std::string& s)
+{
+    auto hash = hash64(s);
+    auto range = interned_.equal_range(hash);
+    auto it = std::find_if(range.first, range.second, [&](const std::pair<const uint64_t, uint32_t>& entry) {
+        auto& interned = strings_[entry.second];
+        return interned.size == s.size() && std::memcmp(interned.data, s.data(), s.size()) == 0;
+    });
+
+    uint32_t id;
+    if (it != range.second) {
+        id = it->second;
+    } else {
+        auto p = arena_.allocate(s.size());
+        std::memcpy(p, s.data(), s.size());
+
+        id = strings_.size();
+        strings_.push_back(Span{p, s.size()});
+        occurrences_.emplace_back();
+        interned_.emplace(hash, id);
+    }
+
+    occurrences_[id].push_back(StringOccurrence{engine, stringset, index});
+}
+
+static void put_u32(std::string& out, uint32_t value)
+{
+    uint8_t buf[4];
+    store_little_u32(buf, value);
+    out.append(reinterpret_cast<char*>(buf), sizeof(buf));
+}
+
+Expected<void> DictionaryWriter::write(const std::string& path) const
+{
+    std::vector<uint32_t> order(strings_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        auto& x = strings_[a];
+        auto& y = strings_[b];
+        auto result = std::memcmp(x.data, y.data, std::min(x.size, y.size));
+        return result ? result < 0 : x.size < y.size;
+    });
+
+    std::string engine_offsets, engine_blob;
+    for (auto& engine : engines_) {
+        put_u32(engine_offsets, engine_blob.size());
+        engine_blob += engine;
+    }
+    put_u32(engine_offsets, engine_blob.size());
+
+    std::string string_offsets, occurrence_offsets, occurrences, text;
+    uint32_t occurrence_count = 0;
+    for (auto id : order) {
+        put_u32(string_offsets, text.size());
+        text.append(reinterpret_cast<const char*>(strings_[id].data), strings_[id].size);
+        text.push_back('\0');
+
+        put_u32(occurrence_offsets, occurrence_count);
+        for (auto& occurrence : occurrences_[id]) {
+            put_u32(occurrences, occurrence.engine);
+            put_u32(occurrences, occurrence.stringset);
+            put_u32(occurrences, occurrence.index);
+            ++occurrence_count;
+        }
+    }
+    put_u32(string_offsets, text.size());
+    put_u32(occurrence_offsets, occurrence_count);
+
+    if (text.size() > UINT32_MAX || engine_blob.size() > UINT32_MAX) {
+        return Error{"Dictionary too large"};
+    }
+
+    // every suffix starting within a string; each runs to its string's
+    // NUL, so they compare as C strings
+    std::vector<uint32_t> suffixes;
+    for (auto p = 0u; p < text.size(); ++p) {
+        if (text[p]) {
+            suffixes.push_back(p);
+        }
+    }
+
+    auto t = text.c_str();
+    std::sort(suffixes.begin(), suffixes.end(), [&](uint32_t a, uint32_t b) {
+        auto result = std::strcmp(t + a, t + b);
+        return result ? result < 0 : a < b;
+    });
+
+    std::string data(dictionary_magic, sizeof(dictionary_magic));
+    put_u32(data, engines_.size());
+    put_u32(data, strings_.size());
+    put_u32(data, occurrence_count);
+    put_u32(data, text.size());
+    put_u32(data, engine_blob.size());
+    put_u32(data, suffixes.size());
+
+    data += engine_offsets;
+    data += engine_blob;
+    data += string_offsets;
+    data += occurrence_offsets;
+    data += occurrences;
+    data += text;
+    for (auto suffix : suffixes) {
+        put_u32(data, suffix);
+    }
+
+    return write_file_atomically(path, data);
+}
+
+Dictionary::Dictionary(const char* path) : file_{path}
+{
+    auto data = file_.data();
+    auto size = file_.size();
+    if (size < dictionary_header_size || std::memcmp(data, dictionary_magic, sizeof(dictionary_magic))) {
+        throw std::runtime_error(std::string{path} + " is not a string dictionary");
+    }
+
+    engine_count_ = load_little_u32(data + 4);
+    string_count_ = load_little_u32(data + 8);
+    occurrence_count_ = load_little_u32(data + 12);
+    text_size_ = load_little_u32(data + 16);
+    auto engine_blob_size = load_little_u32(data + 20);
+    suffix_count_ = load_little_u32(data + 24);
+
+    uint64_t expected_size = dictionary_header_size +
+        (engine_count_ + 1ull) * 4 + engine_blob_size +
+        (string_count_ + 1ull) * 8 + occurrence_count_ * static_cast<uint64_t>(occurrence_size) +
+        text_size_ + suffix_count_ * 4ull;
+    if (size != expected_size || (text_size_ && data[size - suffix_count_ * 4ull - 1])) {
+        throw std::runtime_error(std::string{path} + " is truncated or damaged");
+    }
+
+    engine_offsets_ = data + dictionary_header_size;
+    engine_blob_ = engine_offsets_ + (engine_count_ + 1ull) * 4;
+    string_offsets_ = engine_blob_ + engine_blob_size;
+    occurrence_offsets_ = string_offsets_ + (string_count_ + 1ull) * 4;
+    occurrences_ = occurrence_offsets_ + (string_count_ + 1ull) * 4;
+    text_ = occurrences_ + occurrence_count_ * static_cast<uint64_t>(occurrence_size);
+    suffixes_ = text_ + text_size_;
+
+    // engines are few, and checked now; the other tables are checked as
+    // they are used, so that opening stays cheap
+    for (auto i = 0u; i < engine_count_; ++i) {
+        auto begin = load_little_u32(engine_offsets_ + i * 4);
+        auto end = load_little_u32(engine_offsets_ + (i + 1) * 4);
+        if (begin > end || end > engine_blob_size) {
+            throw std::runtime_error(std::string{path} + " is truncated or damaged");
+        }
+    }
+}
+
+std::string Dictionary::engine(uint32_t i) const
+{
+    if (i >= engine_count_) {
+        return std::string{};
+    }
+
+    auto begin = load_little_u32(engine_offsets_ + i * 4);
+    auto end = load_little_u32(engine_offsets_ + (i + 1) * 4);
+    return std::string(reinterpret_cast<const char*>(engine_blob_ + begin), end - begin);
+}
+
+// the string without its NUL; empty if the offsets are damaged
+Span Dictionary::entry(uint32_t i) const
+{
+    auto begin = load_little_u32(string_offsets_ + i * 4);
+    auto end = load_little_u32(string_offsets_ + (i + 1) * 4);
+    if (begin >= end || end > text_size_) {
+        return Span{text_, 0};
+    }
+
+    return Span{text_ + begin, end - begin - 1};
+}
+
+std::string Dictionary::string(uint32_t i) const
+{
+    auto s = entry(i);
+    return std::string(reinterpret_cast<const char*>(s.data), s.size);
+}
+
+std::vector<StringOccurrence> Dictionary::occurrences(uint32_t i) const
+{
+    std::vector<StringOccurrence> found;
+
+    auto begin = load_little_u32(occurrence_offsets_ + i * 4);
+    auto end = load_little_u32(occurrence_offsets_ + (i + 1) * 4);
+    if (begin > end || end > occurrence_count_) {
+        return found;
+    }
+
+    for (auto o = begin; o < end; ++o) {
+        auto p = occurrences_ + o * occurrence_size;
+        found.push_back(StringOccurrence{load_little_u32(p), static_cast<int32_t>(load_little_u32(p + 4)), load_little_u32(p + 8)});
+    }
+
+    return found;
+}
+
+std::vector<uint32_t> Dictionary::find_exact(const std::string& s) const
+{
+    std::vector<uint32_t> found;
+
+    auto compare = [&](uint32_t i) {
+        auto e = entry(i);
+        auto result = std::memcmp(e.data, s.data(), std::min(e.size, s.size()));
+        return result ? result : (e.size < s.size() ? -1 : e.size > s.size());
+    };
+
+    uint32_t first = 0;
+    uint32_t count = string_count_;
+    while (count) {
+        auto step = count / 2;
+        if (compare(first + step) < 0) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    if (first < string_count_ && compare(first) == 0) {
+        found.push_back(first);
+    }
+
+    return found;
+}
+
+uint32_t Dictionary::string_at(uint32_t position) const
+{
+    uint32_t first = 0;
+    uint32_t count = string_count_;
+    while (count) {
+        auto step = count / 2;
+        if (load_little_u32(string_offsets_ + (first + step + 1) * 4) <= position) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    return first;
+}
+
+std::vector<uint32_t> Dictionary::find_substring(const std::string& s) const
+{
+    std::vector<uint32_t> found;
+    if (s.empty()) {
+        return found;
+    }
+
+    // negative if the suffix sorts before every suffix beginning with s,
+    // zero if it begins with s
+    auto compare = [&](uint32_t i) {
+        auto position = load_little_u32(suffixes_ + i * 4);
+        for (std::size_t k = 0; k < s.size(); ++k) {
+            auto c = position + k < text_size_ ? text_[position + k] : 0;
+            if (c != static_cast<uint8_t>(s[k])) {
+                return c < static_cast<uint8_t>(s[k]) ? -1 : 1;
+            }
+        }
+        return 0;
+    };
+
+    auto bound = [&](bool upper) {
+        uint32_t first = 0;
+        uint32_t count = suffix_count_;
+        while (count) {
+            auto step = count / 2;
+            auto result = compare(first + step);
+            if (result < 0 || (upper && result == 0)) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return first;
+    };
+
+    auto end = bound(true);
+    for (auto i = bound(false); i < end; ++i) {
+        auto position = load_little_u32(suffixes_ + i * 4);
+        if (position < text_size_) {
+            found.push_back(string_at(position));
+        }
+    }
+
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
@@ -0,0 +1,102 @@
+/*
+    dictionary.h: every string in a corpus of engines, for lookups
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "expected.h"
+#include "mapped_file.h"
+
+// where a string was found: which engine, and which string of which
+// stringset, numbered as in MML
+struct StringOccurrence {
+    uint32_t engine;
+    int32_t stringset;
+    uint32_t index;
+};
+
+// each distinct string is kept once, in an arena, however many engines
+// have it
+class DictionaryWriter {
+public:
+    uint32_t add_engine(const std::string& name);
+    void add(uint32_t engine, int32_t stringset, uint32_t index, const std::string& s);
+
+    // a header of the magic number and the number of engines, strings and
+    // occurrences and the size of the text, then the engine name offsets
+    // and names, each string's offset and first occurrence, the
+    // occurrences, the text, and the suffix array of the text; strings
+    // are sorted and each is followed by a NUL in the text, and
+    // everything is little-endian
+    Expected<void> write(const std::string& path) const;
+
+private:
+    std::vector<std::string> engines_;
+
+    Arena arena_;
+    std::vector<Span> strings_;
+    std::vector<std::vector<StringOccurrence>> occurrences_;
+
+    // strings_ entries by hash; a collision just means a longer list
+    std::unordered_multimap<uint64_t, uint32_t> interned_;
+};
+
+// a dictionary written by DictionaryWriter, mapped rather than read; a
+// lookup is a binary search over the strings or the suffix array
+class Dictionary {
+public:
+    // throws std::runtime_error if path is not a dictionary
+    explicit Dictionary(const char* path);
+
+    std::string engine(uint32_t i) const;
+    std::string string(uint32_t i) const;
+    std::vector<StringOccurrence> occurrences(uint32_t i) const;
+
+    // the string equal to s, if there is one
+    std::vector<uint32_t> find_exact(const std::string& s) const;
+
+    // every string containing s, in order
+    std::vector<uint32_t> find_substring(const std::string& s) const;
+
+private:
+    Span entry(uint32_t i) const;
+    uint32_t string_at(uint32_t position) const;
+
+    MappedFile file_;
+    uint32_t engine_count_;
+    uint32_t string_count_;
+    uint32_t occurrence_count_;
+    uint32_t text_size_;
+    uint32_t suffix_count_;
+    const uint8_t* engine_offsets_;
+    const uint8_t* engine_blob_;
+    const uint8_t* string_offsets_;
+    const uint8_t* occurrence_offsets_;
+    const uint8_t* occurrences_;
+    const uint8_t* text_;
+    const uint8_t* suffixes_;
+};
+
+#endif
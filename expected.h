@@ -0,0 +1,108 @@
+/*
+    expected.h: error values for loaders that must not throw
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXPECTED_H
+#define EXPECTED_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// why an input could not be used, and where in it
+struct Error {
+    Error() : offset{-1} { }
+    Error(std::string reason, int64_t offset = -1, std::string where = std::string{}) :
+        reason{std::move(reason)}, offset{offset}, where{std::move(where)} { }
+
+    std::string reason;
+
+    // byte offset into the input (into the decoded fork, for BinHex), or
+    // -1 if there is no one place to point at
+    int64_t offset;
+
+    // the resource or Fux! tag concerned, if any
+    std::string where;
+
+    // everything on one line, for exceptions and stderr
+    std::string message() const {
+        auto s = reason;
+        if (!where.empty()) {
+            s += " in " + where;
+        }
+        if (offset >= 0) {
+            s += " at offset " + std::to_string(offset);
+        }
+        return s;
+    }
+};
+
+// a value or the Error that prevented it; batch runs see many malformed
+// files, and returning these is much cheaper than unwinding an exception
+// through every caller. Checking is explicit, as with std::expected
+template <typename T>
+class Expected {
+public:
+    Expected(T value) : ok_{true}, value_(std::move(value)) { }
+    Expected(Error error) : ok_{false}, value_(), error_(std::move(error)) { }
+
+    explicit operator bool() const { return ok_; }
+
+    T& operator*() { return value_; }
+    const T& operator*() const { return value_; }
+    T* operator->() { return &value_; }
+    const T* operator->() const { return &value_; }
+
+    const Error& error() const { return error_; }
+
+    // for callers that report failure by exception
+    T& value() {
+        if (!ok_) {
+            throw std::runtime_error(error_.message());
+        }
+        return value_;
+    }
+
+private:
+    bool ok_;
+    T value_;
+    Error error_;
+};
+
+template <>
+class Expected<void> {
+public:
+    Expected() : ok_{true} { }
+    Expected(Error error) : ok_{false}, error_(std::move(error)) { }
+
+    explicit operator bool() const { return ok_; }
+
+    const Error& error() const { return error_; }
+
+    void value() const {
+        if (!ok_) {
+            throw std::runtime_error(error_.message());
+        }
+    }
+
+private:
+    bool ok_;
+    Error error_;
+};
+
+#endif
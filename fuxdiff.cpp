@@ -16,737 +16,715 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <array>
-#include <cassert>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
-#include <boost/endian/arithmetic.hpp>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-
-using namespace boost::endian;
-namespace pt = boost::property_tree;
+#include "batch.h"
+#include "batch_reader.h"
+#include "cache.h"
+#include "daemon.h"
+#include "expected.h"
+#include "fuxstate.h"
+#include "hash.h"
+#include "journal.h"
+#include "mapped_file.h"
+#include "memory_budget.h"
+#include "pipeline.h"
+#include "process_pool.h"
+#include "sketch.h"
+#include "store.h"
+
+// adds the state to the object store, split into its tags so that those
+// it shares with other states are kept once, and writes a tab-separated
+// record of the manifest and how many new bytes it took
+static bool store(ObjectStore& store, const char* filename, std::ostream& out)
+{
+    out << filename;
 
-using Tag = std::array<char, 4>;
+    try {
+        MappedFile file{filename};
+        if (is_manifest(file.span())) {
+            out << "\terror=already a manifest\n";
+            return false;
+        }
 
-using big_fixed_t = big_int32_t;
+        Fuxstate state;
+        state.load(file.span()).value();
 
-std::ostream& operator<<(std::ostream& s, Tag tag) {
-    for (auto c : tag) {
-        s << c;
+        auto added = store.add(flatten_path(filename) + ".manifest", file.span(), Fuxstate::tag_data(file.span())).value();
+        out << "\tmanifest=" << added.manifest
+            << "\tsize=" << file.size()
+            << "\tnew=" << added.bytes << "\n";
+        return true;
+    } catch (const std::exception& e) {
+        out << "\terror=" << e.what() << "\n";
     }
 
-    return s;
+    return false;
 }
 
-struct Header {
-    Tag tag;
-    big_uint32_t length;
-};
-
-struct RGBColor {
-    pt::ptree diff(const RGBColor& other) {
-        pt::ptree tree;
+// the state must load, so that anything else is turned away
+static Expected<Sketch> sketch_state(const char* filename)
+{
+    try {
+        MappedFile file{filename};
+        std::vector<uint8_t> data(file.data(), file.data() + file.size());
+        auto expanded = expand_manifest(filename, data);
+        if (!expanded) {
+            return expanded.error();
+        }
 
-        if (r != other.r ||
-            g != other.g ||
-            b != other.b)
-        {
-            tree.put("color.<xmlattr>.red", other.r / 65535.0);
-            tree.put("color.<xmlattr>.green", other.g / 65535.0);
-            tree.put("color.<xmlattr>.blue", other.b / 65535.0);
+        Span span{data.data(), data.size()};
+        Fuxstate state;
+        auto loaded = state.load(span);
+        if (!loaded) {
+            return loaded.error();
         }
 
-        return tree;
+        return make_sketch(Fuxstate::tag_fingerprints(span));
+    } catch (const std::exception& e) {
+        return Error{e.what()};
     }
+}
 
-    pt::ptree diff(int index, const RGBColor& other) {
-        pt::ptree tree;
+// the cache is keyed on this rather than the build, so rebuilding the
+// same sources keeps its entries; bump it with any change to the MML
+// fuxdiff writes, or stale results will be reused
+static const char* version = "fuxdiff output 1";
 
-        if (r != other.r ||
-            g != other.g ||
-            b != other.b)
-        {
-            tree.put("color.<xmlattr>.index", index);
-            tree.put("color.<xmlattr>.red", other.r / 65535.0);
-            tree.put("color.<xmlattr>.green", other.g / 65535.0);
-            tree.put("color.<xmlattr>.blue", other.b / 65535.0);
-        }
+// diffs base_filename against mod_filename through cache. Both are mapped
+// and hashed first, and only decoded if no earlier run left the result
+static int diff_cached(const char* base_filename, const char* mod_filename, const char* cache_dir)
+{
+    ResultCache cache{cache_dir, version};
+
+    MappedFile base_file{base_filename};
+    MappedFile mod_file{mod_filename};
 
-        return tree;
+    auto key = cache.key(hash64(base_file.data(), base_file.size()), hash64(mod_file.data(), mod_file.size()));
+    if (cache.fetch(key, std::cout)) {
+        return 0;
     }
-    
-    big_uint16_t r;
-    big_uint16_t g;
-    big_uint16_t b;
-};
 
-bool operator==(const RGBColor& a, const RGBColor& b)
-{
-    return a.r == b.r && a.g == b.g && a.b == b.b;
-}
+    Fuxstate base;
+    auto loaded = base.load(base_file);
+    if (!loaded) {
+        std::cerr << base_filename << ": " << loaded.error().message() << "\n";
+        return -1;
+    }
 
-bool operator!=(const RGBColor& a, const RGBColor& b)
-{
-    return !(a == b);
-}
+    Fuxstate mod;
+    loaded = mod.load(mod_file);
+    if (!loaded) {
+        std::cerr << mod_filename << ": " << loaded.error().message() << "\n";
+        return -1;
+    }
 
-struct AnnotationDefinition {
-    RGBColor color;
-    big_int16_t font;
-    big_int16_t face;
-    std::array<big_int16_t, 4> sizes;
-};
+    std::ostringstream oss;
+    auto diffed = base.diff(mod, oss);
+    if (!diffed) {
+        std::cerr << mod_filename << ": " << diffed.error().message() << "\n";
+        return -1;
+    }
 
-struct ControlPanelDefinition {
-    pt::ptree diff(int index, const ControlPanelDefinition& other) {
-        pt::ptree tree;
-
-        if (panel_class != other.panel_class ||
-            flags != other.flags ||
-            collection != other.collection ||
-            active_shape != other.active_shape ||
-            inactive_shape != other.inactive_shape ||
-            sounds != other.sounds ||
-            sound_frequency != other.sound_frequency ||
-            item != other.item)
-        {
-            tree.put("panel.<xmlattr>.index", index);
-            tree.put("panel.<xmlattr>.type", other.panel_class);
-            tree.put("panel.<xmlattr>.coll", other.collection);
-            tree.put("panel.<xmlattr>.active_frame", other.active_shape);
-            tree.put("panel.<xmlattr>.inactive_frame", other.inactive_shape);
-            tree.put("panel.<xmlattr>.pitch", other.sound_frequency / 65536.0);
-            tree.put("panel.<xmlattr>.item", other.item);
-            for (auto i = 0; i < sounds.size(); ++i) {
-                if (sounds[i] != other.sounds[i]) {
-                    pt::ptree sound_tree;
-                    sound_tree.put("sound.<xmlattr>.type", i);
-                    sound_tree.put("sound.<xmlattr>.which", other.sounds[i]);
-
-                    tree.add_child("panel.sound", sound_tree.get_child("sound"));
-                }
-            }
-        }
+    auto mml = oss.str();
+    std::cout << mml;
 
-        return tree;
+    auto stored = cache.store(key, mml);
+    if (!stored) {
+        std::cerr << stored.error().message() << "\n";
+        return 1;
     }
-    
-    big_int16_t panel_class;
-    big_uint16_t flags;
 
-    big_int16_t collection;
-    big_int16_t active_shape, inactive_shape;
+    return 0;
+}
 
-    std::array<big_int16_t, 3> sounds;
-    big_fixed_t sound_frequency;
+// an input as it moves through the batch pipeline; each stage fills in
+// the next part, or the error that stops it
+struct BatchItem {
+    BatchItem() : hash{0}, key{0}, skipped{false}, cached{false}, base{nullptr}, failed{false} { }
 
-    big_int16_t item;
-};
+    BatchFile file;
+    std::string output;
 
-struct DamageDefinition {
-    pt::ptree diff(const DamageDefinition& other) {
-        pt::ptree tree;
+    // only filled in when there is a journal or a cache
+    uint64_t hash;
+    uint64_t key;
+    bool skipped;
 
-        if (type != other.type ||
-            flags != other.flags ||
-            base != other.base ||
-            random != other.random ||
-            scale != other.scale)
-        {
-            tree.put("damage.<xmlattr>.type", other.type);
-            tree.put("damage.<xmlattr>.flags", other.flags);
-            tree.put("damage.<xmlattr>.base", other.base);
-            tree.put("damage.<xmlattr>.random", other.random);
-            tree.put("damage.<xmlattr>.scale", other.scale / 65536.0);
-        }
+    // mml came from the cache
+    bool cached;
 
-        return tree;
-    };
-    big_int16_t type;
-    big_int16_t flags;
-    big_int16_t base;
-    big_int16_t random;
-    big_fixed_t scale;
+    std::unique_ptr<Fuxstate> mod;
+    Fuxstate* base;
+    std::string mml;
+
+    bool failed;
+    Error error;
 };
 
-struct DamageResponse {
-    pt::ptree diff(const DamageResponse& other, int index) {
-        pt::ptree tree;
-
-        assert(type == other.type);
-        
-        if (threshold != other.threshold ||
-            fade != other.fade ||
-            sound != other.sound ||
-            death_sound != other.death_sound ||
-            death_action != other.death_action)
-        {
-            tree.put("damage.<xmlattr>.index", index);
-            tree.put("damage.<xmlattr>.threshold", other.threshold);
-            tree.put("damage.<xmlattr>.fade", other.fade);
-            tree.put("damage.<xmlattr>.sound", other.sound);
-            tree.put("damage.<xmlattr>.death_sound", other.death_sound);
-            tree.put("damage.<xmlattr>.death_action", other.death_action);
-        }
-            
-        return tree;
+using BatchItemPtr = std::unique_ptr<BatchItem>;
+
+// the states --auto-base chooses among in a batch run, each read the
+// first time an input resembles it and shared from then on
+class References {
+public:
+    explicit References(const char* index_path)
+    {
+        index_.load(index_path).value();
+        if (!index_.size()) {
+            throw std::runtime_error(std::string{index_path} + " holds no references");
+        }
     }
-    
-    big_int16_t type;
-    big_int16_t threshold;
-
-    big_int16_t fade;
-    big_int16_t sound;
-    big_int16_t death_sound;
-    big_int16_t death_action;
-};
 
-struct FadeDefinition {
-    pt::ptree diff(int index, const FadeDefinition& other) {
-        pt::ptree tree;
-
-        if (proc != other.proc ||
-            color != other.color ||
-            initial_transparency != other.initial_transparency ||
-            final_transparency != other.final_transparency ||
-            period != other.period ||
-            flags != other.flags ||
-            priority != other.priority)
-        {
-            tree.put("fader.<xmlattr>.index", index);
-            tree.put("fader.<xmlattr>.type", other.proc);
-            tree.put("fader.<xmlattr>.initial_opacity",
-                     other.initial_transparency / 65536.0);
-            tree.put("fader.<xmlattr>.final_opacity",
-                     other.final_transparency / 65536.0);
-            tree.put("fader.<xmlattr>.period", other.period);
-            tree.put("fader.<xmlattr>.flags", other.flags);
-            tree.put("fader.<xmlattr>.priority", other.priority);
-
-            auto color_tree = color.diff(other.color);
-            if (!color_tree.empty()) {
-                tree.add_child("fader.color", color_tree.get_child("color"));
+    Expected<Fuxstate*> nearest(const Sketch& sketch)
+    {
+        auto i = index_.nearest(sketch);
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto& state = states_[i];
+        if (!state) {
+            std::unique_ptr<Fuxstate> loading{new Fuxstate};
+            auto loaded = loading->load(index_.name(i).c_str());
+            if (!loaded) {
+                return Error{index_.name(i) + ": " + loaded.error().message()};
             }
+            state = std::move(loading);
         }
 
-        return tree;
+        return state.get();
     }
-    
-    big_uint32_t proc;
-    RGBColor color;
-    big_fixed_t initial_transparency, final_transparency;
-    big_int16_t period;
-    big_uint16_t flags;
-    big_int16_t priority;
+
+private:
+    SketchIndex index_;
+    std::mutex mutex_;
+    std::map<int, std::unique_ptr<Fuxstate>> states_;
 };
 
-struct LineDefinition {
-    pt::ptree diff(int index, const LineDefinition& other) {
-        pt::ptree tree;
+// as run_batch(), with each input read and diffed in a worker process
+// rather than a pipeline stage. The base is read once, before the workers
+// start, and they share it copy-on-write
+static int run_process_batch(const char* base_filename, const std::vector<std::string>& inputs, const BatchOptions& options)
+{
+    if (options.auto_base || options.journal || options.cache) {
+        throw std::runtime_error("--processes cannot be combined with --auto-base, --journal or --cache");
+    }
 
-        if (color != other.color ||
-            pen_sizes != other.pen_sizes)
-        {
-            auto color_tree = color.diff(other.color);
-            if (!color_tree.empty()) {
-                tree.add_child("line.color", color_tree.get_child("color"));
-            }
+    Fuxstate base;
+    base.load(base_filename).value();
+    ErrorReport report{options.error_report_path()};
+
+    auto lost = run_in_processes(inputs.size(), options.processes, [&](std::size_t i) -> Expected<std::string> {
+        Fuxstate mod;
+        auto loaded = mod.load(inputs[i].c_str());
+        if (!loaded) {
+            return loaded.error();
+        }
 
-            for (auto i = 0; i < pen_sizes.size(); ++i) {
-                if (pen_sizes[i] != other.pen_sizes[i]) {
-                    
-                }
+        std::ostringstream oss;
+        auto diffed = base.diff(mod, oss);
+        if (!diffed) {
+            return diffed.error();
+        }
+        return oss.str();
+    }, [&](std::size_t i, Expected<std::string> mml) {
+        if (mml) {
+            auto written = write_file_atomically(batch_output_path(options.output_dir, inputs[i]), *mml);
+            if (!written) {
+                report.add(inputs[i], written.error());
             }
+        } else {
+            report.add(inputs[i], mml.error());
         }
+    });
 
-        return tree;
+    if (lost) {
+        std::cerr << lost << (lost == 1 ? " worker" : " workers") << " died and had to be replaced\n";
     }
-    RGBColor color;
-    std::array<big_int16_t, 4> pen_sizes;
-};
 
-struct MediaDefinition {
-    pt::ptree diff(int index, const MediaDefinition& other) {
-        pt::ptree tree;
-        
-        auto damage_tree = damage.diff(other.damage);
-        if (collection != other.collection ||
-            shape != other.shape ||
-            shape_count != other.shape_count ||
-            /* shape_frequency is unused */
-            transfer_mode != other.transfer_mode ||
-            damage_frequency != other.damage_frequency ||
-            !damage_tree.empty() ||
-            detonation_effects != other.detonation_effects ||
-            sounds != other.sounds ||
-            submerged_fade_effect != other.submerged_fade_effect)
-        {
-            tree.put("liquid.<xmlattr>.index", index);
-            tree.put("liquid.<xmlattr>.coll", other.collection);
-            tree.put("liquid.<xmlattr>.frame", other.shape);
-            tree.put("liquid.<xmlattr>.transfer", other.transfer_mode);
-            tree.put("liquid.<xmlattr>.damage_freq", other.damage_frequency);
-            if (!damage_tree.empty()) {
-                 tree.add_child("liquid.damage", damage_tree.get_child("damage"));
+    return report.summarize(std::cerr) ? 0 : 1;
+}
+
+// diffs each input against base, or the reference it most resembles,
+// writing one MML file per input to the output directory. Reading,
+// decoding, diffing and writing overlap as pipeline stages; an input that
+// fails is recorded in the error report and skipped rather than ending
+// the run
+static int run_batch(const char* base_filename, std::vector<std::string> inputs, const BatchOptions& options)
+{
+    check_output_paths(options.output_dir, inputs);
+
+    if (options.processes) {
+        return run_process_batch(base_filename, inputs, options);
+    }
+
+    std::unique_ptr<Fuxstate> base;
+    std::unique_ptr<References> references;
+    if (options.auto_base) {
+        // the journal and cache are keyed by the base, which is not known
+        // until each input has been read
+        if (options.journal || options.cache) {
+            throw std::runtime_error("--auto-base cannot be combined with --journal or --cache in batch mode");
+        }
+        references.reset(new References{options.auto_base});
+    } else {
+        base.reset(new Fuxstate);
+        base->load(base_filename).value();
+    }
+
+    ErrorReport report{options.error_report_path()};
+
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<ResultCache> cache;
+    std::atomic<std::size_t> skipped{0};
+    uint64_t base_hash = 0;
+    if (options.journal || options.cache) {
+        if (std::string{base_filename} == "-") {
+            throw std::runtime_error("--journal and --cache need the base in a file");
+        }
+        base_hash = hash_file(base_filename).value();
+    }
+
+    if (options.journal) {
+        // a journal kept by the other tool, or against another base, has
+        // nothing in common with this run
+        journal.reset(new Journal{options.journal, options.output_dir, hash64(std::string{"fuxdiff"}, base_hash), options.journal_sync});
+    }
+
+    if (options.cache) {
+        cache.reset(new ResultCache{options.cache, version});
+    }
+
+    MemoryBudget budget{options.memory_limit};
+    std::atomic<std::size_t> past_decode{0};
+    std::atomic<std::size_t> past_diff{0};
+
+    BatchReader reader{std::move(inputs), options.queue_depth, &budget};
+
+    BoundedQueue<BatchItemPtr> read{options.queue_size};
+    BoundedQueue<BatchItemPtr> decoded{options.queue_size};
+    BoundedQueue<BatchItemPtr> diffed{options.queue_size};
+
+    Pipeline pipeline;
+
+    pipeline.add_source("read", read, [&](BatchItemPtr& item) {
+        item.reset(new BatchItem);
+        if (!reader.next(item->file)) {
+            return false;
+        }
+        item->output = batch_output_path(options.output_dir, item->file.path);
+
+        if (item->file.error) {
+            item->failed = true;
+            item->error = Error{std::strerror(item->file.error)};
+        }
+        return true;
+    });
+
+    // states too large to hold are read tag by tag from the file
+    pipeline.add_stage("decode", options.decode_threads, read, decoded, [&](BatchItemPtr item) {
+        if (!item->failed && (journal || cache)) {
+            auto hash = item->file.oversized ? hash_file(item->file.path.c_str()) : Expected<uint64_t>{hash64(item->file.data.data(), item->file.data.size())};
+            if (hash) {
+                item->hash = *hash;
+            } else {
+                item->failed = true;
+                item->error = hash.error();
             }
-            for (auto i = 0; i < detonation_effects.size(); ++i) {
-                // TODO: should we always include these? or only when different?
-                if (detonation_effects[i] != other.detonation_effects[i]) {
-                    pt::ptree effect_tree;
-                    effect_tree.put("effect.<xmlattr>.type", i);
-                    effect_tree.put("effect.<xmlattr>.which", other.detonation_effects[i]);
-                    tree.add_child("liquid.effect", effect_tree.get_child("effect"));
-                }
+        }
+
+        if (!item->failed && journal) {
+            item->key = journal->key(item->file.path, item->output, item->hash);
+            if (journal->finished(item->key, item->output)) {
+                item->skipped = true;
+                std::vector<uint8_t>().swap(item->file.data);
+                ++skipped;
             }
-            for (auto i = 0; i < sounds.size(); ++i) {
-                // TODO: should we always include these? or only when different?
-                if (sounds[i] != other.sounds[i]) {
-                    pt::ptree sound_tree;
-                    sound_tree.put("sound.<xmlattr>.type", i);
-                    sound_tree.put("sound.<xmlattr>.which", other.sounds[i]);
-                    tree.add_child("liquid.sound", sound_tree.get_child("sound"));
+        }
+
+        if (!item->failed && !item->skipped && cache) {
+            std::ostringstream oss;
+            if (cache->fetch(cache->key(base_hash, item->hash), oss)) {
+                item->mml = oss.str();
+                item->cached = true;
+                std::vector<uint8_t>().swap(item->file.data);
+
+                auto charged = recharge(budget, item->file, item->mml.size(), past_decode);
+                if (!charged) {
+                    item->failed = true;
+                    item->error = charged.error();
                 }
             }
-            tree.put("liquid.<xmlattr>.submerged", other.submerged_fade_effect);
         }
 
-        return tree;
-    };
-    
-    big_int16_t collection;
-    big_int16_t shape;
-    big_int16_t shape_count;
-    big_int16_t shape_frequency;
-    big_int16_t transfer_mode;
-    big_int16_t damage_frequency;
-    DamageDefinition damage;
-
-    std::array<big_int16_t, 4> detonation_effects;
-    std::array<big_int16_t, 9> sounds;
-    big_int16_t submerged_fade_effect;
-};
+        // a manifest is small enough never to be streamed
+        if (!item->failed && !item->skipped && !item->cached && !item->file.oversized) {
+            auto expanded = expand_manifest(item->file.path, item->file.data);
+            if (!expanded) {
+                item->failed = true;
+                item->error = expanded.error();
+            }
+        }
 
-struct SceneryDefinition {
-    pt::ptree diff(int index, const SceneryDefinition& other) {
-        pt::ptree tree;
-        if (flags != other.flags ||
-            shape != other.shape ||
-            radius != other.radius ||
-            height != other.height ||
-            destroyed_effect != other.destroyed_effect ||
-            destroyed_shape != other.destroyed_shape)
-        {
-            tree.put("object.<xmlattr>.index", index);
-            tree.put("object.<xmlattr>.flags", other.flags);
-            tree.put("object.<xmlattr>.radius", other.radius);
-            tree.put("object.<xmlattr>.height", other.height);
-            tree.put("object.<xmlattr>.destruction", other.destroyed_effect);
-
-            if (shape != other.shape) {
-                pt::ptree child;
-                child.put("shape.<xmlattr>.coll", (other.shape >> 8) & 0x1f);
-                child.put("shape.<xmlattr>.clut", other.shape >> 11);
-                child.put("shape.<xmlattr>.seq", other.shape & 0xff);
-
-                tree.add_child("object.normal.shape", child.get_child("shape"));
+        if (!item->failed && !item->skipped && !item->cached && references) {
+            auto sketch = item->file.oversized ? sketch_state(item->file.path.c_str()) : Expected<Sketch>{make_sketch(Fuxstate::tag_fingerprints(Span{item->file.data.data(), item->file.data.size()}))};
+            auto nearest = sketch ? references->nearest(*sketch) : Expected<Fuxstate*>{sketch.error()};
+            if (nearest) {
+                item->base = *nearest;
+            } else {
+                item->failed = true;
+                item->error = nearest.error();
             }
+        } else {
+            item->base = base.get();
+        }
 
-            if (destroyed_shape != other.destroyed_shape) {
-                pt::ptree child;
-                child.put("shape.<xmlattr>.coll", (other.destroyed_shape >> 8) & 0x1f);
-                child.put("shape.<xmlattr>.clut", (other.destroyed_shape >> 11));
-                child.put("shape.<xmlattr>.seq", (other.destroyed_shape & 0xff));
+        if (!item->failed && !item->skipped && !item->cached) {
+            item->mod.reset(new Fuxstate);
+            auto loaded = item->file.oversized ? item->mod->load(item->file.path.c_str()) : item->mod->load(Span{item->file.data.data(), item->file.data.size()});
+            std::vector<uint8_t>().swap(item->file.data);
 
-                tree.add_child("object.destroyed.shape", child.get_child("shape"));
+            if (loaded) {
+                // what was read has been freed, leaving the state
+                loaded = recharge(budget, item->file, item->mod->memory_usage(), past_decode);
             }
-        }
 
-        return tree;
-    }
-    
-    big_uint16_t flags;
-    big_uint16_t shape;
+            if (!loaded) {
+                item->mod.reset();
+                item->failed = true;
+                item->error = loaded.error();
+            }
+        }
 
-    big_int16_t radius, height;
+        ++past_decode;
+        return item;
+    });
+
+    // bases are only read while diffing, so they are shared by every
+    // worker
+    pipeline.add_stage("diff", options.diff_threads, decoded, diffed, [&](BatchItemPtr item) {
+        if (item->mod) {
+            std::ostringstream oss;
+            auto diffed = item->base->diff(*item->mod, oss);
+            if (diffed) {
+                item->mml = oss.str();
+            } else {
+                item->failed = true;
+                item->error = diffed.error();
+            }
+            item->mod.reset();
 
-    big_int16_t destroyed_effect;
-    big_uint16_t destroyed_shape;
-};
+            auto charged = recharge(budget, item->file, item->mml.size(), past_diff);
+            if (!charged) {
+                item->failed = true;
+                item->error = charged.error();
+            }
+        }
 
-struct WeaponInterfaceAmmoDefinition {
-    pt::ptree diff(int index, const WeaponInterfaceAmmoDefinition& other) {
-        pt::ptree tree;
-
-        if (type != other.type ||
-            screen_left != other.screen_left ||
-            screen_top != other.screen_top ||
-            ammo_across != other.ammo_across ||
-            ammo_down != other.ammo_down ||
-            delta_x != other.delta_x ||
-            delta_y != other.delta_y ||
-            bullet != other.bullet ||
-            empty_bullet != other.empty_bullet ||
-            right_to_left != other.right_to_left)
-        {
-            tree.put("ammo.<xmlattr>.index", index);
-            tree.put("ammo.<xmlattr>.type", other.type);
-            tree.put("ammo.<xmlattr>.left", other.screen_left);
-            tree.put("ammo.<xmlattr>.top", other.screen_top);
-            tree.put("ammo.<xmlattr>.across", other.ammo_across);
-            tree.put("ammo.<xmlattr>.down", other.ammo_down);
-            tree.put("ammo.<xmlattr>.delta_x", other.delta_x);
-            tree.put("ammo.<xmlattr>.delta_y", other.delta_y);
-            tree.put("ammo.<xmlattr>.bullet_shape", other.bullet);
-            tree.put("ammo.<xmlattr>.empty_shape", other.empty_bullet);
-            tree.put("ammo.<xmlattr>.right_to_left", other.right_to_left != 0);
-        }
-
-        return tree;
-    }
-    
-    big_int16_t type;
-    big_int16_t screen_left;
-    big_int16_t screen_top;
-    big_int16_t ammo_across;
-    big_int16_t ammo_down;
-    big_int16_t delta_x;
-    big_int16_t delta_y;
-    big_int16_t bullet;
-    big_int16_t empty_bullet;
-    big_uint16_t right_to_left;
-};
+        ++past_diff;
+        return item;
+    });
 
-bool operator==(const WeaponInterfaceAmmoDefinition& a, const WeaponInterfaceAmmoDefinition& b)
-{
-    return a.type == b.type &&
-        a.screen_left == b.screen_left &&
-        a.screen_top == b.screen_top &&
-        a.ammo_across == b.ammo_across &&
-        a.ammo_down == b.ammo_down &&
-        a.delta_x == b.delta_x &&
-        a.delta_y == b.delta_y &&
-        a.bullet == b.bullet &&
-        a.empty_bullet == b.empty_bullet &&
-        a.right_to_left == b.right_to_left;
-}
+    pipeline.add_sink("write", options.write_threads, diffed, [&](BatchItemPtr item) {
+        if (!item->failed && !item->skipped) {
+            auto written = write_file_atomically(item->output, item->mml);
+            if (written && cache && !item->cached) {
+                written = cache->store(cache->key(base_hash, item->hash), item->mml);
+            }
 
-bool operator!=(const WeaponInterfaceAmmoDefinition& a, const WeaponInterfaceAmmoDefinition& b)
-{
-    return !(a == b);
-}
+            if (written && journal) {
+                written = journal->record(item->key, item->hash, item->file.path, item->output, hash64(item->mml));
+            }
 
-struct WeaponInterfaceDefinition {
-    pt::ptree diff(int index, const WeaponInterfaceDefinition& other) {
-        pt::ptree tree;
-        if (item_id != other.item_id) {
-            std::cerr << "Weapon HUD items changed; Aleph One does not support this!\n";
-        }
-        
-        if (weapon_panel_shape != other.weapon_panel_shape ||
-            weapon_name_start_y != other.weapon_name_start_y ||
-            weapon_name_end_y != other.weapon_name_end_y ||
-            weapon_name_start_x != other.weapon_name_start_x ||
-            weapon_name_end_x != other.weapon_name_end_x ||
-            standard_weapon_panel_top != other.standard_weapon_panel_top ||
-            standard_weapon_panel_left != other.standard_weapon_panel_left ||
-            multi_weapon != other.multi_weapon ||
-            ammo_data[0] != other.ammo_data[0] ||
-            ammo_data[1] != other.ammo_data[1])
-        {
-            tree.put("weapon.<xmlattr>.index", index);
-            tree.put("weapon.<xmlattr>.shape", other.weapon_panel_shape);
-            tree.put("weapon.<xmlattr>.start_y", other.weapon_name_start_y);
-            tree.put("weapon.<xmlattr>.end_y", other.weapon_name_end_y);
-            tree.put("weapon.<xmlattr>.start_x", other.weapon_name_start_x);
-            tree.put("weapon.<xmlattr>.end_x", other.weapon_name_end_x);
-            tree.put("weapon.<xmlattr>.top", other.standard_weapon_panel_top);
-            tree.put("weapon.<xmlattr>.left", other.standard_weapon_panel_left);
-            tree.put("weapon.<xmlattr>.multiple", other.multi_weapon != 0);
-
-            for (auto i = 0; i < 2; ++i) {
-                auto ammo_tree = ammo_data[i].diff(i, other.ammo_data[i]);
-                if (!ammo_tree.empty()) {
-                    tree.add_child("weapon.ammo", ammo_tree.get_child("ammo"));
-                }
+            if (!written) {
+                item->failed = true;
+                item->error = written.error();
             }
         }
 
-        return tree;
-    }
-    
-    big_int16_t item_id;
-    big_int16_t weapon_panel_shape;
-    big_int16_t weapon_name_start_y;
-    big_int16_t weapon_name_end_y;
-    big_int16_t weapon_name_start_x;
-    big_int16_t weapon_name_end_x;
-    big_int16_t standard_weapon_panel_top;
-    big_int16_t standard_weapon_panel_left;
-    big_uint16_t multi_weapon;
-
-    WeaponInterfaceAmmoDefinition ammo_data[2];
-};
+        if (item->failed) {
+            report.add(item->file.path, item->error);
+        }
 
-class Fuxstate {
-public:
-    void diff(Fuxstate& other);
-    void load(const char* filename);
-    void load(std::istream& s);
-
-    AnnotationDefinition annotation_definition;
-    std::array<ControlPanelDefinition, 54> control_panels;
-    std::array<DamageResponse, 24> damage_responses;
-    std::array<FadeDefinition, 32> fade_definitions;
-    std::array<RGBColor, 4> infravision_colors;
-    std::array<LineDefinition, 3> line_definitions;
-    RGBColor map_name_color;
-    std::array<MediaDefinition, 5> media_definitions;
-    std::array<RGBColor, 6> polygon_colors;
-    std::array<big_int16_t, 5> random_sounds;
-    std::array<SceneryDefinition, 61> scenery_definitions;
-    std::map<Tag, std::vector<char>> tags;
-    std::array<WeaponInterfaceDefinition, 10> weapon_interface_definitions;
-};
+        // before the release, so a worker waiting on it sees it coming
+        --past_decode;
+        --past_diff;
+        budget.release(item->file.charged);
+    });
 
-void Fuxstate::diff(Fuxstate& other)
-{
-    pt::ptree tree;
+    pipeline.wait();
 
-    tree.add("<xmlcomment>", "Generated by fuxdiff");
+    if (journal) {
+        auto synced = journal->sync();
+        if (!synced) {
+            report.add(options.journal, synced.error());
+        }
 
-    for (auto i = 0; i < control_panels.size(); ++i) {
-        auto child = control_panels[i].diff(i, other.control_panels[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.control_panels.panel", child.get_child("panel"));
+        if (skipped) {
+            std::cerr << skipped << (skipped == 1 ? " input" : " inputs") << " already in " << options.journal << "; skipped\n";
         }
     }
-    
-    for (auto i = 0; i < fade_definitions.size(); ++i) {
-        auto child = fade_definitions[i].diff(i, other.fade_definitions[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.faders.fader", child.get_child("fader"));
-        }
+
+    if (options.stats) {
+        pipeline.write_stats(std::cerr);
     }
 
-    for (auto i = 0; i < infravision_colors.size(); ++i) {
-        auto child = infravision_colors[i].diff(i, other.infravision_colors[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.infravision.color", child.get_child("color"));
-        }
+    if (options.stats || options.memory_limit) {
+        std::cerr << "Peak accounted memory: " << budget.peak() << " bytes\n";
     }
 
-    // overhead map colors
-    for (auto i = 0; i < polygon_colors.size(); ++i) {
-        auto color_tree = polygon_colors[i].diff(i, other.polygon_colors[i]);
-        if (!color_tree.empty()) {
-            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+    return report.summarize(std::cerr) ? 0 : 1;
+}
+
+// serves diffs against bases parsed once, for callers that would otherwise
+// start a process per diff
+static int run_diff_daemon(const char* socket_path, std::vector<std::string> bases, unsigned threads)
+{
+    ResidentBases<Fuxstate> resident{std::move(bases), [](const std::string& path, Sketch& sketch) -> Expected<std::unique_ptr<Fuxstate>> {
+        try {
+            MappedFile file{path.c_str()};
+            std::vector<uint8_t> data(file.data(), file.data() + file.size());
+            auto expanded = expand_manifest(path, data);
+            if (!expanded) {
+                return expanded.error();
+            }
+
+            Span span{data.data(), data.size()};
+            std::unique_ptr<Fuxstate> base{new Fuxstate};
+            auto loaded = base->load(span);
+            if (!loaded) {
+                return loaded.error();
+            }
+
+            sketch = make_sketch(Fuxstate::tag_fingerprints(span));
+            return base;
+        } catch (const std::exception& e) {
+            return Error{e.what()};
         }
-    }
-    
-    for (auto i = 0; i < line_definitions.size(); ++i) {
-        auto color_tree = line_definitions[i].color.diff(i + 8, other.line_definitions[i].color);
-        if (!color_tree.empty()) {
-            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+    }};
+    resident.reload().value();
+
+    DaemonHandlers handlers;
+    handlers.diff = [&](const std::string& name, Span modified) -> Expected<std::string> {
+        Fuxstate mod;
+        auto loaded = mod.load(modified);
+        if (!loaded) {
+            return loaded.error();
         }
-    }
 
-    {
-        auto color_tree = annotation_definition.color.diff(16, other.annotation_definition.color);
-        if (!color_tree.empty()) {
-            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+        auto set = resident.current();
+        auto base = set->find(name, name.empty() ? make_sketch(Fuxstate::tag_fingerprints(modified)) : Sketch{});
+        if (!base) {
+            return Error{"No base " + name};
         }
-    }
 
-    {
-        auto color_tree = map_name_color.diff(17, other.map_name_color);
-        if (!color_tree.empty()) {
-            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+        std::ostringstream oss;
+        auto diffed = base->diff(mod, oss);
+        if (!diffed) {
+            return diffed.error();
         }
-    }
+        return oss.str();
+    };
+    handlers.reload = [&]() {
+        return resident.reload();
+    };
 
-    // overhead map lines
-    for (auto i = 0 ; i < line_definitions.size(); ++i) {
-        for (auto j = 0; j < line_definitions[i].pen_sizes.size(); ++j) {
-            if (line_definitions[i].pen_sizes[j] != other.line_definitions[i].pen_sizes[j])
-            {
-                pt::ptree line_tree;
-                line_tree.put("line.<xmlattr>.type", i);
-                line_tree.put("line.<xmlattr>.scale", j);
-                line_tree.put("line.<xmlattr>.width", other.line_definitions[i].pen_sizes[j]);
-                tree.add_child("marathon.overhead_map.line", line_tree.get_child("line"));
-            }
-        }
-    }
+    return run_daemon(socket_path, threads, handlers);
+}
 
-    // overhead map fonts
-    for (auto i = 0; i < annotation_definition.sizes.size(); ++i) {
-        if (annotation_definition.font != other.annotation_definition.font ||
-            annotation_definition.face != other.annotation_definition.face ||
-            annotation_definition.sizes[i] != other.annotation_definition.sizes[i]) {
-            pt::ptree font_tree;
-            font_tree.put("font.<xmlattr>.index", i);
-            switch (other.annotation_definition.font) {
-            case 4:
-                font_tree.put("font.<xmlattr>.name", "Monaco");
-                break;
-            case 22:
-                font_tree.put("font.<xmlattr>.name", "Courier");
-                break;
-            default:
-                assert(false);
-            }
-            font_tree.put("font.<xmlattr>.size", other.annotation_definition.sizes[i]);
-            font_tree.put("font.<xmlattr>.style", other.annotation_definition.face);
-            tree.add_child("marathon.overhead_map.font", font_tree.get_child("font"));
+int main(int argv, char* argc[])
+{
+    BatchOptions batch;
+    const char* store_dir = nullptr;
+    const char* sketch_index = nullptr;
+    auto cluster = false;
+    auto threshold = 0.7;
+    const char* socket_path = nullptr;
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+
+    auto arg = 1;
+    for (; arg < argv && argc[arg][0] == '-' && argc[arg][1]; ++arg) {
+        std::string option{argc[arg]};
+        if (option == "--store" && arg + 1 < argv) {
+            store_dir = argc[++arg];
+        } else if (option == "--sketch" && arg + 1 < argv) {
+            sketch_index = argc[++arg];
+        } else if (option == "--cluster") {
+            cluster = true;
+        } else if (option == "--threshold" && arg + 1 < argv) {
+            threshold = std::atof(argc[++arg]);
+        } else if (option == "--daemon" && arg + 1 < argv) {
+            socket_path = argc[++arg];
+        } else if (option == "-j" && arg + 1 < argv) {
+            threads = std::max(1, std::atoi(argc[++arg]));
+        } else if (!parse_batch_option(arg, argv, argc, batch)) {
+            break;
         }
     }
-    
-    for (auto i = 0; i < damage_responses.size(); ++i) {
-        auto child = damage_responses[i].diff(other.damage_responses[i], i);
-        if (!child.empty()) {
-            tree.add_child("marathon.player.damage", child.get_child("damage"));
+
+    if (store_dir) {
+        if (arg == argv) {
+            std::cerr << "Usage: fuxdiff --store <dir> <file>...\n";
+            return -1;
         }
-    }
-    
-    for (auto i = 0; i < media_definitions.size(); ++i) {
-        auto child = media_definitions[i].diff(i, other.media_definitions[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.liquids.liquid", child.get_child("liquid"));
+
+        try {
+            ObjectStore objects{store_dir};
+
+            auto result = 0;
+            for (; arg < argv; ++arg) {
+                if (!store(objects, argc[arg], std::cout)) {
+                    result = 1;
+                }
+            }
+
+            return result;
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
     }
 
-    for (auto i = 0; i < random_sounds.size(); ++i) {
-        if (random_sounds[i] != other.random_sounds[i]) {
-            pt::ptree random_tree;
-            random_tree.put("random.<xmlattr>.index", i);
-            random_tree.put("random.<xmlattr>.sound", other.random_sounds[i]);
+    if (socket_path) {
+        try {
+            std::vector<std::string> bases(argc + arg, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                bases.insert(bases.end(), listed.begin(), listed.end());
+            }
+
+            if (bases.empty()) {
+                std::cerr << "Usage: fuxdiff [-j threads] --daemon <socket> <base>...\n";
+                return -1;
+            }
 
-            tree.add_child("marathon.sounds.random", random_tree.get_child("random"));
+            return run_diff_daemon(socket_path, std::move(bases), threads);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
     }
 
-    for (auto i = 0; i < scenery_definitions.size(); ++i) {
-        auto child = scenery_definitions[i].diff(i, other.scenery_definitions[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.scenery.object", child.get_child("object"));
+    if (sketch_index || cluster) {
+        try {
+            std::vector<std::string> files(argc + arg, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                files.insert(files.end(), listed.begin(), listed.end());
+            }
+
+            if (files.empty()) {
+                std::cerr << "Usage: fuxdiff --sketch <index> <file>...\n";
+                std::cerr << "       fuxdiff --cluster [--threshold similarity] <file>...\n";
+                return -1;
+            }
+
+            if (sketch_index) {
+                return update_sketch_index(sketch_index, files, sketch_state, std::cerr) ? 0 : 1;
+            }
+
+            return write_families(files, threshold, sketch_state, std::cout, std::cerr) ? 0 : 1;
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
     }
 
-    for (auto i = 0; i < weapon_interface_definitions.size(); ++i) {
-        auto child = weapon_interface_definitions[i].diff(i, other.weapon_interface_definitions[i]);
-        if (!child.empty()) {
-            tree.add_child("marathon.interface.weapon", child.get_child("weapon"));
+    if (!batch.output_dir.empty()) {
+        if (arg == argv && !(batch.auto_base && batch.list)) {
+            std::cerr << "Usage: fuxdiff " << batch_usage << " <base> <modified>...\n";
+            return -1;
         }
-    }
 
-    std::ostringstream oss;
-    pt::xml_writer_settings<std::string> settings(' ', 4);
-    pt::write_xml(std::cout, tree, settings);
-
-    auto physics_differ = false;
-    
-    for (auto kvp : tags) {
-        if (other.tags[kvp.first] != kvp.second) {
-            if (kvp.first == Tag{'E','f','f','x'} ||
-                kvp.first == Tag{'I','t','e','m'} ||
-                kvp.first == Tag{'M','o','n','s'} ||
-                kvp.first == Tag{'P','r','o','j'} ||
-                kvp.first == Tag{'W','e','p','1'})
-            {
-                physics_differ = true;
-            } else if (kvp.first == Tag{'I','v','r','m'}) {
-                std::cerr << "'Ivrm' differs, but Aleph One does not support 8-bit infravision MML\n";
-            } else {
-                std::cerr << kvp.first << " differs (" << other.tags[kvp.first].size() << ")\n";
+        try {
+            // with --auto-base, every argument is an input
+            auto first = batch.auto_base ? arg : arg + 1;
+            std::vector<std::string> inputs(argc + first, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                inputs.insert(inputs.end(), listed.begin(), listed.end());
             }
+
+            return run_batch(batch.auto_base ? nullptr : argc[arg], std::move(inputs), batch);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
     }
 
-    if (physics_differ) {
-        std::cerr << "Physics models differ\n";
+    if (argv - arg != (batch.auto_base ? 1 : 2)) {
+        std::cerr << "Usage: fuxdiff [--cache <dir>] <base> <modified>\n";
+        std::cerr << "       fuxdiff [--cache <dir>] --auto-base <index> <modified>\n";
+        std::cerr << "       fuxdiff " << batch_usage << " <base> <modified>...\n";
+        std::cerr << "       fuxdiff --store <dir> <file>...\n";
+        std::cerr << "       fuxdiff --sketch <index> <file>...\n";
+        std::cerr << "       fuxdiff --cluster [--threshold similarity] <file>...\n";
+        std::cerr << "       fuxdiff [-j threads] --daemon <socket> <base>...\n";
+        return -1;
     }
-}
-
-void Fuxstate::load(const char* filename)
-{
-    std::ifstream ifs(filename);
-    load(ifs);
-}
 
-void Fuxstate::load(std::istream& s)
-{
-    while (s) {
-        Header header;
-        if (!s.read(reinterpret_cast<char*>(&header), sizeof(Header))) {
-            break;
+    std::string base_filename;
+    const char* mod_filename = argc[argv - 1];
+    if (batch.auto_base) {
+        if (std::string{mod_filename} == "-") {
+            std::cerr << "--auto-base needs <modified> in a file\n";
+            return -1;
         }
 
-        if (header.tag == Tag{'C','l','f','x'}) {
-            assert(header.length == 768);
-            s.read(reinterpret_cast<char*>(fade_definitions.data()), 768);
-        } else if (header.tag == Tag{'D','a','m','g'}) {
-            assert(header.length = 288);
-            s.read(reinterpret_cast<char*>(damage_responses.data()), 288);
-        } else if (header.tag == Tag{'I','v','c','l'}) {
-            assert(header.length == 24);
-            s.read(reinterpret_cast<char*>(infravision_colors.data()), 24);
-        } else if (header.tag == Tag{'M','d','i','a'}) {
-            assert(header.length == 260);
-            s.read(reinterpret_cast<char*>(media_definitions.data()), 260);
-        } else if (header.tag == Tag{'M','p','l','n'}) {
-            assert(header.length == 42);
-            s.read(reinterpret_cast<char*>(line_definitions.data()), 42);
-        } else if (header.tag == Tag{'M','p','n','c'}) {
-            assert(header.length == 6);
-            s.read(reinterpret_cast<char*>(&map_name_color), 6);
-        } else if (header.tag == Tag{'M','p','p','l'}) {
-            assert(header.length == 36);
-            s.read(reinterpret_cast<char*>(polygon_colors.data()), 36);
-        } else if (header.tag == Tag{'M','p','t','x'}) {
-            assert(header.length == 18);
-            s.read(reinterpret_cast<char*>(&annotation_definition), 18);
-        } else if (header.tag == Tag{'P','a','n','l'}) {
-            assert(header.length == 1188);
-            s.read(reinterpret_cast<char*>(control_panels.data()), 1188);
-        } else if (header.tag == Tag{'R','a','n','d'}) {
-            assert(header.length == 10);
-            s.read(reinterpret_cast<char*>(random_sounds.data()), 10);
-        } else if (header.tag == Tag{'S','c','n','r'}) {
-            assert(header.length == 732);
-            s.read(reinterpret_cast<char*>(scenery_definitions.data()), 732);
-        } else if (header.tag == Tag{'T','y','p','e'}) {
-            assert(header.length == 28);
-            // there's no meaningful way to translate this to MML
-            s.seekg(28, s.cur);
-        } else if (header.tag == Tag{'W','e','p','2'}) {
-            assert(header.length == 580);
-            s.read(reinterpret_cast<char*>(weapon_interface_definitions.data()), 580);
-        } else {
-            auto& v = tags[header.tag];
-            v.resize(header.length);
-            
-            s.read(v.data(), v.size());
+        double found_similarity;
+        auto nearest = nearest_reference(batch.auto_base, mod_filename, sketch_state, &found_similarity);
+        if (!nearest) {
+            std::cerr << nearest.error().message() << "\n";
+            return -1;
         }
+
+        base_filename = *nearest;
+        std::cerr << "Using " << base_filename << " as the base (similarity " << std::fixed << std::setprecision(2) << found_similarity << ")\n";
+    } else {
+        base_filename = argc[arg];
     }
-}
 
-int main(int argv, char* argc[])
-{
-    if (argv != 3) {
-        std::cerr << "Usage: fuxdiff <base> <modified>\n";
+    if (base_filename == "-" && std::string{mod_filename} == "-") {
+        std::cerr << "Only one of <base> and <modified> can be read from stdin\n";
         return -1;
     }
 
+    if (batch.cache && base_filename != "-" && std::string{mod_filename} != "-") {
+        try {
+            return diff_cached(base_filename.c_str(), mod_filename, batch.cache);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
+        }
+    }
+
     Fuxstate base;
-    base.load(argc[1]);
+    auto loaded = base.load(base_filename.c_str());
+    if (!loaded) {
+        std::cerr << base_filename << ": " << loaded.error().message() << "\n";
+        return -1;
+    }
 
     Fuxstate mod;
-    mod.load(argc[2]);
+    loaded = mod.load(mod_filename);
+    if (!loaded) {
+        std::cerr << mod_filename << ": " << loaded.error().message() << "\n";
+        return -1;
+    }
 
-    base.diff(mod);
+    auto diffed = base.diff(mod, std::cout);
+    if (!diffed) {
+        std::cerr << mod_filename << ": " << diffed.error().message() << "\n";
+        return -1;
+    }
 }
@@ -0,0 +1,448 @@
+/*
+    fuxstate.cpp: Fux! state files and the MML between them
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fuxstate.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <streambuf>
+#include <string>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "hash.h"
+#include "store.h"
+
+using namespace boost::endian;
+namespace pt = boost::property_tree;
+
+std::ostream& operator<<(std::ostream& s, Tag tag) {
+    for (auto c : tag) {
+        s << c;
+    }
+
+    return s;
+}
+// whether a tag read straight into place differs from other's copy
+template <typename T>
+static bool differs(const T& a, const T& b)
+{
+    return std::memcmp(&a, &b, sizeof(T)) != 0;
+}
+
+Expected<pt::ptree> Fuxstate::diff_tree(Fuxstate& other)
+{
+    // checked up front, so nothing is written for a state that fails
+    for (auto i = 0; i < damage_responses.size(); ++i) {
+        if (damage_responses[i].type != other.damage_responses[i].type) {
+            return Error{"Damage response " + std::to_string(i) + " changes its damage type", -1, "'Damg'"};
+        }
+    }
+
+    if (other.annotation_definition.font != 4 && other.annotation_definition.font != 22) {
+        return Error{"Unsupported overhead map font " + std::to_string(other.annotation_definition.font), -1, "'Mptx'"};
+    }
+
+    pt::ptree tree;
+
+    tree.add("<xmlcomment>", "Generated by fuxdiff");
+
+    // a tag whose bytes match base's adds nothing, so its section is
+    // skipped without comparing it field by field
+    if (differs(control_panels, other.control_panels)) {
+        for (auto i = 0; i < control_panels.size(); ++i) {
+            auto child = control_panels[i].diff(i, other.control_panels[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.control_panels.panel", child.get_child("panel"));
+            }
+        }
+    }
+    
+    if (differs(fade_definitions, other.fade_definitions)) {
+        for (auto i = 0; i < fade_definitions.size(); ++i) {
+            auto child = fade_definitions[i].diff(i, other.fade_definitions[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.faders.fader", child.get_child("fader"));
+            }
+        }
+    }
+
+    if (differs(infravision_colors, other.infravision_colors)) {
+        for (auto i = 0; i < infravision_colors.size(); ++i) {
+            auto child = infravision_colors[i].diff(i, other.infravision_colors[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.infravision.color", child.get_child("color"));
+            }
+        }
+    }
+
+    // overhead map colors
+    if (differs(polygon_colors, other.polygon_colors)) {
+        for (auto i = 0; i < polygon_colors.size(); ++i) {
+            auto color_tree = polygon_colors[i].diff(i, other.polygon_colors[i]);
+            if (!color_tree.empty()) {
+                tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+            }
+        }
+    }
+    
+    if (differs(line_definitions, other.line_definitions)) {
+        for (auto i = 0; i < line_definitions.size(); ++i) {
+            auto color_tree = line_definitions[i].color.diff(i + 8, other.line_definitions[i].color);
+            if (!color_tree.empty()) {
+                tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+            }
+        }
+    }
+
+    if (differs(annotation_definition, other.annotation_definition)) {
+        auto color_tree = annotation_definition.color.diff(16, other.annotation_definition.color);
+        if (!color_tree.empty()) {
+            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+        }
+    }
+
+    if (differs(map_name_color, other.map_name_color)) {
+        auto color_tree = map_name_color.diff(17, other.map_name_color);
+        if (!color_tree.empty()) {
+            tree.add_child("marathon.overhead_map.color", color_tree.get_child("color"));
+        }
+    }
+
+    // overhead map lines
+    if (differs(line_definitions, other.line_definitions)) {
+        for (auto i = 0 ; i < line_definitions.size(); ++i) {
+            for (auto j = 0; j < line_definitions[i].pen_sizes.size(); ++j) {
+                if (line_definitions[i].pen_sizes[j] != other.line_definitions[i].pen_sizes[j])
+                {
+                    pt::ptree line_tree;
+                    line_tree.put("line.<xmlattr>.type", i);
+                    line_tree.put("line.<xmlattr>.scale", j);
+                    line_tree.put("line.<xmlattr>.width", other.line_definitions[i].pen_sizes[j]);
+                    tree.add_child("marathon.overhead_map.line", line_tree.get_child("line"));
+                }
+            }
+        }
+    }
+
+    // overhead map fonts
+    if (differs(annotation_definition, other.annotation_definition)) {
+        for (auto i = 0; i < annotation_definition.sizes.size(); ++i) {
+            if (annotation_definition.font != other.annotation_definition.font ||
+                annotation_definition.face != other.annotation_definition.face ||
+                annotation_definition.sizes[i] != other.annotation_definition.sizes[i]) {
+                pt::ptree font_tree;
+                font_tree.put("font.<xmlattr>.index", i);
+                switch (other.annotation_definition.font) {
+                case 4:
+                    font_tree.put("font.<xmlattr>.name", "Monaco");
+                    break;
+                case 22:
+                    font_tree.put("font.<xmlattr>.name", "Courier");
+                    break;
+                }
+                font_tree.put("font.<xmlattr>.size", other.annotation_definition.sizes[i]);
+                font_tree.put("font.<xmlattr>.style", other.annotation_definition.face);
+                tree.add_child("marathon.overhead_map.font", font_tree.get_child("font"));
+            }
+        }
+    }
+    
+    if (differs(damage_responses, other.damage_responses)) {
+        for (auto i = 0; i < damage_responses.size(); ++i) {
+            auto child = damage_responses[i].diff(other.damage_responses[i], i);
+            if (!child.empty()) {
+                tree.add_child("marathon.player.damage", child.get_child("damage"));
+            }
+        }
+    }
+    
+    if (differs(media_definitions, other.media_definitions)) {
+        for (auto i = 0; i < media_definitions.size(); ++i) {
+            auto child = media_definitions[i].diff(i, other.media_definitions[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.liquids.liquid", child.get_child("liquid"));
+            }
+        }
+    }
+
+    if (differs(random_sounds, other.random_sounds)) {
+        for (auto i = 0; i < random_sounds.size(); ++i) {
+            if (random_sounds[i] != other.random_sounds[i]) {
+                pt::ptree random_tree;
+                random_tree.put("random.<xmlattr>.index", i);
+                random_tree.put("random.<xmlattr>.sound", other.random_sounds[i]);
+
+                tree.add_child("marathon.sounds.random", random_tree.get_child("random"));
+            }
+        }
+    }
+
+    if (differs(scenery_definitions, other.scenery_definitions)) {
+        for (auto i = 0; i < scenery_definitions.size(); ++i) {
+            auto child = scenery_definitions[i].diff(i, other.scenery_definitions[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.scenery.object", child.get_child("object"));
+            }
+        }
+    }
+
+    if (differs(weapon_interface_definitions, other.weapon_interface_definitions)) {
+        for (auto i = 0; i < weapon_interface_definitions.size(); ++i) {
+            auto child = weapon_interface_definitions[i].diff(i, other.weapon_interface_definitions[i]);
+            if (!child.empty()) {
+                tree.add_child("marathon.interface.weapon", child.get_child("weapon"));
+            }
+        }
+    }
+
+    auto physics_differ = false;
+    
+    for (auto kvp : tags) {
+        if (other.tags[kvp.first] != kvp.second) {
+            if (kvp.first == Tag{'E','f','f','x'} ||
+                kvp.first == Tag{'I','t','e','m'} ||
+                kvp.first == Tag{'M','o','n','s'} ||
+                kvp.first == Tag{'P','r','o','j'} ||
+                kvp.first == Tag{'W','e','p','1'})
+            {
+                physics_differ = true;
+            } else if (kvp.first == Tag{'I','v','r','m'}) {
+                std::cerr << "'Ivrm' differs, but Aleph One does not support 8-bit infravision MML\n";
+            } else {
+                std::cerr << kvp.first << " differs (" << other.tags[kvp.first].size() << ")\n";
+            }
+        }
+    }
+
+    if (physics_differ) {
+        std::cerr << "Physics models differ\n";
+    }
+
+    return tree;
+}
+
+Expected<void> Fuxstate::diff(Fuxstate& other, std::ostream& out)
+{
+    auto tree = diff_tree(other);
+    if (!tree) {
+        return tree.error();
+    }
+
+    pt::xml_writer_settings<std::string> settings(' ', 4);
+    pt::write_xml(out, *tree, settings);
+    return Expected<void>{};
+}
+
+std::size_t Fuxstate::memory_usage() const
+{
+    // tree nodes carry three pointers and a color besides their value
+    const std::size_t node = 4 * sizeof(void*);
+
+    auto size = sizeof(*this);
+    for (auto& kvp : tags) {
+        size += node + sizeof(kvp) + kvp.second.capacity();
+    }
+
+    return size;
+}
+
+Expected<void> Fuxstate::load(const char* filename)
+{
+    if (std::string{filename} == "-") {
+        return load(std::cin);
+    }
+
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs) {
+        return Error{std::string{"Unable to open "} + filename};
+    }
+
+    // a manifest is read whole from its store in place of the file;
+    // anything else is streamed
+    std::vector<uint8_t> data(manifest_header_size);
+    ifs.read(reinterpret_cast<char*>(data.data()), data.size());
+    data.resize(ifs.gcount());
+
+    if (is_manifest(Span{data.data(), data.size()})) {
+        data.insert(data.end(), std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        auto expanded = expand_manifest(filename, data);
+        if (!expanded) {
+            return expanded.error();
+        }
+
+        return load(Span{data.data(), data.size()});
+    }
+
+    ifs.clear();
+    ifs.seekg(0);
+    return load(ifs);
+}
+
+Expected<void> Fuxstate::load(const MappedFile& file)
+{
+    if (is_manifest(file.span())) {
+        std::vector<uint8_t> data(file.data(), file.data() + file.size());
+        auto expanded = expand_manifest(file.path(), data);
+        if (!expanded) {
+            return expanded.error();
+        }
+
+        return load(Span{data.data(), data.size()});
+    }
+
+    return load(file.span());
+}
+
+std::vector<Span> Fuxstate::tag_data(Span file)
+{
+    std::vector<Span> data;
+
+    std::size_t offset = 0;
+    while (offset + sizeof(Header) <= file.size) {
+        auto header = reinterpret_cast<const Header*>(file.data + offset);
+        offset += sizeof(Header);
+
+        data.push_back(Span{file.data + offset, std::min<std::size_t>(header->length, file.size - offset)});
+        offset += header->length;
+    }
+
+    return data;
+}
+
+std::vector<uint64_t> Fuxstate::tag_fingerprints(Span file)
+{
+    static const std::size_t piece_size = 32;
+
+    std::vector<uint64_t> fingerprints;
+
+    std::size_t offset = 0;
+    while (offset + sizeof(Header) <= file.size) {
+        auto header = reinterpret_cast<const Header*>(file.data + offset);
+        offset += sizeof(Header);
+
+        auto length = std::min<std::size_t>(header->length, file.size - offset);
+        auto tag = static_cast<uint64_t>(load_big_u32(reinterpret_cast<const uint8_t*>(header->tag.data()))) << 32;
+        for (std::size_t piece = 0; piece * piece_size < length; ++piece) {
+            auto size = std::min(piece_size, length - piece * piece_size);
+            fingerprints.push_back(hash64(file.data + offset + piece * piece_size, size, tag | piece));
+        }
+
+        // an empty tag still counts
+        if (!length) {
+            fingerprints.push_back(hash64(&tag, sizeof(tag)));
+        }
+
+        offset += header->length;
+    }
+
+    return fingerprints;
+}
+
+// reads a file already in memory without copying it
+class MemoryBuffer : public std::streambuf {
+public:
+    MemoryBuffer(Span data) {
+        auto p = const_cast<char*>(reinterpret_cast<const char*>(data.data));
+        setg(p, p, p + data.size);
+    }
+};
+
+Expected<void> Fuxstate::load(Span file)
+{
+    MemoryBuffer buffer(file);
+    std::istream s(&buffer);
+    return load(s);
+}
+
+Expected<void> Fuxstate::load(std::istream& s)
+{
+    // tags with a fixed layout are read straight into place
+    const struct {
+        Tag tag;
+        void* data;
+        uint32_t length;
+    } fixed_tags[] = {
+        {{'C','l','f','x'}, fade_definitions.data(), 768},
+        {{'D','a','m','g'}, damage_responses.data(), 288},
+        {{'I','v','c','l'}, infravision_colors.data(), 24},
+        {{'M','d','i','a'}, media_definitions.data(), 260},
+        {{'M','p','l','n'}, line_definitions.data(), 42},
+        {{'M','p','n','c'}, &map_name_color, 6},
+        {{'M','p','p','l'}, polygon_colors.data(), 36},
+        {{'M','p','t','x'}, &annotation_definition, 18},
+        {{'P','a','n','l'}, control_panels.data(), 1188},
+        {{'R','a','n','d'}, random_sounds.data(), 10},
+        {{'S','c','n','r'}, scenery_definitions.data(), 732},
+        // there's no meaningful way to translate this to MML; skip
+        // without seeking so pipes work
+        {{'T','y','p','e'}, nullptr, 28},
+        {{'W','e','p','2'}, weapon_interface_definitions.data(), 580},
+    };
+
+    auto tag_name = [](const Tag& tag) {
+        return "'" + std::string(tag.data(), tag.size()) + "'";
+    };
+
+    int64_t offset = 0;
+    for (;;) {
+        Header header;
+        if (!s.read(reinterpret_cast<char*>(&header), sizeof(Header))) {
+            if (s.gcount()) {
+                return Error{"Tag header truncated", offset};
+            }
+            break;
+        }
+
+        auto found = std::find_if(std::begin(fixed_tags), std::end(fixed_tags), [&](decltype(fixed_tags[0])& t) {
+            return t.tag == header.tag;
+        });
+
+        if (found != std::end(fixed_tags)) {
+            if (header.length != found->length) {
+                return Error{"Expected length " + std::to_string(found->length) + ", found " + std::to_string(header.length),
+                             offset + 4, tag_name(header.tag)};
+            }
+
+            if (found->data) {
+                s.read(static_cast<char*>(found->data), found->length);
+            } else {
+                s.ignore(found->length);
+            }
+
+            if (s.gcount() != found->length) {
+                return Error{"Tag data truncated", offset + static_cast<int64_t>(sizeof(Header) + s.gcount()), tag_name(header.tag)};
+            }
+        } else {
+            auto& v = tags[header.tag];
+            v.resize(header.length);
+            
+            if (!s.read(v.data(), v.size())) {
+                return Error{"Tag data truncated", offset + static_cast<int64_t>(sizeof(Header) + s.gcount()), tag_name(header.tag)};
+            }
+        }
+
+        offset += sizeof(Header) + header.length;
+    }
+
+    return Expected<void>{};
+}
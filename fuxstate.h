@@ -0,0 +1,488 @@
+/*
+    fuxstate.h: Fux! state files and the MML between them
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FUXSTATE_H
+#define FUXSTATE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <boost/endian/arithmetic.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "expected.h"
+#include "mapped_file.h"
+#include "rgb_color.h"
+
+using Tag = std::array<char, 4>;
+
+// 16.16 fixed point
+using big_fixed_t = boost::endian::big_int32_t;
+
+struct Header {
+    Tag tag;
+    boost::endian::big_uint32_t length;
+};
+
+using BigRGBColor = BasicRGBColor<boost::endian::big_uint16_t>;
+
+struct AnnotationDefinition {
+    BigRGBColor color;
+    boost::endian::big_int16_t font;
+    boost::endian::big_int16_t face;
+    std::array<boost::endian::big_int16_t, 4> sizes;
+};
+
+struct ControlPanelDefinition {
+    boost::property_tree::ptree diff(int index, const ControlPanelDefinition& other) {
+        boost::property_tree::ptree tree;
+
+        if (panel_class != other.panel_class ||
+            flags != other.flags ||
+            collection != other.collection ||
+            active_shape != other.active_shape ||
+            inactive_shape != other.inactive_shape ||
+            sounds != other.sounds ||
+            sound_frequency != other.sound_frequency ||
+            item != other.item)
+        {
+            tree.put("panel.<xmlattr>.index", index);
+            tree.put("panel.<xmlattr>.type", other.panel_class);
+            tree.put("panel.<xmlattr>.coll", other.collection);
+            tree.put("panel.<xmlattr>.active_frame", other.active_shape);
+            tree.put("panel.<xmlattr>.inactive_frame", other.inactive_shape);
+            tree.put("panel.<xmlattr>.pitch", other.sound_frequency / 65536.0);
+            tree.put("panel.<xmlattr>.item", other.item);
+            for (auto i = 0; i < sounds.size(); ++i) {
+                if (sounds[i] != other.sounds[i]) {
+                    boost::property_tree::ptree sound_tree;
+                    sound_tree.put("sound.<xmlattr>.type", i);
+                    sound_tree.put("sound.<xmlattr>.which", other.sounds[i]);
+
+                    tree.add_child("panel.sound", sound_tree.get_child("sound"));
+                }
+            }
+        }
+
+        return tree;
+    }
+    
+    boost::endian::big_int16_t panel_class;
+    boost::endian::big_uint16_t flags;
+
+    boost::endian::big_int16_t collection;
+    boost::endian::big_int16_t active_shape, inactive_shape;
+
+    std::array<boost::endian::big_int16_t, 3> sounds;
+    big_fixed_t sound_frequency;
+
+    boost::endian::big_int16_t item;
+};
+
+struct DamageDefinition {
+    boost::property_tree::ptree diff(const DamageDefinition& other) {
+        boost::property_tree::ptree tree;
+
+        if (type != other.type ||
+            flags != other.flags ||
+            base != other.base ||
+            random != other.random ||
+            scale != other.scale)
+        {
+            tree.put("damage.<xmlattr>.type", other.type);
+            tree.put("damage.<xmlattr>.flags", other.flags);
+            tree.put("damage.<xmlattr>.base", other.base);
+            tree.put("damage.<xmlattr>.random", other.random);
+            tree.put("damage.<xmlattr>.scale", other.scale / 65536.0);
+        }
+
+        return tree;
+    };
+    boost::endian::big_int16_t type;
+    boost::endian::big_int16_t flags;
+    boost::endian::big_int16_t base;
+    boost::endian::big_int16_t random;
+    big_fixed_t scale;
+};
+
+struct DamageResponse {
+    boost::property_tree::ptree diff(const DamageResponse& other, int index) {
+        boost::property_tree::ptree tree;
+
+        if (threshold != other.threshold ||
+            fade != other.fade ||
+            sound != other.sound ||
+            death_sound != other.death_sound ||
+            death_action != other.death_action)
+        {
+            tree.put("damage.<xmlattr>.index", index);
+            tree.put("damage.<xmlattr>.threshold", other.threshold);
+            tree.put("damage.<xmlattr>.fade", other.fade);
+            tree.put("damage.<xmlattr>.sound", other.sound);
+            tree.put("damage.<xmlattr>.death_sound", other.death_sound);
+            tree.put("damage.<xmlattr>.death_action", other.death_action);
+        }
+            
+        return tree;
+    }
+    
+    boost::endian::big_int16_t type;
+    boost::endian::big_int16_t threshold;
+
+    boost::endian::big_int16_t fade;
+    boost::endian::big_int16_t sound;
+    boost::endian::big_int16_t death_sound;
+    boost::endian::big_int16_t death_action;
+};
+
+struct FadeDefinition {
+    boost::property_tree::ptree diff(int index, const FadeDefinition& other) {
+        boost::property_tree::ptree tree;
+
+        if (proc != other.proc ||
+            color != other.color ||
+            initial_transparency != other.initial_transparency ||
+            final_transparency != other.final_transparency ||
+            period != other.period ||
+            flags != other.flags ||
+            priority != other.priority)
+        {
+            tree.put("fader.<xmlattr>.index", index);
+            tree.put("fader.<xmlattr>.type", other.proc);
+            tree.put("fader.<xmlattr>.initial_opacity",
+                     other.initial_transparency / 65536.0);
+            tree.put("fader.<xmlattr>.final_opacity",
+                     other.final_transparency / 65536.0);
+            tree.put("fader.<xmlattr>.period", other.period);
+            tree.put("fader.<xmlattr>.flags", other.flags);
+            tree.put("fader.<xmlattr>.priority", other.priority);
+
+            auto color_tree = color.diff(other.color);
+            if (!color_tree.empty()) {
+                tree.add_child("fader.color", color_tree.get_child("color"));
+            }
+        }
+
+        return tree;
+    }
+    
+    boost::endian::big_uint32_t proc;
+    BigRGBColor color;
+    big_fixed_t initial_transparency, final_transparency;
+    boost::endian::big_int16_t period;
+    boost::endian::big_uint16_t flags;
+    boost::endian::big_int16_t priority;
+};
+
+struct LineDefinition {
+    boost::property_tree::ptree diff(int index, const LineDefinition& other) {
+        boost::property_tree::ptree tree;
+
+        if (color != other.color ||
+            pen_sizes != other.pen_sizes)
+        {
+            auto color_tree = color.diff(other.color);
+            if (!color_tree.empty()) {
+                tree.add_child("line.color", color_tree.get_child("color"));
+            }
+
+            for (auto i = 0; i < pen_sizes.size(); ++i) {
+                if (pen_sizes[i] != other.pen_sizes[i]) {
+                    
+                }
+            }
+        }
+
+        return tree;
+    }
+    BigRGBColor color;
+    std::array<boost::endian::big_int16_t, 4> pen_sizes;
+};
+
+struct MediaDefinition {
+    boost::property_tree::ptree diff(int index, const MediaDefinition& other) {
+        boost::property_tree::ptree tree;
+        
+        auto damage_tree = damage.diff(other.damage);
+        if (collection != other.collection ||
+            shape != other.shape ||
+            shape_count != other.shape_count ||
+            /* shape_frequency is unused */
+            transfer_mode != other.transfer_mode ||
+            damage_frequency != other.damage_frequency ||
+            !damage_tree.empty() ||
+            detonation_effects != other.detonation_effects ||
+            sounds != other.sounds ||
+            submerged_fade_effect != other.submerged_fade_effect)
+        {
+            tree.put("liquid.<xmlattr>.index", index);
+            tree.put("liquid.<xmlattr>.coll", other.collection);
+            tree.put("liquid.<xmlattr>.frame", other.shape);
+            tree.put("liquid.<xmlattr>.transfer", other.transfer_mode);
+            tree.put("liquid.<xmlattr>.damage_freq", other.damage_frequency);
+            if (!damage_tree.empty()) {
+                 tree.add_child("liquid.damage", damage_tree.get_child("damage"));
+            }
+            for (auto i = 0; i < detonation_effects.size(); ++i) {
+                // TODO: should we always include these? or only when different?
+                if (detonation_effects[i] != other.detonation_effects[i]) {
+                    boost::property_tree::ptree effect_tree;
+                    effect_tree.put("effect.<xmlattr>.type", i);
+                    effect_tree.put("effect.<xmlattr>.which", other.detonation_effects[i]);
+                    tree.add_child("liquid.effect", effect_tree.get_child("effect"));
+                }
+            }
+            for (auto i = 0; i < sounds.size(); ++i) {
+                // TODO: should we always include these? or only when different?
+                if (sounds[i] != other.sounds[i]) {
+                    boost::property_tree::ptree sound_tree;
+                    sound_tree.put("sound.<xmlattr>.type", i);
+                    sound_tree.put("sound.<xmlattr>.which", other.sounds[i]);
+                    tree.add_child("liquid.sound", sound_tree.get_child("sound"));
+                }
+            }
+            tree.put("liquid.<xmlattr>.submerged", other.submerged_fade_effect);
+        }
+
+        return tree;
+    };
+    
+    boost::endian::big_int16_t collection;
+    boost::endian::big_int16_t shape;
+    boost::endian::big_int16_t shape_count;
+    boost::endian::big_int16_t shape_frequency;
+    boost::endian::big_int16_t transfer_mode;
+    boost::endian::big_int16_t damage_frequency;
+    DamageDefinition damage;
+
+    std::array<boost::endian::big_int16_t, 4> detonation_effects;
+    std::array<boost::endian::big_int16_t, 9> sounds;
+    boost::endian::big_int16_t submerged_fade_effect;
+};
+
+struct SceneryDefinition {
+    boost::property_tree::ptree diff(int index, const SceneryDefinition& other) {
+        boost::property_tree::ptree tree;
+        if (flags != other.flags ||
+            shape != other.shape ||
+            radius != other.radius ||
+            height != other.height ||
+            destroyed_effect != other.destroyed_effect ||
+            destroyed_shape != other.destroyed_shape)
+        {
+            tree.put("object.<xmlattr>.index", index);
+            tree.put("object.<xmlattr>.flags", other.flags);
+            tree.put("object.<xmlattr>.radius", other.radius);
+            tree.put("object.<xmlattr>.height", other.height);
+            tree.put("object.<xmlattr>.destruction", other.destroyed_effect);
+
+            if (shape != other.shape) {
+                boost::property_tree::ptree child;
+                child.put("shape.<xmlattr>.coll", (other.shape >> 8) & 0x1f);
+                child.put("shape.<xmlattr>.clut", other.shape >> 11);
+                child.put("shape.<xmlattr>.seq", other.shape & 0xff);
+
+                tree.add_child("object.normal.shape", child.get_child("shape"));
+            }
+
+            if (destroyed_shape != other.destroyed_shape) {
+                boost::property_tree::ptree child;
+                child.put("shape.<xmlattr>.coll", (other.destroyed_shape >> 8) & 0x1f);
+                child.put("shape.<xmlattr>.clut", (other.destroyed_shape >> 11));
+                child.put("shape.<xmlattr>.seq", (other.destroyed_shape & 0xff));
+
+                tree.add_child("object.destroyed.shape", child.get_child("shape"));
+            }
+        }
+
+        return tree;
+    }
+    
+    boost::endian::big_uint16_t flags;
+    boost::endian::big_uint16_t shape;
+
+    boost::endian::big_int16_t radius, height;
+
+    boost::endian::big_int16_t destroyed_effect;
+    boost::endian::big_uint16_t destroyed_shape;
+};
+
+struct WeaponInterfaceAmmoDefinition {
+    boost::property_tree::ptree diff(int index, const WeaponInterfaceAmmoDefinition& other) {
+        boost::property_tree::ptree tree;
+
+        if (type != other.type ||
+            screen_left != other.screen_left ||
+            screen_top != other.screen_top ||
+            ammo_across != other.ammo_across ||
+            ammo_down != other.ammo_down ||
+            delta_x != other.delta_x ||
+            delta_y != other.delta_y ||
+            bullet != other.bullet ||
+            empty_bullet != other.empty_bullet ||
+            right_to_left != other.right_to_left)
+        {
+            tree.put("ammo.<xmlattr>.index", index);
+            tree.put("ammo.<xmlattr>.type", other.type);
+            tree.put("ammo.<xmlattr>.left", other.screen_left);
+            tree.put("ammo.<xmlattr>.top", other.screen_top);
+            tree.put("ammo.<xmlattr>.across", other.ammo_across);
+            tree.put("ammo.<xmlattr>.down", other.ammo_down);
+            tree.put("ammo.<xmlattr>.delta_x", other.delta_x);
+            tree.put("ammo.<xmlattr>.delta_y", other.delta_y);
+            tree.put("ammo.<xmlattr>.bullet_shape", other.bullet);
+            tree.put("ammo.<xmlattr>.empty_shape", other.empty_bullet);
+            tree.put("ammo.<xmlattr>.right_to_left", other.right_to_left != 0);
+        }
+
+        return tree;
+    }
+    
+    boost::endian::big_int16_t type;
+    boost::endian::big_int16_t screen_left;
+    boost::endian::big_int16_t screen_top;
+    boost::endian::big_int16_t ammo_across;
+    boost::endian::big_int16_t ammo_down;
+    boost::endian::big_int16_t delta_x;
+    boost::endian::big_int16_t delta_y;
+    boost::endian::big_int16_t bullet;
+    boost::endian::big_int16_t empty_bullet;
+    boost::endian::big_uint16_t right_to_left;
+};
+
+inline bool operator==(const WeaponInterfaceAmmoDefinition& a, const WeaponInterfaceAmmoDefinition& b)
+{
+    return a.type == b.type &&
+        a.screen_left == b.screen_left &&
+        a.screen_top == b.screen_top &&
+        a.ammo_across == b.ammo_across &&
+        a.ammo_down == b.ammo_down &&
+        a.delta_x == b.delta_x &&
+        a.delta_y == b.delta_y &&
+        a.bullet == b.bullet &&
+        a.empty_bullet == b.empty_bullet &&
+        a.right_to_left == b.right_to_left;
+}
+
+inline bool operator!=(const WeaponInterfaceAmmoDefinition& a, const WeaponInterfaceAmmoDefinition& b)
+{
+    return !(a == b);
+}
+
+struct WeaponInterfaceDefinition {
+    boost::property_tree::ptree diff(int index, const WeaponInterfaceDefinition& other) {
+        boost::property_tree::ptree tree;
+        if (item_id != other.item_id) {
+            std::cerr << "Weapon HUD items changed; Aleph One does not support this!\n";
+        }
+        
+        if (weapon_panel_shape != other.weapon_panel_shape ||
+            weapon_name_start_y != other.weapon_name_start_y ||
+            weapon_name_end_y != other.weapon_name_end_y ||
+            weapon_name_start_x != other.weapon_name_start_x ||
+            weapon_name_end_x != other.weapon_name_end_x ||
+            standard_weapon_panel_top != other.standard_weapon_panel_top ||
+            standard_weapon_panel_left != other.standard_weapon_panel_left ||
+            multi_weapon != other.multi_weapon ||
+            ammo_data[0] != other.ammo_data[0] ||
+            ammo_data[1] != other.ammo_data[1])
+        {
+            tree.put("weapon.<xmlattr>.index", index);
+            tree.put("weapon.<xmlattr>.shape", other.weapon_panel_shape);
+            tree.put("weapon.<xmlattr>.start_y", other.weapon_name_start_y);
+            tree.put("weapon.<xmlattr>.end_y", other.weapon_name_end_y);
+            tree.put("weapon.<xmlattr>.start_x", other.weapon_name_start_x);
+            tree.put("weapon.<xmlattr>.end_x", other.weapon_name_end_x);
+            tree.put("weapon.<xmlattr>.top", other.standard_weapon_panel_top);
+            tree.put("weapon.<xmlattr>.left", other.standard_weapon_panel_left);
+            tree.put("weapon.<xmlattr>.multiple", other.multi_weapon != 0);
+
+            for (auto i = 0; i < 2; ++i) {
+                auto ammo_tree = ammo_data[i].diff(i, other.ammo_data[i]);
+                if (!ammo_tree.empty()) {
+                    tree.add_child("weapon.ammo", ammo_tree.get_child("ammo"));
+                }
+            }
+        }
+
+        return tree;
+    }
+    
+    boost::endian::big_int16_t item_id;
+    boost::endian::big_int16_t weapon_panel_shape;
+    boost::endian::big_int16_t weapon_name_start_y;
+    boost::endian::big_int16_t weapon_name_end_y;
+    boost::endian::big_int16_t weapon_name_start_x;
+    boost::endian::big_int16_t weapon_name_end_x;
+    boost::endian::big_int16_t standard_weapon_panel_top;
+    boost::endian::big_int16_t standard_weapon_panel_left;
+    boost::endian::big_uint16_t multi_weapon;
+
+    WeaponInterfaceAmmoDefinition ammo_data[2];
+};
+
+class Fuxstate {
+public:
+    // writes MML that turns this state into other, or fails if other
+    // changes something MML cannot express
+    Expected<void> diff(Fuxstate& other, std::ostream& out);
+
+    // the document diff() writes, with its sections under "marathon";
+    // what MML cannot express is noted on stderr
+    Expected<boost::property_tree::ptree> diff_tree(Fuxstate& other);
+
+    // fail on a tag of the wrong length or a truncated file, with offsets
+    // into the file. A manifest in an object store is read as the file it
+    // describes
+    Expected<void> load(const char* filename);
+    Expected<void> load(const MappedFile& file);
+    Expected<void> load(std::istream& s);
+    Expected<void> load(Span file);
+
+    // where each tag's data lies in file, which must have loaded
+    static std::vector<Span> tag_data(Span file);
+
+    // one for each 32-byte piece of each tag in file, covering the tag,
+    // the piece's place in it and its contents; a state's sketch is made
+    // from these, as there are too few tags to tell states apart by
+    static std::vector<uint64_t> tag_fingerprints(Span file);
+
+    // roughly the bytes held by everything decoded
+    std::size_t memory_usage() const;
+
+    AnnotationDefinition annotation_definition;
+    std::array<ControlPanelDefinition, 54> control_panels;
+    std::array<DamageResponse, 24> damage_responses;
+    std::array<FadeDefinition, 32> fade_definitions;
+    std::array<BigRGBColor, 4> infravision_colors;
+    std::array<LineDefinition, 3> line_definitions;
+    BigRGBColor map_name_color;
+    std::array<MediaDefinition, 5> media_definitions;
+    std::array<BigRGBColor, 6> polygon_colors;
+    std::array<boost::endian::big_int16_t, 5> random_sounds;
+    std::array<SceneryDefinition, 61> scenery_definitions;
+    std::map<Tag, std::vector<char>> tags;
+    std::array<WeaponInterfaceDefinition, 10> weapon_interface_definitions;
+};
+
+
+#endif
@@ -0,0 +1,120 @@
+/*
+    hash.cpp: fast non-cryptographic hashing for resource and string fingerprints
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hash.h"
+
+#include <cstring>
+
+static const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t prime3 = 0x165667b19e3779f9ULL;
+static const uint64_t prime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t prime5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// unaligned little-endian loads; the byte loop folds to a single mov on
+// x86 and ARM
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (auto i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t v)
+{
+    acc ^= round(0, v);
+    return acc * prime1 + prime4;
+}
+
+uint64_t hash64(const void* data, std::size_t length, uint64_t seed)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    auto end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+
+        auto limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+
+    h += length;
+
+    while (p + 8 <= end) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= read32(p) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= *p * prime5;
+        h = rotl(h, 11) * prime1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+
+    return h;
+}
@@ -0,0 +1,34 @@
+/*
+    hash.h: fast non-cryptographic hashing for resource and string fingerprints
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// XXH64; not suitable for anything adversarial
+uint64_t hash64(const void* data, std::size_t length, uint64_t seed = 0);
+
+inline uint64_t hash64(const std::string& s, uint64_t seed = 0)
+{
+    return hash64(s.data(), s.size(), seed);
+}
+
+#endif
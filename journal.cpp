@@ -0,0 +1,203 @@
+/*
+    journal.cpp: record of finished batch inputs, for resuming runs
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "mapped_file.h"
+
+Expected<uint64_t> hash_file(const char* path, uint64_t seed)
+{
+    try {
+        MappedFile file{path};
+        return hash64(file.data(), file.size(), seed);
+    } catch (const std::exception& e) {
+        return Error{e.what()};
+    }
+}
+
+static std::string hex(uint64_t n)
+{
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016" PRIx64, n);
+    return buf;
+}
+
+// tabs and line breaks would split a record
+static std::string field(const std::string& s)
+{
+    auto f = s;
+    for (auto& c : f) {
+        if (c == '\t' || c == '\n' || c == '\r') {
+            c = ' ';
+        }
+    }
+    return f;
+}
+
+// the hash in the field starting at pos, which must be followed by a tab
+static bool parse_hash(const std::string& line, std::size_t pos, uint64_t& hash)
+{
+    if (line.size() < pos + 17 || line[pos + 16] != '\t') {
+        return false;
+    }
+
+    hash = 0;
+    for (auto i = pos; i < pos + 16; ++i) {
+        auto c = line[i];
+        if (c >= '0' && c <= '9') {
+            hash = (hash << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            hash = (hash << 4) | (c - 'a' + 10);
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Journal::Journal(const std::string& path, const std::string& output_dir, uint64_t base, std::size_t sync_every) :
+    path_{path},
+    fd_{-1},
+    dir_fd_{-1},
+    base_{base},
+    sync_every_{sync_every ? sync_every : 1},
+    pending_{0}
+{
+    // everything up to the last complete line is kept
+    off_t complete = 0;
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        std::string line;
+        while (std::getline(ifs, line) && !ifs.eof()) {
+            complete += line.size() + 1;
+
+            // a later record of the same input replaces an earlier one
+            uint64_t key;
+            uint64_t output_hash;
+            if (parse_hash(line, 0, key) && parse_hash(line, 34, output_hash)) {
+                done_[key] = output_hash;
+            }
+        }
+    }
+
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error("Unable to open " + path + ": " + std::strerror(errno));
+    }
+
+    // so the next record does not run on from a torn one
+    if (ftruncate(fd_, complete) < 0) {
+        auto error = errno;
+        close(fd_);
+        throw std::runtime_error("Unable to truncate " + path + ": " + std::strerror(error));
+    }
+
+    if (complete == 0) {
+        std::string header{"key\tinput hash\toutput hash\tinput\toutput\n"};
+        if (write(fd_, header.data(), header.size()) != static_cast<ssize_t>(header.size())) {
+            auto error = errno;
+            close(fd_);
+            throw std::runtime_error("Unable to write " + path + ": " + std::strerror(error));
+        }
+    }
+
+    dir_fd_ = open(output_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+Journal::~Journal()
+{
+    sync();
+
+    close(fd_);
+    if (dir_fd_ >= 0) {
+        close(dir_fd_);
+    }
+}
+
+uint64_t Journal::key(const std::string& input, const std::string& output, uint64_t input_hash) const
+{
+    return hash64(output, hash64(input, input_hash ^ base_));
+}
+
+bool Journal::finished(uint64_t key, const std::string& output) const
+{
+    auto it = done_.find(key);
+    if (it == done_.end()) {
+        return false;
+    }
+
+    auto output_hash = hash_file(output.c_str());
+    return output_hash && *output_hash == it->second;
+}
+
+Expected<void> Journal::record(uint64_t key, uint64_t input_hash, const std::string& input, const std::string& output, uint64_t output_hash)
+{
+    auto line = hex(key) + "\t" + hex(input_hash) + "\t" + hex(output_hash) + "\t" + field(input) + "\t" + field(output) + "\n";
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // O_APPEND keeps the line in one piece
+    if (write(fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        return Error{"Unable to write " + path_ + ": " + std::strerror(errno)};
+    }
+
+    if (++pending_ >= sync_every_) {
+        return sync_locked();
+    }
+
+    return Expected<void>{};
+}
+
+Expected<void> Journal::sync()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sync_locked();
+}
+
+Expected<void> Journal::sync_locked()
+{
+    if (!pending_) {
+        return Expected<void>{};
+    }
+
+    // a record must not reach the disk before its output does; one
+    // syncfs covers every output since the last sync, where fsyncing
+    // each would cost a flush per file
+    if (dir_fd_ >= 0 && syncfs(dir_fd_) < 0) {
+        return Error{"Unable to sync outputs: " + std::string{std::strerror(errno)}};
+    }
+
+    if (fdatasync(fd_) < 0) {
+        return Error{"Unable to sync " + path_ + ": " + std::strerror(errno)};
+    }
+
+    pending_ = 0;
+    return Expected<void>{};
+}
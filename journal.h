@@ -0,0 +1,84 @@
+/*
+    journal.h: record of finished batch inputs, for resuming runs
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "expected.h"
+
+// the XXH64 of a file's contents, read through a mapping
+Expected<uint64_t> hash_file(const char* path, uint64_t seed = 0);
+
+// the inputs a batch run has finished, so that a run which is
+// interrupted or repeated skips them. Each is appended as one
+// tab-separated line: key, input hash, output hash, input path, output
+// path. Lines reach the disk every sync_every records, after the outputs
+// they name; a line torn by a crash is ignored when the journal is loaded.
+// An input only counts as finished while its output is still as recorded
+class Journal {
+public:
+    // loads what path already records, then opens it for appending.
+    // base identifies what inputs are diffed against, so a run against
+    // another base or with another tool finds nothing to skip. Throws
+    // std::runtime_error if the journal cannot be opened
+    Journal(const std::string& path, const std::string& output_dir, uint64_t base, std::size_t sync_every);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // what an input is recorded under: its path and contents, and where
+    // its output goes
+    uint64_t key(const std::string& input, const std::string& output, uint64_t input_hash) const;
+
+    // whether a previous run finished key, and output still holds what it
+    // wrote; safe from any thread
+    bool finished(uint64_t key, const std::string& output) const;
+    std::size_t size() const { return done_.size(); }
+
+    // records that input, whose contents hash to input_hash, was written
+    // to output; may be called from any thread
+    Expected<void> record(uint64_t key, uint64_t input_hash, const std::string& input, const std::string& output, uint64_t output_hash);
+
+    // flushes the outputs written so far, then the records naming them
+    Expected<void> sync();
+
+private:
+    Expected<void> sync_locked();
+
+    std::string path_;
+    int fd_;
+    int dir_fd_;
+    uint64_t base_;
+
+    // the hash of each finished input's output, by key; only filled while
+    // loading, so lookups need no lock
+    std::unordered_map<uint64_t, uint64_t> done_;
+
+    std::size_t sync_every_;
+    std::size_t pending_;
+    std::mutex mutex_;
+};
+
+#endif
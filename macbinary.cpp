@@ -0,0 +1,934 @@
+/*
+    macbinary.cpp: Marathon engines and the MML between them
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "macbinary.h"
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "dcmp.h"
+#include "hash.h"
+#include "macroman.h"
+#include "myers.h"
+#include "store.h"
+
+using namespace boost::endian;
+namespace pt = boost::property_tree;
+
+// Aleph One's interface MML covers the first 26 clut 130 colors and the
+// first 18 nrct 128 rectangles
+static const std::size_t max_interface_colors = 26;
+static const std::size_t max_interface_rects = 18;
+
+MacBinary::MacBinary(const char* filename, ThreadPool* pool) : pool_{pool}, deferred_{false}, fork_position_{0}
+{
+    Expected<void> loaded;
+    if (std::string{filename} == "-") {
+        loaded = load(std::cin);
+    } else {
+        loaded = load(std::unique_ptr<MappedFile>{new MappedFile{filename}});
+    }
+
+    if (!loaded) {
+        throw Exception(loaded.error().message());
+    }
+}
+
+MacBinary::MacBinary(std::istream& stream, ThreadPool* pool) : pool_{pool}, deferred_{false}, fork_position_{0}
+{
+    auto loaded = load(stream);
+    if (!loaded) {
+        throw Exception(loaded.error().message());
+    }
+}
+
+Expected<std::unique_ptr<MacBinary>> MacBinary::create(std::vector<uint8_t> file, ThreadPool* pool, bool deferred)
+{
+    std::unique_ptr<MacBinary> binary{new MacBinary{pool}};
+    binary->deferred_ = deferred;
+    binary->input_ = std::move(file);
+
+    auto loaded = binary->load(Span{binary->input_.data(), binary->input_.size()});
+    if (!loaded) {
+        return loaded.error();
+    }
+
+    return binary;
+}
+
+Expected<std::unique_ptr<MacBinary>> MacBinary::create(std::unique_ptr<MappedFile> file, ThreadPool* pool, bool deferred)
+{
+    std::unique_ptr<MacBinary> binary{new MacBinary{pool}};
+    binary->deferred_ = deferred;
+
+    auto loaded = binary->load(std::move(file));
+    if (!loaded) {
+        return loaded.error();
+    }
+
+    return binary;
+}
+
+std::size_t MacBinary::memory_usage() const
+{
+    // tree nodes carry three pointers and a color besides their value
+    const std::size_t node = 4 * sizeof(void*);
+
+    std::size_t size = sizeof(*this) + input_.capacity() + buffer_.capacity() + arena_.capacity();
+    size += resources_.size() * (node + sizeof(decltype(resources_)::value_type));
+
+    for (auto strings : {&strings_, &menu_strings_}) {
+        for (auto& id : *strings) {
+            size += node + sizeof(id) + id.second.capacity() * sizeof(StringView);
+        }
+    }
+
+    size += jobs_.capacity() * sizeof(Job);
+    size += compressed_.size() * (node + sizeof(decltype(compressed_)::value_type));
+    size += interface_colors_.capacity() * sizeof(RGBColor);
+    size += interface_rects_.capacity() * sizeof(Rect);
+
+    return size;
+}
+
+Expected<void> MacBinary::load(Span file)
+{
+    auto forks = find_forks(file, buffer_);
+    if (!forks) {
+        return forks.error();
+    }
+
+    container_ = forks->container;
+    if (container_ != Container::BinHex) {
+        fork_position_ = forks->resource.data - file.data;
+    }
+
+    return load_resources(forks->resource);
+}
+
+Expected<void> MacBinary::load(std::unique_ptr<MappedFile> file)
+{
+    // a manifest is read whole from its store in place of the file
+    if (is_manifest(file->span())) {
+        input_.assign(file->data(), file->data() + file->size());
+        auto expanded = expand_manifest(file->path(), input_);
+        if (!expanded) {
+            return expanded.error();
+        }
+
+        return load(Span{input_.data(), input_.size()});
+    }
+
+    file_ = std::move(file);
+    return load(file_->span());
+}
+
+Expected<void> MacBinary::load(std::istream& stream)
+{
+    std::array<uint8_t, macbinary_header_size> header;
+    stream.read(reinterpret_cast<char*>(header.data()), header.size());
+
+    if (stream && is_macbinary(header.data())) {
+        container_ = Container::MacBinary;
+        auto fork = macbinary_resource_fork(header.data());
+
+        // the data fork is never needed
+        stream.ignore(fork.offset - header.size());
+
+        input_.resize(fork.length);
+        if (!stream.read(reinterpret_cast<char*>(input_.data()), input_.size())) {
+            return Error{"Resource fork extends past end of file", 87};
+        }
+
+        fork_position_ = fork.offset;
+        return load_resources(Span{input_.data(), input_.size()});
+    }
+
+    // other containers are located by offsets that may point anywhere,
+    // so take the whole stream
+    input_.assign(header.begin(), header.begin() + stream.gcount());
+    char chunk[64 * 1024];
+    while (stream.read(chunk, sizeof(chunk)) || stream.gcount()) {
+        input_.insert(input_.end(), chunk, chunk + stream.gcount());
+    }
+
+    return load(Span{input_.data(), input_.size()});
+}
+
+Span MacBinary::GetResource(ResourceType type, int16_t id) const
+{
+    auto it = resources_.find(ResourceId{type, id});
+    if (it == resources_.end()) {
+        return Span{nullptr, 0};
+    }
+
+    return it->second;
+}
+
+// the decoders report offsets relative to the start of the resource
+
+static Expected<StringView> read_pstring(const uint8_t*& p, Span resource)
+{
+    auto end = resource.data + resource.size;
+    if (p >= end || p + 1 + *p > end) {
+        return Error{"String extends past end of resource", p - resource.data};
+    }
+
+    StringView s{reinterpret_cast<const char*>(p + 1), *p};
+    p += 1 + *p;
+
+    return s;
+}
+
+static Expected<std::vector<StringView>> decode_strings(Span resource)
+{
+    std::vector<StringView> v;
+    if (resource.size < 2) {
+        return v;
+    }
+
+    auto p = resource.data;
+
+    auto num_strings = load_big_s16(p);
+    p += 2;
+
+    v.reserve(std::max<int16_t>(num_strings, 0));
+    for (auto i = 0; i < num_strings; ++i) {
+        auto s = read_pstring(p, resource);
+        if (!s) {
+            return s.error();
+        }
+        v.push_back(*s);
+    }
+
+    return v;
+}
+
+static Expected<std::vector<RGBColor>> decode_clut(Span resource)
+{
+    // ctSeed, ctFlags, ctSize (one less than the number of entries), then
+    // a pixel value and RGB triple per entry
+    std::vector<RGBColor> colors;
+    if (resource.size < 8) {
+        return colors;
+    }
+
+    auto num_colors = load_big_s16(resource.data + 6) + 1;
+    if (num_colors < 0 || 8 + static_cast<std::size_t>(num_colors) * 8 > resource.size) {
+        std::ostringstream oss;
+        oss << "Invalid number of colors in clut: " << num_colors;
+        return Error{oss.str(), 6};
+    }
+
+    colors.resize(num_colors);
+    auto p = resource.data + 8;
+    for (auto& color : colors) {
+        color.r = load_big_u16(p + 2);
+        color.g = load_big_u16(p + 4);
+        color.b = load_big_u16(p + 6);
+        p += 8;
+    }
+
+    return colors;
+}
+
+static Expected<std::vector<Rect>> decode_nrct(Span resource)
+{
+    std::vector<Rect> rects;
+    if (resource.size < 2) {
+        return rects;
+    }
+
+    auto num_rects = load_big_u16(resource.data);
+    if (2 + static_cast<std::size_t>(num_rects) * 8 > resource.size) {
+        std::ostringstream oss;
+        oss << "Invalid number of rects in nrct: " << num_rects;
+        return Error{oss.str(), 0};
+    }
+
+    rects.resize(num_rects);
+    auto p = resource.data + 2;
+    for (auto& rect : rects) {
+        rect.top = load_big_s16(p);
+        rect.left = load_big_s16(p + 2);
+        rect.bottom = load_big_s16(p + 4);
+        rect.right = load_big_s16(p + 6);
+        p += 8;
+    }
+
+    return rects;
+}
+
+static Expected<std::vector<StringView>> decode_menu(Span resource)
+{
+    std::vector<StringView> v;
+
+    // skip id, width, height, proc, enableFlags
+    if (resource.size < 14) {
+        return v;
+    }
+
+    auto p = resource.data + 14;
+    auto end = resource.data + resource.size;
+
+    // skip title
+    auto title = read_pstring(p, resource);
+    if (!title) {
+        return title.error();
+    }
+
+    // items run until an empty name, each followed by icon number, item
+    // command key, item mark and item style
+    while (p < end && *p) {
+        auto s = read_pstring(p, resource);
+        if (!s) {
+            return s.error();
+        }
+        v.push_back(*s);
+        p += 4;
+    }
+
+    return v;
+}
+
+const MacBinary::Decoder MacBinary::decoders_[] = {
+    {{'S','T','R','#'}, INT16_MIN, INT16_MAX, &MacBinary::load_stringset},
+    // clut id 130 sets interface colors
+    {{'c','l','u','t'}, 130, 130, &MacBinary::load_interface_colors},
+    // nrct 128 sets interface rectangles
+    {{'n','r','c','t'}, 128, 128, &MacBinary::load_interface_rects},
+    // MENU 1000 sets player color strings
+    {{'M','E','N','U'}, 1000, 1000, &MacBinary::load_menu},
+    // MENU 2004 sets difficulty level strings
+    {{'M','E','N','U'}, 2004, 2004, &MacBinary::load_menu},
+};
+
+Expected<void> MacBinary::load_stringset(int16_t id, Span resource)
+{
+    auto strings = decode_strings(resource);
+    if (!strings) {
+        return strings.error();
+    }
+
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    strings_[id] = std::move(*strings);
+
+    return Expected<void>{};
+}
+
+Expected<void> MacBinary::load_interface_colors(int16_t, Span resource)
+{
+    auto colors = decode_clut(resource);
+    if (!colors) {
+        return colors.error();
+    }
+
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    interface_colors_ = std::move(*colors);
+
+    return Expected<void>{};
+}
+
+Expected<void> MacBinary::load_interface_rects(int16_t, Span resource)
+{
+    auto rects = decode_nrct(resource);
+    if (!rects) {
+        return rects.error();
+    }
+
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    interface_rects_ = std::move(*rects);
+
+    return Expected<void>{};
+}
+
+Expected<void> MacBinary::load_menu(int16_t id, Span resource)
+{
+    auto strings = decode_menu(resource);
+    if (!strings) {
+        return strings.error();
+    }
+
+    std::lock_guard<std::mutex> lock(decode_mutex_);
+    menu_strings_[id] = std::move(*strings);
+
+    return Expected<void>{};
+}
+
+static std::string resource_name(const ResourceId& id)
+{
+    return "'" + std::string(id.first.data(), 4) + "' " + std::to_string(id.second);
+}
+
+Expected<void> MacBinary::load_resources(Span fork)
+{
+    auto indexed = index_resources(fork);
+    if (!indexed || deferred_) {
+        return indexed;
+    }
+
+    return decode_resources(nullptr);
+}
+
+Expected<void> MacBinary::index_resources(Span fork)
+{
+    fork_ = fork;
+
+    if (fork.size < sizeof(ResourceForkHeader)) {
+        return Error{"Resource fork not long enough", offset_of(fork.data)};
+    }
+
+    // every range is checked as 64-bit offsets, so that no sum of fork
+    // fields can wrap and no signed offset can reach before the map
+    auto header = reinterpret_cast<const ResourceForkHeader*>(fork.data);
+    uint64_t data_offset = header->data_offset;
+    uint64_t map_offset = header->map_offset;
+    if (data_offset > fork.size || map_offset + 30 > fork.size) {
+        return Error{"Resource map extends past end of fork", offset_of(fork.data)};
+    }
+
+    auto data = fork.data + data_offset;
+    uint64_t data_length = fork.size - data_offset;
+    auto map = fork.data + map_offset;
+    int64_t map_length = fork.size - map_offset;
+
+    int64_t type_list_offset = load_big_u16(map + 24);
+    if (type_list_offset + 2 > map_length) {
+        return Error{"Resource type list extends past end of fork", offset_of(map + 24)};
+    }
+
+    auto type_list = map + type_list_offset;
+    auto num_types = load_big_s16(type_list) + 1;
+    if (num_types < 0 || type_list_offset + 2 + num_types * 8 > map_length) {
+        return Error{"Resource type list extends past end of fork", offset_of(type_list)};
+    }
+
+    std::vector<const Decoder*> type_decoders;
+
+    for (auto i = 0; i < num_types; ++i) {
+        auto type_list_entry = reinterpret_cast<const TypeListEntry*>(type_list + 2 + i * 8);
+
+        type_decoders.clear();
+        for (auto& decoder : decoders_) {
+            if (decoder.type == type_list_entry->type) {
+                type_decoders.push_back(&decoder);
+            }
+        }
+
+        auto num_refs = type_list_entry->num_refs + 1;
+        int64_t ref_list_offset = type_list_offset + type_list_entry->ref_list_offset;
+        if (num_refs < 0 || ref_list_offset < 0 || ref_list_offset + num_refs * 12 > map_length) {
+            return Error{"Resource reference list extends past end of fork",
+                         offset_of(reinterpret_cast<const uint8_t*>(type_list_entry)),
+                         "'" + std::string(type_list_entry->type.data(), 4) + "'"};
+        }
+
+        auto ref_list = map + ref_list_offset;
+        for (auto j = 0; j < num_refs; ++j) {
+            auto ref_list_entry = reinterpret_cast<const RefListEntry*>(ref_list + j * 12);
+            ResourceId id{type_list_entry->type, ref_list_entry->id.value()};
+
+            uint64_t offset = ref_list_entry->data_offset & 0x00ffffff;
+            if (offset + 4 > data_length || offset + 4 + load_big_u32(data + offset) > data_length) {
+                return Error{"Resource extends past end of fork",
+                             offset_of(reinterpret_cast<const uint8_t*>(ref_list_entry)),
+                             resource_name(id)};
+            }
+
+            // the Resource Manager returns the first of any duplicates
+            auto p = data + offset;
+            Span resource{p + 4, load_big_u32(p)};
+            auto inserted = resources_.insert(std::make_pair(id, resource));
+            if (!inserted.second) {
+                continue;
+            }
+
+            auto attributes = ref_list_entry->data_offset >> 24;
+            if ((attributes & resource_compressed_attribute) && is_compressed_resource(resource)) {
+                compressed_.insert(std::make_pair(id, resource));
+            }
+
+            for (auto decoder : type_decoders) {
+                if (id.second >= decoder->first_id && id.second <= decoder->last_id) {
+                    jobs_.push_back(Job{decoder, id});
+                }
+            }
+        }
+    }
+
+    return Expected<void>{};
+}
+
+uint64_t MacBinary::fingerprint(const ResourceId& id) const
+{
+    auto it = compressed_.find(id);
+    if (it != compressed_.end()) {
+        return hash64(it->second.data, it->second.size);
+    }
+
+    auto resource = GetResource(id.first, id.second);
+    return hash64(resource.data, resource.size);
+}
+
+void MacBinary::for_each_string(const std::function<void(int stringset, std::size_t index, const std::string& s)>& f) const
+{
+    for (auto& stringset : strings_) {
+        for (auto i = 0u; i < stringset.second.size(); ++i) {
+            f(stringset.first, i, mac_roman_to_utf8(stringset.second[i].str()));
+        }
+    }
+
+    for (auto& menu : menu_strings_) {
+        // as in diff_fragment()
+        auto index = menu.first == 1000 ? 152 : 145;
+        for (auto i = 0u; i < menu.second.size(); ++i) {
+            f(index, i, mac_roman_to_utf8(menu.second[i].str()));
+        }
+    }
+}
+
+std::vector<uint64_t> MacBinary::resource_fingerprints() const
+{
+    std::vector<uint64_t> fingerprints;
+    fingerprints.reserve(resources_.size());
+    for (auto& resource : resources_) {
+        uint64_t id = static_cast<uint64_t>(load_big_u32(reinterpret_cast<const uint8_t*>(resource.first.first.data()))) << 16 | static_cast<uint16_t>(resource.first.second);
+        fingerprints.push_back(hash64(&id, sizeof(id), fingerprint(resource.first)));
+    }
+
+    return fingerprints;
+}
+
+Expected<void> MacBinary::decode_resources(const std::function<bool(const ResourceId&)>& wanted)
+{
+    // compressed resources are unpacked before any decoder runs, each
+    // replacing its own index entry; the span as found in the fork is
+    // kept for error offsets
+    struct Compressed {
+        ResourceId id;
+        Span* resource;
+        Span original;
+    };
+    std::vector<Compressed> compressed;
+    for (auto& c : compressed_) {
+        if (!wanted || wanted(c.first)) {
+            compressed.push_back(Compressed{c.first, &resources_.find(c.first)->second, c.second});
+        }
+    }
+
+    std::vector<const Job*> jobs;
+    for (auto& job : jobs_) {
+        if (!wanted || wanted(job.id)) {
+            jobs.push_back(&job);
+        }
+    }
+
+    std::vector<Expected<void>> decompressed(compressed.size());
+    auto decompress = [&](std::size_t i) {
+        // the header is checked before anything is allocated for it
+        auto size = decompressed_size(compressed[i].original);
+        if (!size) {
+            decompressed[i] = size.error();
+            return;
+        }
+
+        auto p = arena_.allocate(*size);
+        decompressed[i] = decompress_resource(compressed[i].original, p);
+        *compressed[i].resource = Span{p, *size};
+    };
+
+    // every job stores into its own (type, id) slot, so the results do
+    // not depend on the order the jobs finish in
+    std::vector<Expected<void>> decoded(jobs.size());
+    auto decode = [&](std::size_t i) {
+        decoded[i] = (this->*jobs[i]->decoder->decode)(jobs[i]->id.second, resources_.find(jobs[i]->id)->second);
+    };
+
+    auto run = [this](std::size_t count, const std::function<void(std::size_t)>& f) {
+        if (pool_) {
+            pool_->parallel_for(count, f);
+        } else {
+            for (auto i = 0u; i < count; ++i) {
+                f(i);
+            }
+        }
+    };
+
+    // the first failure in map order is reported, however the jobs ran
+    run(compressed.size(), decompress);
+    for (auto i = 0u; i < compressed.size(); ++i) {
+        if (!decompressed[i]) {
+            auto error = decompressed[i].error();
+            auto start = offset_of(compressed[i].original.data);
+            error.offset = error.offset < 0 ? start : start + error.offset;
+            error.where = resource_name(compressed[i].id);
+            return error;
+        }
+    }
+
+    run(jobs.size(), decode);
+    for (auto i = 0u; i < jobs.size(); ++i) {
+        if (!decoded[i]) {
+            // offsets into an unpacked copy mean nothing in the input, so
+            // point at the start of the compressed resource instead
+            auto error = decoded[i].error();
+            auto original = compressed_.find(jobs[i]->id);
+            auto start = offset_of(original != compressed_.end() ? original->second.data : resources_.find(jobs[i]->id)->second.data);
+            if (error.offset < 0 || original != compressed_.end()) {
+                error.offset = start;
+            } else {
+                error.offset += start;
+            }
+            error.where = resource_name(jobs[i]->id);
+            return error;
+        }
+    }
+
+    return Expected<void>{};
+}
+
+// calls emit(i) for each index below limit where other has an entry that
+// base lacks or that differs; identical tables are rejected with a single
+// memcmp
+template <typename T, typename F>
+static void diff_table(const std::vector<T>& base, const std::vector<T>& other,
+                       std::size_t limit, F emit)
+{
+    auto count = std::min(limit, other.size());
+    auto common = std::min(count, base.size());
+
+    if (common && std::memcmp(base.data(), other.data(), common * sizeof(T)) != 0) {
+        for (std::size_t i = 0; i < common; ++i) {
+            if (std::memcmp(&base[i], &other[i], sizeof(T)) != 0) {
+                emit(i);
+            }
+        }
+    }
+
+    for (auto i = common; i < count; ++i) {
+        emit(i);
+    }
+}
+
+// strings are addressed by index in MML, so every position whose final
+// contents differ has to be written; when the set changed length the edit
+// script is noted alongside so inserted and removed runs are easy to review
+static pt::ptree diff_strings(int index,
+                              const std::vector<StringView>& v,
+                              const std::vector<StringView>& other_v)
+{
+    pt::ptree stringset_tree;
+
+    if (v.size() != other_v.size()) {
+        std::vector<uint64_t> hashes;
+        std::vector<uint64_t> other_hashes;
+        hashes.reserve(v.size());
+        other_hashes.reserve(other_v.size());
+        for (auto& s : v) {
+            hashes.push_back(hash64(s.data, s.size));
+        }
+        for (auto& s : other_v) {
+            other_hashes.push_back(hash64(s.data, s.size));
+        }
+
+        for (auto& hunk : myers_diff(hashes, other_hashes)) {
+            auto range = [](std::ostream& s, std::size_t begin, std::size_t length) {
+                s << begin;
+                if (length > 1) {
+                    s << "-" << begin + length - 1;
+                }
+            };
+
+            std::ostringstream oss;
+            if (hunk.base_length) {
+                oss << "removed ";
+                range(oss, hunk.base_begin, hunk.base_length);
+            }
+            if (hunk.base_length && hunk.other_length) {
+                oss << ", ";
+            }
+            if (hunk.other_length) {
+                oss << "inserted ";
+                range(oss, hunk.other_begin, hunk.other_length);
+            }
+            stringset_tree.add("stringset.<xmlcomment>", oss.str());
+        }
+
+        if (other_v.size() < v.size()) {
+            std::cerr << "Stringset " << index << " lost " << v.size() - other_v.size()
+                      << " strings; Aleph One MML cannot remove them!\n";
+        }
+    }
+
+    auto found_diff = false;
+    for (auto i = 0u; i < other_v.size(); ++i) {
+        if (i >= v.size() || v[i] != other_v[i]) {
+            pt::ptree string_tree;
+
+            string_tree.put("string", mac_roman_to_utf8(other_v[i].str()));
+            string_tree.put("string.<xmlattr>.index", i);
+
+            found_diff = true;
+
+            stringset_tree.add_child("stringset.string", string_tree.get_child("string"));
+        }
+    }
+
+    if (!found_diff) {
+        return pt::ptree{};
+    }
+
+    stringset_tree.put("stringset.<xmlattr>.index", index);
+    return stringset_tree;
+}
+
+std::vector<std::pair<ResourceId, Span>> MacBinary::stored_resources(Span file) const
+{
+    std::vector<std::pair<ResourceId, Span>> stored;
+    if (container_ == Container::BinHex) {
+        return stored;
+    }
+
+    for (auto& resource : resources_) {
+        auto compressed = compressed_.find(resource.first);
+        auto data = compressed != compressed_.end() ? compressed->second : resource.second;
+
+        Span span{data.data - 4, data.size + 4};
+        if (span.data >= file.data && span.data + span.size <= file.data + file.size) {
+            stored.push_back(std::make_pair(resource.first, span));
+        }
+    }
+
+    std::stable_sort(stored.begin(), stored.end(), [](const std::pair<ResourceId, Span>& a, const std::pair<ResourceId, Span>& b) {
+        return a.second.data < b.second.data;
+    });
+
+    auto end = std::unique(stored.begin(), stored.end(), [](const std::pair<ResourceId, Span>& a, const std::pair<ResourceId, Span>& b) {
+        return b.second.data < a.second.data + a.second.size;
+    });
+    stored.erase(end, stored.end());
+
+    return stored;
+}
+
+std::vector<ResourceId> MacBinary::fragment_ids() const
+{
+    std::vector<ResourceId> ids{
+        ResourceId{{'c','l','u','t'}, 130},
+        ResourceId{{'n','r','c','t'}, 128},
+    };
+
+    // skip filenames
+    ResourceType str{'S','T','R','#'};
+    for (auto it = resources_.lower_bound(ResourceId{str, INT16_MIN}); it != resources_.end() && it->first.first == str; ++it) {
+        if (it->first.second != 129) {
+            ids.push_back(it->first);
+        }
+    }
+
+    for (auto id : {1000, 2004}) {
+        ResourceId menu{{'M','E','N','U'}, id};
+        if (resources_.count(menu)) {
+            ids.push_back(menu);
+        }
+    }
+
+    return ids;
+}
+
+// writes tree as an element named key, at the depth it will have in the
+// document, laid out as write_xml would
+static void write_element(std::string& out, const std::string& key, const pt::ptree& tree, int depth)
+{
+    std::ostringstream oss;
+    pt::xml_writer_settings<std::string> settings(' ', 4, "utf-8");
+    pt::xml_parser::write_xml_element(oss, key, tree, depth, settings);
+    out += oss.str();
+}
+
+Fragment MacBinary::diff_fragment(const ResourceId& id, const MacBinary& other) const
+{
+    Fragment fragment;
+
+    static const std::vector<StringView> none;
+    auto find = [](const std::map<int, std::vector<StringView>>& strings, int id) -> const std::vector<StringView>& {
+        auto it = strings.find(id);
+        return it == strings.end() ? none : it->second;
+    };
+
+    if (id.first == ResourceType{'c','l','u','t'}) {
+        diff_table(interface_colors_, other.interface_colors_, max_interface_colors, [&](std::size_t i) {
+            write_element(fragment.interface, "color", other.interface_colors_[i].tree(i).get_child("color"), 2);
+        });
+    } else if (id.first == ResourceType{'n','r','c','t'}) {
+        diff_table(interface_rects_, other.interface_rects_, max_interface_rects, [&](std::size_t i) {
+            write_element(fragment.interface, "rect", other.interface_rects_[i].tree(i).get_child("rect"), 2);
+        });
+    } else if (id.first == ResourceType{'S','T','R','#'}) {
+        auto stringset_tree = diff_strings(id.second, find(strings_, id.second), find(other.strings_, id.second));
+        if (!stringset_tree.empty()) {
+            write_element(fragment.marathon, "stringset", stringset_tree.get_child("stringset"), 1);
+        }
+    } else if (id.first == ResourceType{'M','E','N','U'}) {
+        // MENU 1000 is stringset 152, MENU 2004 is stringset 145
+        auto index = id.second == 1000 ? 152 : 145;
+        auto stringset_tree = diff_strings(index, find(menu_strings_, id.second), find(other.menu_strings_, id.second));
+        if (!stringset_tree.empty()) {
+            write_element(fragment.marathon, "stringset", stringset_tree.get_child("stringset"), 1);
+        }
+    }
+
+    return fragment;
+}
+
+void write_mml(std::ostream& out, const std::vector<Fragment>& fragments)
+{
+    out << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+    out << "<!--Generated by resdiff-->\n";
+
+    auto has_interface = false;
+    auto has_marathon = false;
+    for (auto& fragment : fragments) {
+        has_interface = has_interface || !fragment.interface.empty();
+        has_marathon = has_marathon || !fragment.marathon.empty();
+    }
+
+    if (!has_interface && !has_marathon) {
+        return;
+    }
+
+    out << "<marathon>\n";
+    if (has_interface) {
+        out << "    <interface>\n";
+        for (auto& fragment : fragments) {
+            out << fragment.interface;
+        }
+        out << "    </interface>\n";
+    }
+    for (auto& fragment : fragments) {
+        out << fragment.marathon;
+    }
+    out << "</marathon>\n";
+}
+
+std::vector<Fragment> MacBinary::diff_fragments(const MacBinary& other) const
+{
+    std::vector<Fragment> fragments;
+    for (auto& id : fragment_ids()) {
+        fragments.push_back(diff_fragment(id, other));
+    }
+
+    return fragments;
+}
+
+void MacBinary::diff(MacBinary& other, std::ostream& out)
+{
+    write_mml(out, diff_fragments(other));
+}
+
+// a stored fragment is the length of its interface part as 32 bits, then
+// both parts
+static std::string serialize_fragment(const Fragment& fragment)
+{
+    uint32_t size = fragment.interface.size();
+    std::string data(reinterpret_cast<const char*>(&size), sizeof(size));
+    return data + fragment.interface + fragment.marathon;
+}
+
+static bool deserialize_fragment(const std::string& data, Fragment& fragment)
+{
+    uint32_t size;
+    if (data.size() < sizeof(size)) {
+        return false;
+    }
+
+    std::memcpy(&size, data.data(), sizeof(size));
+    if (data.size() - sizeof(size) < size) {
+        return false;
+    }
+
+    fragment.interface = data.substr(sizeof(size), size);
+    fragment.marathon = data.substr(sizeof(size) + size);
+    return true;
+}
+
+Expected<void> MacBinary::diff(MacBinary& other, ResultCache& cache, std::ostream& out)
+{
+    auto ids = fragment_ids();
+    std::vector<Fragment> fragments(ids.size());
+
+    // fragments that have to be worked out, and the resources needed
+    std::vector<std::size_t> missing;
+    std::vector<uint64_t> keys(ids.size());
+    std::set<ResourceId> wanted;
+
+    for (auto i = 0u; i < ids.size(); ++i) {
+        auto& id = ids[i];
+
+        // an unchanged resource adds nothing
+        auto in_base = resources_.count(id) != 0;
+        auto in_other = other.resources_.count(id) != 0;
+        auto base_fingerprint = in_base ? fingerprint(id) : 0;
+        auto other_fingerprint = in_other ? other.fingerprint(id) : 0;
+        if (in_base == in_other && base_fingerprint == other_fingerprint) {
+            continue;
+        }
+
+        keys[i] = cache.fragment_key(hash64(resource_name(id)), base_fingerprint, other_fingerprint);
+
+        std::string data;
+        if (cache.fetch_fragment(keys[i], data) && deserialize_fragment(data, fragments[i])) {
+            continue;
+        }
+
+        missing.push_back(i);
+        wanted.insert(id);
+    }
+
+    if (!missing.empty()) {
+        auto is_wanted = [&](const ResourceId& id) {
+            return wanted.count(id) != 0;
+        };
+
+        for (auto binary : {this, &other}) {
+            if (binary->deferred_) {
+                auto decoded = binary->decode_resources(is_wanted);
+                if (!decoded) {
+                    return decoded.error();
+                }
+            }
+        }
+
+        for (auto i : missing) {
+            fragments[i] = diff_fragment(ids[i], other);
+
+            auto stored = cache.store_fragment(keys[i], serialize_fragment(fragments[i]));
+            if (!stored) {
+                return stored.error();
+            }
+        }
+    }
+
+    write_mml(out, fragments);
+    return Expected<void>{};
+}
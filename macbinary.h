@@ -0,0 +1,300 @@
+/*
+    macbinary.h: Marathon engines and the MML between them
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MACBINARY_H
+#define MACBINARY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/endian/arithmetic.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "arena.h"
+#include "cache.h"
+#include "container.h"
+#include "expected.h"
+#include "mapped_file.h"
+#include "rgb_color.h"
+#include "thread_pool.h"
+
+using ResourceType = std::array<char, 4>;
+using ResourceId = std::pair<ResourceType, int>;
+
+struct ResourceForkHeader {
+    boost::endian::big_uint32_t data_offset;
+    boost::endian::big_uint32_t map_offset;
+    boost::endian::big_uint32_t data_length;
+    boost::endian::big_uint32_t map_length;
+};
+
+struct TypeListEntry {
+    ResourceType type;
+    boost::endian::big_int16_t num_refs;
+    boost::endian::big_int16_t ref_list_offset;
+};
+
+struct RefListEntry {
+    boost::endian::big_int16_t id;
+    boost::endian::big_int16_t name_list_offset;
+    boost::endian::big_uint32_t data_offset;
+    boost::endian::big_uint32_t unused;
+};
+
+// decoded resources are native-endian and tightly packed, so whole tables
+// can be compared with memcmp
+struct Rect {
+    boost::property_tree::ptree diff(int index, const Rect& other) {
+        boost::property_tree::ptree tree;
+
+        if (top != other.top ||
+            left != other.left ||
+            bottom != other.bottom ||
+            right != other.right)
+        {
+            tree = other.tree(index);
+        }
+
+        return tree;
+    }
+
+    boost::property_tree::ptree tree(int index) const {
+        boost::property_tree::ptree tree;
+
+        tree.put("rect.<xmlattr>.index", index);
+        tree.put("rect.<xmlattr>.top", top);
+        tree.put("rect.<xmlattr>.left", left);
+        tree.put("rect.<xmlattr>.bottom", bottom);
+        tree.put("rect.<xmlattr>.right", right);
+
+        return tree;
+    }
+
+    // QuickDraw coordinates are signed, so a rectangle above or left of
+    // the origin is written with negative values
+    int16_t top;
+    int16_t left;
+    int16_t bottom;
+    int16_t right;
+};
+
+inline bool operator==(const Rect& a, const Rect& b)
+{
+    return a.top == b.top && a.left == b.left &&
+        a.bottom == b.bottom && a.right == b.right;
+}
+
+inline bool operator!=(const Rect& a, const Rect& b) {
+    return !(a == b);
+}
+
+// a Pascal string's characters, left in place in the mapped file until
+// they are written out
+struct StringView {
+    std::string str() const {
+        return std::string(data, size);
+    }
+
+    const char* data;
+    std::size_t size;
+};
+
+inline bool operator==(const StringView& a, const StringView& b)
+{
+    return a.size == b.size && std::memcmp(a.data, b.data, a.size) == 0;
+}
+
+inline bool operator!=(const StringView& a, const StringView& b)
+{
+    return !(a == b);
+}
+
+// one resource's part of the MML, already written out: elements that go
+// inside <interface>, and elements that go directly inside <marathon>
+struct Fragment {
+    std::string interface;
+    std::string marathon;
+};
+
+// the document the fragments make, in order
+void write_mml(std::ostream& out, const std::vector<Fragment>& fragments);
+
+class MacBinary {
+public:
+    class Exception : public std::runtime_error {
+    public:
+        Exception(const char* what) : std::runtime_error{what} { }
+        Exception(const std::string& what) : std::runtime_error{what} { }
+    };
+    
+    // resources are decoded on pool when one is given; a filename of "-"
+    // reads from stdin, and a manifest in an object store reads the file
+    // it describes. Throws Exception if the file is malformed
+    MacBinary(const char* filename, ThreadPool* pool = nullptr);
+
+    // reads the stream front to back without seeking; only the resource
+    // fork of a MacBinary stream is kept, other containers are read whole
+    MacBinary(std::istream& stream, ThreadPool* pool = nullptr);
+
+    // takes over a file already read into memory; a malformed file is
+    // returned as an Error rather than thrown, for batch runs. A deferred
+    // engine only reads its resource map, leaving resources to be decoded
+    // as a diff against a cache needs them
+    static Expected<std::unique_ptr<MacBinary>> create(std::vector<uint8_t> file, ThreadPool* pool = nullptr, bool deferred = false);
+
+    // as above, for a file already mapped, which may be a manifest in an
+    // object store
+    static Expected<std::unique_ptr<MacBinary>> create(std::unique_ptr<MappedFile> file, ThreadPool* pool = nullptr, bool deferred = false);
+
+    // roughly the bytes held by the input and everything decoded from it
+    std::size_t memory_usage() const;
+
+    // despite the name, engines may come in any supported container
+    Container container() const { return container_; }
+
+    // the resource's data, without its length prefix and decompressed if
+    // need be (for a deferred engine, once it has been decoded); empty if
+    // missing
+    Span GetResource(ResourceType type, int16_t id) const;
+
+    // writes MML that turns this engine into other
+    void diff(MacBinary& other, std::ostream& out);
+
+    // the MML diff() writes, one fragment for each resource it covers
+    // whether or not the resource differs
+    std::vector<Fragment> diff_fragments(const MacBinary& other) const;
+
+    // each resource as it lies in file, which the engine was read from,
+    // with its length before it and in file order; none if the fork had
+    // to be decoded from BinHex. Resources sharing their data are listed
+    // once, under the first id
+    std::vector<std::pair<ResourceId, Span>> stored_resources(Span file) const;
+
+    // every STR# and MENU string, in UTF-8, with the stringset and index
+    // MML gives it
+    void for_each_string(const std::function<void(int stringset, std::size_t index, const std::string& s)>& f) const;
+
+    // one for each resource, covering its type, id and contents as
+    // stored; an engine's sketch is made from these
+    std::vector<uint64_t> resource_fingerprints() const;
+
+    // as above, reusing the fragment of the MML for each resource that
+    // cache holds from an earlier run. A resource is only decoded, in
+    // either engine, when it differs between them and no fragment for the
+    // pair is stored
+    Expected<void> diff(MacBinary& other, ResultCache& cache, std::ostream& out);
+
+private:
+    // decoders are collected as the resource map is scanned, for each
+    // resource of the given type with an id in [first_id, last_id], and
+    // may then run concurrently; they must hold decode_mutex_ while
+    // storing their results
+    struct Decoder {
+        ResourceType type;
+        int16_t first_id;
+        int16_t last_id;
+        Expected<void> (MacBinary::*decode)(int16_t id, Span resource);
+    };
+    static const Decoder decoders_[];
+
+    struct Job {
+        const Decoder* decoder;
+        ResourceId id;
+    };
+
+    explicit MacBinary(ThreadPool* pool) : pool_{pool}, deferred_{false}, fork_position_{0} { }
+
+    Expected<void> load(Span file);
+    Expected<void> load(std::istream& stream);
+    Expected<void> load(std::unique_ptr<MappedFile> file);
+    Expected<void> load_resources(Span fork);
+
+    // reads the resource map, noting what to decode without decoding it
+    Expected<void> index_resources(Span fork);
+
+    // unpacks and decodes the indexed resources wanted selects, or all of
+    // them if it is empty
+    Expected<void> decode_resources(const std::function<bool(const ResourceId&)>& wanted);
+
+    // hash of the resource as stored, before unpacking; copies stored
+    // differently are told apart, which costs no more than a cache miss
+    uint64_t fingerprint(const ResourceId& id) const;
+
+    // the resources whose diffs make up the MML, in the order written
+    std::vector<ResourceId> fragment_ids() const;
+
+    // the MML one of those contributes, empty if the resources do not
+    // differ
+    Fragment diff_fragment(const ResourceId& id, const MacBinary& other) const;
+
+    Expected<void> load_stringset(int16_t id, Span resource);
+    Expected<void> load_interface_colors(int16_t id, Span resource);
+    Expected<void> load_interface_rects(int16_t id, Span resource);
+    Expected<void> load_menu(int16_t id, Span resource);
+
+    // where p, which points into the resource fork, lies in the input
+    int64_t offset_of(const uint8_t* p) const { return fork_position_ + (p - fork_.data); }
+
+    std::map<int, std::vector<StringView>> strings_;
+    std::vector<RGBColor> interface_colors_;
+    std::vector<Rect> interface_rects_;
+    std::map<int, std::vector<StringView>> menu_strings_;
+
+    std::map<ResourceId, Span> resources_;
+
+    ThreadPool* pool_;
+    std::mutex decode_mutex_;
+
+    // what index_resources() found to decode
+    std::vector<Job> jobs_;
+    std::map<ResourceId, Span> compressed_;
+    bool deferred_;
+
+    // decompressed resources
+    Arena arena_;
+
+    std::unique_ptr<MappedFile> file_;
+
+    // the file, or just its resource fork, when read from a stream or
+    // handed over in memory
+    std::vector<uint8_t> input_;
+
+    // decoded BinHex
+    std::vector<uint8_t> buffer_;
+
+    // the resource fork, and its offset in the input (0 when decoded
+    // from BinHex)
+    Span fork_;
+    int64_t fork_position_;
+
+    Container container_;
+};
+
+#endif
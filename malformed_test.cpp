@@ -0,0 +1,369 @@
+/*
+    malformed_test.cpp: crafted engines must be refused, not crash
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include "batch.h"
+#include "daemon.h"
+#include "macbinary.h"
+
+using namespace boost::endian;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+    if (!ok) {
+        std::cerr << "FAIL: " << what << "\n";
+        ++failures;
+    }
+}
+
+static void put16(std::vector<uint8_t>& v, std::size_t offset, uint16_t value)
+{
+    v[offset] = value >> 8;
+    v[offset + 1] = value & 0xff;
+}
+
+static void put32(std::vector<uint8_t>& v, std::size_t offset, uint32_t value)
+{
+    put16(v, offset, value >> 16);
+    put16(v, offset + 2, value & 0xffff);
+}
+
+// where the parts of a fork from make_fork() lie
+static const std::size_t data_offset = 16;
+static const std::size_t map_header_size = 28;
+
+// a bare resource fork holding STR# 128 with the strings given: header,
+// the one resource's data, then a map with one type and one reference
+static std::vector<uint8_t> make_fork(const std::vector<std::string>& strings)
+{
+    std::vector<uint8_t> resource(2);
+    put16(resource, 0, strings.size());
+    for (auto& s : strings) {
+        resource.push_back(s.size());
+        resource.insert(resource.end(), s.begin(), s.end());
+    }
+
+    auto data_length = 4 + resource.size();
+    auto map_offset = data_offset + data_length;
+    auto map_length = map_header_size + 2 + 8 + 12;
+
+    std::vector<uint8_t> fork(map_offset + map_length);
+    put32(fork, 0, data_offset);
+    put32(fork, 4, map_offset);
+    put32(fork, 8, data_length);
+    put32(fork, 12, map_length);
+
+    put32(fork, data_offset, resource.size());
+    std::copy(resource.begin(), resource.end(), fork.begin() + data_offset + 4);
+
+    auto map = map_offset;
+    std::copy(fork.begin(), fork.begin() + 16, fork.begin() + map);
+    put16(fork, map + 24, map_header_size);
+    put16(fork, map + 26, map_length);
+
+    auto type_list = map + map_header_size;
+    put16(fork, type_list, 0);
+    std::memcpy(&fork[type_list + 2], "STR#", 4);
+    put16(fork, type_list + 6, 0);
+    put16(fork, type_list + 8, 10);
+
+    auto ref_list = type_list + 10;
+    put16(fork, ref_list, 128);
+    put16(fork, ref_list + 2, 0xffff);
+    put32(fork, ref_list + 4, 0);
+
+    return fork;
+}
+
+// the fork inside an AppleSingle file, whose fork offsets are not
+// checked against anything but the file's size
+static std::vector<uint8_t> apple_single(const std::vector<uint8_t>& fork)
+{
+    std::vector<uint8_t> file(38);
+    put32(file, 0, 0x00051600);
+    put32(file, 4, 0x00020000);
+    put16(file, 24, 1);
+    put32(file, 26, 2);
+    put32(file, 30, file.size());
+    put32(file, 34, fork.size());
+    file.insert(file.end(), fork.begin(), fork.end());
+
+    return file;
+}
+
+// engines whose resource maps point outside the fork
+static std::vector<std::pair<std::string, std::vector<uint8_t>>> crafted_engines()
+{
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> engines;
+
+    auto fork = make_fork({"crafted"});
+    auto map = load_big_u32(fork.data() + 4);
+    auto type_list = map + map_header_size;
+
+    auto negative_refs = fork;
+    put16(negative_refs, type_list + 8, -30000);
+    engines.emplace_back("negative reference list offset", apple_single(negative_refs));
+
+    auto negative_types = fork;
+    put16(negative_types, type_list, -5000);
+    engines.emplace_back("negative type count", apple_single(negative_types));
+
+    auto negative_ref_count = fork;
+    put16(negative_ref_count, type_list + 6, -5000);
+    engines.emplace_back("negative reference count", apple_single(negative_ref_count));
+
+    auto wrapping_map = fork;
+    put32(wrapping_map, 4, 0xfffffff0);
+    engines.emplace_back("map offset wrapping past 2^32", apple_single(wrapping_map));
+
+    auto long_resource = fork;
+    put32(long_resource, data_offset, 0xfffffff0);
+    engines.emplace_back("resource longer than the fork", apple_single(long_resource));
+
+    return engines;
+}
+
+static void test_create()
+{
+    auto valid = MacBinary::create(make_fork({"one", "two"}));
+    check(static_cast<bool>(valid), "valid fork is read");
+    if (valid) {
+        auto strings = (*valid)->GetResource(ResourceType{{'S', 'T', 'R', '#'}}, 128);
+        check(strings.size == 10, "valid fork has its STR# 128");
+    }
+
+    auto wrapped = MacBinary::create(apple_single(make_fork({"one"})));
+    check(static_cast<bool>(wrapped), "valid AppleSingle fork is read");
+
+    for (auto& engine : crafted_engines()) {
+        auto crafted = MacBinary::create(engine.second);
+        check(!crafted, engine.first + " is refused");
+    }
+}
+
+static bool send_request(int fd, const std::string& body)
+{
+    uint8_t header[4] = {
+        static_cast<uint8_t>(body.size()),
+        static_cast<uint8_t>(body.size() >> 8),
+        static_cast<uint8_t>(body.size() >> 16),
+        static_cast<uint8_t>(body.size() >> 24)
+    };
+
+    return write(fd, header, sizeof(header)) == sizeof(header) &&
+        write(fd, body.data(), body.size()) == static_cast<ssize_t>(body.size());
+}
+
+static bool read_fully(int fd, void* data, std::size_t size)
+{
+    auto p = static_cast<uint8_t*>(data);
+    while (size) {
+        auto n = read(fd, p, size);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// the status byte of the response, or -1 if the connection failed
+static int diff_request(int fd, const std::vector<uint8_t>& modified)
+{
+    std::string body{'d', 0, 0};
+    body.append(modified.begin(), modified.end());
+    if (!send_request(fd, body)) {
+        return -1;
+    }
+
+    uint8_t header[4];
+    if (!read_fully(fd, header, sizeof(header))) {
+        return -1;
+    }
+
+    std::vector<uint8_t> response(load_little_u32(header));
+    if (response.empty() || !read_fully(fd, response.data(), response.size())) {
+        return -1;
+    }
+
+    return response[0];
+}
+
+static int connect_to(const std::string& path)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+
+    // the daemon may not be listening yet
+    for (auto tries = 0; tries < 100; ++tries) {
+        auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+// the daemon parses uploads in process, so a crafted one must come back
+// as an error and leave it serving the next
+static void test_daemon()
+{
+    auto base = MacBinary::create(make_fork({"one", "two"}));
+    if (!base) {
+        check(false, "daemon base is read");
+        return;
+    }
+
+    DaemonHandlers handlers;
+    handlers.diff = [&](const std::string&, Span modified) -> Expected<std::string> {
+        auto mod = MacBinary::create(std::vector<uint8_t>(modified.data, modified.data + modified.size));
+        if (!mod) {
+            return mod.error();
+        }
+
+        std::ostringstream oss;
+        (*base)->diff(**mod, oss);
+        return oss.str();
+    };
+    handlers.reload = []() {
+        return Expected<void>{};
+    };
+
+    auto path = "/tmp/malformed_test." + std::to_string(getpid()) + ".sock";
+    auto status = -1;
+    std::thread daemon{[&]() {
+        // blocked from the start, so a stop sent early is not fatal
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        status = run_daemon(path, 2, handlers);
+    }};
+
+    auto fd = connect_to(path);
+    check(fd >= 0, "daemon accepts a connection");
+    if (fd >= 0) {
+        check(diff_request(fd, make_fork({"one", "three"})) == 0, "daemon diffs a valid upload");
+        for (auto& engine : crafted_engines()) {
+            check(diff_request(fd, engine.second) == 1, "daemon refuses " + engine.first);
+        }
+        check(diff_request(fd, make_fork({"four", "two"})) == 0, "daemon diffs a valid upload after crafted ones");
+        close(fd);
+
+        fd = connect_to(path);
+        check(fd >= 0 && diff_request(fd, make_fork({"five", "two"})) == 0, "daemon serves a new connection");
+        close(fd);
+    }
+
+    // only the daemon's thread blocks the signal, so it must be sent there
+    pthread_kill(daemon.native_handle(), SIGTERM);
+    daemon.join();
+    check(status == 0, "daemon stops cleanly");
+}
+
+static void write_file(const std::string& path, const std::vector<uint8_t>& data)
+{
+    std::ofstream out{path, std::ios::binary};
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+static bool exists(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// a crafted input in a batch run is recorded in errors.tsv, and the
+// inputs around it are still written
+static void test_batch(const std::string& options)
+{
+    auto dir = "/tmp/malformed_test." + std::to_string(getpid());
+    auto out = dir + "/out";
+    mkdir(dir.c_str(), 0755);
+    mkdir(out.c_str(), 0755);
+
+    std::string args = " " + dir + "/base.rsrc";
+    write_file(dir + "/base.rsrc", make_fork({"one", "two"}));
+
+    std::vector<std::string> valid;
+    std::vector<std::string> crafted;
+    auto engines = crafted_engines();
+    for (auto i = 0u; i < engines.size(); ++i) {
+        valid.push_back(dir + "/valid" + std::to_string(i) + ".rsrc");
+        write_file(valid.back(), make_fork({"one", "valid " + std::to_string(i)}));
+        crafted.push_back(dir + "/crafted" + std::to_string(i) + ".as");
+        write_file(crafted.back(), engines[i].second);
+        args += " " + valid.back() + " " + crafted.back();
+    }
+
+    auto status = std::system(("./resdiff --batch " + out + " " + options + args + " 2>/dev/null").c_str());
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 1, "batch run" + options + " fails without crashing");
+
+    std::ifstream errors{out + "/errors.tsv"};
+    std::string report{std::istreambuf_iterator<char>{errors}, std::istreambuf_iterator<char>{}};
+    for (auto i = 0u; i < engines.size(); ++i) {
+        check(report.find(crafted[i] + "\t") != std::string::npos, "batch run" + options + " records " + engines[i].first);
+        check(exists(batch_output_path(out, valid[i])), "batch run" + options + " writes " + valid[i]);
+    }
+
+    std::system(("rm -rf " + dir).c_str());
+}
+
+int main()
+{
+    test_create();
+    test_daemon();
+    test_batch("");
+    test_batch(" --processes 2");
+
+    if (failures) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+
+    std::cout << "malformed_test: all checks passed\n";
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+    mapped_file.cpp: read-only memory mapped input files
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char* path) : path_{path}, data_{nullptr}, size_{0}
+{
+    auto fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string{"Unable to open "} + path + ": " + std::strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        auto error = errno;
+        close(fd);
+        throw std::runtime_error(std::string{"Unable to stat "} + path + ": " + std::strerror(error));
+    }
+
+    size_ = st.st_size;
+    if (size_) {
+        auto p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            auto error = errno;
+            close(fd);
+            throw std::runtime_error(std::string{"Unable to map "} + path + ": " + std::strerror(error));
+        }
+        data_ = static_cast<const uint8_t*>(p);
+    }
+
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+}
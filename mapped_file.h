@@ -0,0 +1,55 @@
+/*
+    mapped_file.h: read-only memory mapped input files
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// a view of bytes owned by someone else
+struct Span {
+    const uint8_t* data;
+    std::size_t size;
+
+    bool empty() const { return size == 0; }
+};
+
+class MappedFile {
+public:
+    explicit MappedFile(const char* path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    Span span() const { return Span{data_, size_}; }
+
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    const uint8_t* data_;
+    std::size_t size_;
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+    memory_budget.cpp: caps the memory held by in-flight batch items
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+void MemoryBudget::add(uint64_t bytes)
+{
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+}
+
+bool MemoryBudget::try_acquire(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!admits(bytes)) {
+        return false;
+    }
+
+    add(bytes);
+    return true;
+}
+
+void MemoryBudget::acquire(uint64_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [&]() { return admits(bytes); });
+    add(bytes);
+}
+
+bool MemoryBudget::grow(uint64_t bytes, const std::function<bool()>& releasing)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (!limit_ || used_ + bytes <= limit_) {
+            add(bytes);
+            return true;
+        }
+
+        // checked under the lock, so a release still to come cannot slip
+        // in before the wait
+        if (!releasing()) {
+            return false;
+        }
+
+        auto generation = generation_;
+        released_.wait(lock, [&]() { return generation_ != generation; });
+    }
+}
+
+void MemoryBudget::release(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= std::min(used_, bytes);
+        ++generation_;
+    }
+    released_.notify_all();
+}
+
+uint64_t MemoryBudget::generation() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generation_;
+}
+
+void MemoryBudget::wait_for_release(uint64_t generation)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [&]() { return generation_ != generation; });
+}
+
+uint64_t MemoryBudget::peak() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+
+uint64_t parse_memory_size(const char* s)
+{
+    char* end;
+    auto value = std::strtoull(s, &end, 10);
+    if (end == s) {
+        return 0;
+    }
+
+    switch (std::toupper(*end)) {
+    case 'K':
+        return value << 10;
+    case 'M':
+        return value << 20;
+    case 'G':
+        return value << 30;
+    case '\0':
+        return value;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+    memory_budget.h: caps the memory held by in-flight batch items
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// accounts for the bytes held by batch items between being read and being
+// written. New work is admitted only while it fits under the limit, or
+// when nothing else is held, so a single file larger than the limit can
+// still be taken on its own (to be mapped rather than read); work already
+// admitted only grows under the limit. A limit of 0 admits everything but
+// still tracks the peak
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t limit) : limit_{limit}, used_{0}, peak_{0}, generation_{0} { }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    uint64_t limit() const { return limit_; }
+
+    // true if bytes could ever be admitted alongside other work
+    bool fits(uint64_t bytes) const { return !limit_ || bytes <= limit_; }
+
+    bool try_acquire(uint64_t bytes);
+    void acquire(uint64_t bytes);
+
+    // admits bytes more for work already admitted, only under the limit.
+    // Waits for releases while releasing() says some are still to come,
+    // and fails once none are
+    bool grow(uint64_t bytes, const std::function<bool()>& releasing);
+
+    void release(uint64_t bytes);
+
+    // changes whenever memory is released; pass it to wait_for_release()
+    // to sleep until a failed try_acquire() might succeed
+    uint64_t generation() const;
+    void wait_for_release(uint64_t generation);
+
+    uint64_t peak() const;
+
+private:
+    bool admits(uint64_t bytes) const { return !limit_ || used_ == 0 || used_ + bytes <= limit_; }
+    void add(uint64_t bytes);
+
+    const uint64_t limit_;
+    uint64_t used_;
+    uint64_t peak_;
+    uint64_t generation_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+};
+
+// parses sizes such as 512M, 2G or 65536; 0 if s is not one
+uint64_t parse_memory_size(const char* s);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+    mml_index.cpp: which engines' MML changes which elements
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mml_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "batch.h"
+#include "postings.h"
+
+namespace pt = boost::property_tree;
+using namespace boost::endian;
+
+static const char index_magic[4] = {'R','M','X','1'};
+static const std::size_t index_header_size = 24;
+
+// the attribute an element is told apart from its siblings by, if any
+static const char* identifying_attribute(const pt::ptree& element)
+{
+    for (auto name : {"index", "type"}) {
+        if (element.get_child_optional(std::string{"<xmlattr>."} + name)) {
+            return name;
+        }
+    }
+
+    return nullptr;
+}
+
+static void add_keys(const pt::ptree& tree, const std::string& prefix, std::vector<std::string>& keys)
+{
+    auto identity = identifying_attribute(tree);
+    for (auto& child : tree) {
+        if (child.first == "<xmlattr>") {
+            for (auto& attribute : child.second) {
+                if (!identity || attribute.first != identity) {
+                    keys.push_back(prefix + "@" + attribute.first);
+                }
+            }
+            continue;
+        }
+
+        if (child.first == "<xmlcomment>" || child.first == "<xmltext>") {
+            continue;
+        }
+
+        auto path = prefix.empty() ? child.first : prefix + "/" + child.first;
+        auto id = identifying_attribute(child.second);
+        if (id) {
+            path += "[" + child.second.get<std::string>(std::string{"<xmlattr>."} + id) + "]";
+        }
+
+        keys.push_back(path);
+        add_keys(child.second, path, keys);
+    }
+}
+
+Expected<std::vector<std::string>> mml_keys(std::istream& in)
+{
+    pt::ptree tree;
+    try {
+        pt::read_xml(in, tree);
+    } catch (const pt::xml_parser_error& e) {
+        return Error{"Line " + std::to_string(e.line()) + ": " + e.message()};
+    }
+
+    std::vector<std::string> keys;
+    for (auto& root : tree) {
+        if (root.first != "<xmlcomment>") {
+            add_keys(root.second, std::string{}, keys);
+        }
+    }
+
+    return keys;
+}
+
+void MmlIndexWriter::add(const std::string& engine, std::vector<std::string> keys)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    uint32_t id = engines_.size();
+    engines_.push_back(engine);
+    for (auto& key : keys) {
+        postings_[key].push_back(id);
+    }
+}
+
+static void put_u32(std::string& out, uint32_t value)
+{
+    uint8_t buf[4];
+    store_little_u32(buf, value);
+    out.append(reinterpret_cast<char*>(buf), sizeof(buf));
+}
+
+Expected<void> MmlIndexWriter::write(const std::string& path) const
+{
+    std::string engine_offsets, engine_blob;
+    for (auto& engine : engines_) {
+        put_u32(engine_offsets, engine_blob.size());
+        engine_blob += engine;
+    }
+    put_u32(engine_offsets, engine_blob.size());
+
+    std::string key_offsets, key_blob, postings_offsets, postings_blob;
+    for (auto& postings : postings_) {
+        put_u32(key_offsets, key_blob.size());
+        key_blob += postings.first;
+
+        put_u32(postings_offsets, postings_blob.size());
+        postings_blob += encode_postings(postings.second, engines_.size());
+    }
+    put_u32(key_offsets, key_blob.size());
+    put_u32(postings_offsets, postings_blob.size());
+
+    if (engine_blob.size() > UINT32_MAX || key_blob.size() > UINT32_MAX || postings_blob.size() > UINT32_MAX) {
+        return Error{"Index too large"};
+    }
+
+    std::string data(index_magic, sizeof(index_magic));
+    put_u32(data, engines_.size());
+    put_u32(data, postings_.size());
+    put_u32(data, engine_blob.size());
+    put_u32(data, key_blob.size());
+    put_u32(data, postings_blob.size());
+
+    data += engine_offsets;
+    data += key_offsets;
+    data += postings_offsets;
+    data += engine_blob;
+    data += key_blob;
+    data += postings_blob;
+
+    return write_file_atomically(path, data);
+}
+
+// offsets must start at 0, never decrease and end at the blob's size, so
+// that entries can later be taken without checks
+static bool valid_offsets(const uint8_t* offsets, uint32_t count, uint32_t blob_size)
+{
+    uint32_t previous = 0;
+    for (auto i = 0u; i <= count; ++i) {
+        auto offset = load_little_u32(offsets + i * 4);
+        if (offset < previous || (i == 0 && offset != 0)) {
+            return false;
+        }
+        previous = offset;
+    }
+
+    return previous == blob_size;
+}
+
+MmlIndex::MmlIndex(const char* path) : file_{path}
+{
+    auto data = file_.data();
+    auto size = file_.size();
+    if (size < index_header_size || std::memcmp(data, index_magic, sizeof(index_magic))) {
+        throw std::runtime_error(std::string{path} + " is not an MML index");
+    }
+
+    engine_count_ = load_little_u32(data + 4);
+    key_count_ = load_little_u32(data + 8);
+    auto engine_blob_size = load_little_u32(data + 12);
+    auto key_blob_size = load_little_u32(data + 16);
+    auto postings_blob_size = load_little_u32(data + 20);
+
+    uint64_t expected_size = index_header_size +
+        (engine_count_ + 1ull) * 4 + (key_count_ + 1ull) * 8 +
+        engine_blob_size + key_blob_size + postings_blob_size;
+    if (size != expected_size) {
+        throw std::runtime_error(std::string{path} + " is truncated or damaged");
+    }
+
+    engine_offsets_ = data + index_header_size;
+    key_offsets_ = engine_offsets_ + (engine_count_ + 1ull) * 4;
+    postings_offsets_ = key_offsets_ + (key_count_ + 1ull) * 4;
+    engine_blob_ = postings_offsets_ + (key_count_ + 1ull) * 4;
+    key_blob_ = engine_blob_ + engine_blob_size;
+    postings_blob_ = key_blob_ + key_blob_size;
+
+    if (!valid_offsets(engine_offsets_, engine_count_, engine_blob_size) ||
+        !valid_offsets(key_offsets_, key_count_, key_blob_size) ||
+        !valid_offsets(postings_offsets_, key_count_, postings_blob_size))
+    {
+        throw std::runtime_error(std::string{path} + " is truncated or damaged");
+    }
+}
+
+Span MmlIndex::entry(const uint8_t* offsets, const uint8_t* blob, std::size_t i) const
+{
+    auto begin = load_little_u32(offsets + i * 4);
+    auto end = load_little_u32(offsets + (i + 1) * 4);
+    return Span{blob + begin, end - begin};
+}
+
+std::string MmlIndex::engine(uint32_t i) const
+{
+    auto name = entry(engine_offsets_, engine_blob_, i);
+    return std::string(reinterpret_cast<const char*>(name.data), name.size);
+}
+
+std::string MmlIndex::key(std::size_t i) const
+{
+    auto key = entry(key_offsets_, key_blob_, i);
+    return std::string(reinterpret_cast<const char*>(key.data), key.size);
+}
+
+std::vector<std::size_t> MmlIndex::matching(const std::string& query) const
+{
+    auto compare = [&](std::size_t i) {
+        auto key = entry(key_offsets_, key_blob_, i);
+        auto result = std::memcmp(key.data, query.data(), std::min(key.size, query.size()));
+        return result ? result : (key.size < query.size() ? -1 : key.size > query.size());
+    };
+
+    // the first key not before query
+    std::size_t first = 0;
+    std::size_t count = key_count_;
+    while (count) {
+        auto step = count / 2;
+        if (compare(first + step) < 0) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    std::vector<std::size_t> found;
+    for (auto i = first; i < key_count_; ++i) {
+        auto key = entry(key_offsets_, key_blob_, i);
+        if (key.size < query.size() || std::memcmp(key.data, query.data(), query.size())) {
+            break;
+        }
+
+        auto next = key.size == query.size() ? '\0' : static_cast<char>(key.data[query.size()]);
+        if (query.empty() || !next || next == '/' || next == '@' || next == '[') {
+            found.push_back(i);
+        }
+    }
+
+    return found;
+}
+
+Expected<void> MmlIndex::add_engines(std::size_t key, std::vector<bool>& engines) const
+{
+    if (!decode_postings(entry(postings_offsets_, postings_blob_, key), engines)) {
+        return Error{"Damaged postings", -1, MmlIndex::key(key)};
+    }
+
+    return Expected<void>{};
+}
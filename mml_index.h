@@ -0,0 +1,91 @@
+/*
+    mml_index.h: which engines' MML changes which elements
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MML_INDEX_H
+#define MML_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+// the key of every element and attribute in an MML document, such as
+// "stringset[128]/string[5]" or "liquids/liquid[2]@coll"; an element is
+// told apart from its siblings by its index or type attribute, and the
+// root is left out
+Expected<std::vector<std::string>> mml_keys(std::istream& in);
+
+class MmlIndexWriter {
+public:
+    // keys need not be sorted or distinct
+    void add(const std::string& engine, std::vector<std::string> keys);
+
+    std::size_t engine_count() const { return engines_.size(); }
+
+    // a header of the magic number and the number of engines and keys and
+    // the sizes of the three blobs, then an offset table into each blob
+    // for engine names, keys and postings, then the blobs; keys are
+    // sorted, and everything is little-endian
+    Expected<void> write(const std::string& path) const;
+
+private:
+    std::vector<std::string> engines_;
+    std::map<std::string, std::vector<uint32_t>> postings_;
+};
+
+// an index written by MmlIndexWriter, mapped rather than read, so a query
+// only touches the keys its binary search passes and the postings of
+// those it matches
+class MmlIndex {
+public:
+    // throws std::runtime_error if path is not an index
+    explicit MmlIndex(const char* path);
+
+    uint32_t engine_count() const { return engine_count_; }
+    std::string engine(uint32_t i) const;
+
+    std::string key(std::size_t i) const;
+
+    // the key query names and every key below it: those continuing query
+    // with '/', '@' or '[', so "liquids/liquid" matches every liquid; an
+    // empty query matches every key
+    std::vector<std::size_t> matching(const std::string& query) const;
+
+    // sets the bit of each engine that has key
+    Expected<void> add_engines(std::size_t key, std::vector<bool>& engines) const;
+
+private:
+    Span entry(const uint8_t* offsets, const uint8_t* blob, std::size_t i) const;
+
+    MappedFile file_;
+    uint32_t engine_count_;
+    uint32_t key_count_;
+    const uint8_t* engine_offsets_;
+    const uint8_t* key_offsets_;
+    const uint8_t* postings_offsets_;
+    const uint8_t* engine_blob_;
+    const uint8_t* key_blob_;
+    const uint8_t* postings_blob_;
+};
+
+#endif
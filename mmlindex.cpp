@@ -0,0 +1,150 @@
+/*
+    mmlindex.cpp: finds which engines' MML changes which elements
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "mml_index.h"
+
+// indexes the MML that batch runs of resdiff and fuxdiff wrote, one file
+// per engine or state, which is named by its path
+static int build(const char* index_path, const std::vector<std::string>& files)
+{
+    MmlIndexWriter writer;
+    auto result = 0;
+    for (auto& file : files) {
+        std::ifstream ifs(file);
+        if (!ifs) {
+            std::cerr << file << ": Unable to open\n";
+            result = 1;
+            continue;
+        }
+
+        auto keys = mml_keys(ifs);
+        if (!keys) {
+            std::cerr << file << ": " << keys.error().message() << "\n";
+            result = 1;
+            continue;
+        }
+
+        writer.add(file, std::move(*keys));
+    }
+
+    auto written = writer.write(index_path);
+    if (!written) {
+        std::cerr << index_path << ": " << written.error().message() << "\n";
+        return -1;
+    }
+
+    return result;
+}
+
+// each key under prefix, with how many engines have it
+static int list_keys(const MmlIndex& index, const std::string& prefix)
+{
+    for (auto key : index.matching(prefix)) {
+        std::vector<bool> engines(index.engine_count());
+        index.add_engines(key, engines).value();
+        std::cout << index.key(key) << "\t" << std::count(engines.begin(), engines.end(), true) << "\n";
+    }
+
+    return 0;
+}
+
+// the engines matching every query, each of which matches the engines
+// with any key at or below it
+static int query(const MmlIndex& index, const std::vector<std::string>& queries)
+{
+    std::vector<bool> all(index.engine_count(), true);
+    for (auto& q : queries) {
+        std::vector<bool> engines(index.engine_count());
+        for (auto key : index.matching(q)) {
+            index.add_engines(key, engines).value();
+        }
+
+        for (auto i = 0u; i < all.size(); ++i) {
+            all[i] = all[i] && engines[i];
+        }
+    }
+
+    auto found = false;
+    for (auto i = 0u; i < all.size(); ++i) {
+        if (all[i]) {
+            std::cout << index.engine(i) << "\n";
+            found = true;
+        }
+    }
+
+    return found ? 0 : 1;
+}
+
+int main(int argv, char* argc[])
+{
+    const char* build_path = nullptr;
+    const char* list = nullptr;
+    auto keys = false;
+
+    auto arg = 1;
+    for (; arg < argv && argc[arg][0] == '-' && argc[arg][1]; ++arg) {
+        std::string option{argc[arg]};
+        if (option == "--build" && arg + 1 < argv) {
+            build_path = argc[++arg];
+        } else if (option == "--list" && arg + 1 < argv) {
+            list = argc[++arg];
+        } else if (option == "--keys") {
+            keys = true;
+        } else {
+            break;
+        }
+    }
+
+    try {
+        if (build_path) {
+            std::vector<std::string> files(argc + arg, argc + argv);
+            if (list) {
+                auto listed = read_path_list(list);
+                files.insert(files.end(), listed.begin(), listed.end());
+            }
+
+            return build(build_path, files);
+        }
+
+        if (keys && (argv - arg == 1 || argv - arg == 2)) {
+            MmlIndex index{argc[arg]};
+            return list_keys(index, argv - arg == 2 ? argc[arg + 1] : "");
+        }
+
+        if (!keys && argv - arg >= 2) {
+            MmlIndex index{argc[arg]};
+            return query(index, std::vector<std::string>(argc + arg + 1, argc + argv));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return -1;
+    }
+
+    std::cerr << "Usage: mmlindex --build <index> [--list <file>] <mml>...\n";
+    std::cerr << "       mmlindex --keys <index> [<key>]\n";
+    std::cerr << "       mmlindex <index> <key>...\n";
+    return -1;
+}
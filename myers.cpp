@@ -0,0 +1,179 @@
+/*
+    myers.cpp: linear-space Myers difference of two sequences
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "myers.h"
+
+#include <utility>
+
+namespace {
+
+// Myers 1986, section 4b: find the middle snake of an optimal D-path,
+// then recurse on either side of it
+class MyersDiff {
+public:
+    MyersDiff(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) :
+        a_(a), b_(b),
+        forward_(2 * (a.size() + b.size()) + 3),
+        backward_(2 * (a.size() + b.size()) + 3) { }
+
+    std::vector<std::pair<std::size_t, std::size_t>> matches() {
+        compare(0, a_.size(), 0, b_.size());
+        return std::move(matches_);
+    }
+
+private:
+    struct Snake {
+        std::size_t x, y, u, v;
+    };
+
+    void compare(std::size_t a0, std::size_t a1, std::size_t b0, std::size_t b1);
+    Snake middle_snake(std::size_t a0, std::size_t a1, std::size_t b0, std::size_t b1);
+
+    const std::vector<uint64_t>& a_;
+    const std::vector<uint64_t>& b_;
+    std::vector<std::ptrdiff_t> forward_;
+    std::vector<std::ptrdiff_t> backward_;
+    std::vector<std::pair<std::size_t, std::size_t>> matches_;
+};
+
+void MyersDiff::compare(std::size_t a0, std::size_t a1, std::size_t b0, std::size_t b1)
+{
+    // common prefix and suffix are the bulk of any typical edit, and
+    // trimming them keeps the search below to the changed region
+    while (a0 < a1 && b0 < b1 && a_[a0] == b_[b0]) {
+        matches_.emplace_back(a0++, b0++);
+    }
+
+    std::size_t suffix = 0;
+    while (a0 < a1 - suffix && b0 < b1 - suffix &&
+           a_[a1 - suffix - 1] == b_[b1 - suffix - 1])
+    {
+        ++suffix;
+    }
+
+    if (a0 < a1 - suffix && b0 < b1 - suffix) {
+        auto snake = middle_snake(a0, a1 - suffix, b0, b1 - suffix);
+
+        compare(a0, snake.x, b0, snake.y);
+        for (auto x = snake.x, y = snake.y; x < snake.u; ++x, ++y) {
+            matches_.emplace_back(x, y);
+        }
+        compare(snake.u, a1 - suffix, snake.v, b1 - suffix);
+    }
+
+    for (auto i = suffix; i > 0; --i) {
+        matches_.emplace_back(a1 - i, b1 - i);
+    }
+}
+
+MyersDiff::Snake MyersDiff::middle_snake(std::size_t a0, std::size_t a1, std::size_t b0, std::size_t b1)
+{
+    const std::ptrdiff_t n = a1 - a0;
+    const std::ptrdiff_t m = b1 - b0;
+    const std::ptrdiff_t delta = n - m;
+    const std::ptrdiff_t max = (n + m + 1) / 2;
+    const std::ptrdiff_t offset = max + 1;
+    const bool odd = delta & 1;
+
+    // forward_ holds furthest x on each diagonal k = x - y; backward_
+    // holds the same for the reversed sequences
+    forward_[offset + 1] = 0;
+    backward_[offset + 1] = 0;
+
+    for (std::ptrdiff_t d = 0; d <= max; ++d) {
+        for (auto k = -d; k <= d; k += 2) {
+            std::ptrdiff_t x;
+            if (k == -d || (k != d && forward_[offset + k - 1] < forward_[offset + k + 1])) {
+                x = forward_[offset + k + 1];
+            } else {
+                x = forward_[offset + k - 1] + 1;
+            }
+            auto y = x - k;
+            auto x0 = x;
+            auto y0 = y;
+            while (x < n && y < m && a_[a0 + x] == b_[b0 + y]) {
+                ++x;
+                ++y;
+            }
+            forward_[offset + k] = x;
+
+            auto kr = delta - k;
+            if (odd && kr >= -(d - 1) && kr <= d - 1 &&
+                x + backward_[offset + kr] >= n)
+            {
+                return Snake{a0 + x0, b0 + y0, a0 + x, b0 + y};
+            }
+        }
+
+        for (auto k = -d; k <= d; k += 2) {
+            std::ptrdiff_t x;
+            if (k == -d || (k != d && backward_[offset + k - 1] < backward_[offset + k + 1])) {
+                x = backward_[offset + k + 1];
+            } else {
+                x = backward_[offset + k - 1] + 1;
+            }
+            auto y = x - k;
+            auto x0 = x;
+            auto y0 = y;
+            while (x < n && y < m && a_[a1 - x - 1] == b_[b1 - y - 1]) {
+                ++x;
+                ++y;
+            }
+            backward_[offset + k] = x;
+
+            auto kf = delta - k;
+            if (!odd && kf >= -d && kf <= d &&
+                x + forward_[offset + kf] >= n)
+            {
+                return Snake{a1 - x, b1 - y, a1 - x0, b1 - y0};
+            }
+        }
+    }
+
+    // unreachable: an overlap always exists by d == max
+    return Snake{a1, b1, a1, b1};
+}
+
+}
+
+std::vector<DiffHunk> myers_diff(const std::vector<uint64_t>& base,
+                                 const std::vector<uint64_t>& other)
+{
+    std::vector<DiffHunk> hunks;
+
+    std::size_t a = 0;
+    std::size_t b = 0;
+    auto flush = [&](std::size_t x, std::size_t y) {
+        if (x > a || y > b) {
+            hunks.push_back(DiffHunk{a, x - a, b, y - b});
+        }
+        a = x + 1;
+        b = y + 1;
+    };
+
+    for (auto& match : MyersDiff(base, other).matches()) {
+        flush(match.first, match.second);
+    }
+
+    if (base.size() > a || other.size() > b) {
+        hunks.push_back(DiffHunk{a, base.size() - a, b, other.size() - b});
+    }
+
+    return hunks;
+}
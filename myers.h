@@ -0,0 +1,41 @@
+/*
+    myers.h: linear-space Myers difference of two sequences
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MYERS_H
+#define MYERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// a run of base elements replaced by a run of other elements; either length
+// may be zero (pure insertion or deletion)
+struct DiffHunk {
+    std::size_t base_begin;
+    std::size_t base_length;
+    std::size_t other_begin;
+    std::size_t other_length;
+};
+
+// minimal edit script between two sequences of pre-hashed elements, in
+// O((N+M)D) time and O(N+M) space
+std::vector<DiffHunk> myers_diff(const std::vector<uint64_t>& base,
+                                 const std::vector<uint64_t>& other);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+    pipeline.cpp: staged batch pipeline over bounded lock-free queues
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <iomanip>
+#include <sstream>
+
+void Backoff::wait()
+{
+    if (count_ < 64) {
+        ++count_;
+    } else if (count_ < 128) {
+        ++count_;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+StageStats::StageStats(const char* name, unsigned workers) :
+    name{name},
+    workers{workers},
+    items{0},
+    busy_ns{0},
+    starved_ns{0},
+    blocked_ns{0},
+    queue_capacity{0}
+{
+}
+
+Pipeline::~Pipeline()
+{
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+uint64_t Pipeline::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Pipeline::fail(std::exception_ptr e)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!exception_) {
+        exception_ = e;
+    }
+    failed_ = true;
+}
+
+void Pipeline::wait()
+{
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+
+    if (exception_) {
+        std::rethrow_exception(exception_);
+    }
+}
+
+// a stage that is busy nearly all the time, while the one before it is
+// blocked and its own queue is full, is the bottleneck
+void Pipeline::write_stats(std::ostream& s) const
+{
+    auto seconds = [](uint64_t ns) {
+        return ns / 1e9;
+    };
+
+    auto flags = s.flags();
+    s << std::fixed << std::setprecision(3);
+    s << std::left << std::setw(10) << "stage" << std::right
+      << std::setw(8) << "workers"
+      << std::setw(10) << "items"
+      << std::setw(10) << "busy"
+      << std::setw(10) << "starved"
+      << std::setw(10) << "blocked"
+      << std::setw(22) << "queue mean/max/cap" << "\n";
+
+    for (auto& stats : stats_) {
+        s << std::left << std::setw(10) << stats.name << std::right
+          << std::setw(8) << stats.workers
+          << std::setw(10) << stats.items.load()
+          << std::setw(10) << seconds(stats.busy_ns.load())
+          << std::setw(10) << seconds(stats.starved_ns.load())
+          << std::setw(10) << seconds(stats.blocked_ns.load());
+
+        if (stats.queue_capacity) {
+            std::ostringstream queue;
+            queue << std::fixed << std::setprecision(1) << stats.queue_mean()
+                  << "/" << stats.queue_max() << "/" << stats.queue_capacity;
+            s << std::setw(22) << queue.str();
+        } else {
+            s << std::setw(22) << "-";
+        }
+        s << "\n";
+    }
+
+    s.flags(flags);
+}
@@ -0,0 +1,410 @@
+/*
+    pipeline.h: staged batch pipeline over bounded lock-free queues
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// spins, then yields, then sleeps, for threads waiting on a queue
+class Backoff {
+public:
+    Backoff() : count_{0} { }
+    void wait();
+
+private:
+    unsigned count_;
+};
+
+// a fixed-capacity multi-producer, multi-consumer queue (Vyukov's
+// sequence-numbered ring); capacity is rounded up to a power of two.
+// Producers that find it full wait, which is what holds back the stages
+// before a slow one
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity);
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool try_push(T& value);
+    bool try_pop(T& value);
+
+    // waits while the queue is full
+    void push(T value);
+
+    // waits while the queue is empty; false once it is closed and drained
+    bool pop(T& value);
+
+    // called once every producer has finished
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+    // approximate while producers and consumers are running
+    std::size_t size() const;
+
+    // occupancy after each push, for spotting which stage is saturated
+    uint64_t occupancy_max() const { return occupancy_max_.load(); }
+    double occupancy_mean() const;
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    void record_occupancy();
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+
+    // kept on separate cache lines so producers and consumers do not
+    // contend for them
+    alignas(64) std::atomic<std::size_t> enqueue_pos_;
+    alignas(64) std::atomic<std::size_t> dequeue_pos_;
+    alignas(64) std::atomic<bool> closed_;
+
+    std::atomic<uint64_t> occupancy_sum_;
+    std::atomic<uint64_t> occupancy_samples_;
+    std::atomic<uint64_t> occupancy_max_;
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(std::size_t capacity) :
+    enqueue_pos_{0},
+    dequeue_pos_{0},
+    closed_{false},
+    occupancy_sum_{0},
+    occupancy_samples_{0},
+    occupancy_max_{0}
+{
+    std::size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    cells_.reset(new Cell[size]);
+    mask_ = size - 1;
+    for (std::size_t i = 0; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::try_push(T& value)
+{
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+        cell = &cells_[pos & mask_];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    record_occupancy();
+    return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::try_pop(T& value)
+{
+    auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+        cell = &cells_[pos & mask_];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    value = std::move(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+void BoundedQueue<T>::push(T value)
+{
+    Backoff backoff;
+    while (!try_push(value)) {
+        backoff.wait();
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::pop(T& value)
+{
+    Backoff backoff;
+    while (!try_pop(value)) {
+        // everything pushed before close() is visible once it is seen
+        if (closed_.load(std::memory_order_acquire)) {
+            return try_pop(value);
+        }
+        backoff.wait();
+    }
+
+    return true;
+}
+
+template <typename T>
+std::size_t BoundedQueue<T>::size() const
+{
+    auto enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+    auto dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+template <typename T>
+void BoundedQueue<T>::record_occupancy()
+{
+    uint64_t occupancy = size();
+    occupancy_sum_.fetch_add(occupancy, std::memory_order_relaxed);
+    occupancy_samples_.fetch_add(1, std::memory_order_relaxed);
+
+    auto max = occupancy_max_.load(std::memory_order_relaxed);
+    while (occupancy > max && !occupancy_max_.compare_exchange_weak(max, occupancy, std::memory_order_relaxed)) {
+    }
+}
+
+template <typename T>
+double BoundedQueue<T>::occupancy_mean() const
+{
+    auto samples = occupancy_samples_.load();
+    return samples ? static_cast<double>(occupancy_sum_.load()) / samples : 0.0;
+}
+
+// counters for one stage; times are summed across its workers
+struct StageStats {
+    StageStats(const char* name, unsigned workers);
+
+    std::string name;
+    unsigned workers;
+
+    std::atomic<uint64_t> items;
+
+    // working, waiting for input, and waiting for room downstream
+    std::atomic<uint64_t> busy_ns;
+    std::atomic<uint64_t> starved_ns;
+    std::atomic<uint64_t> blocked_ns;
+
+    // the stage's input queue, if it has one
+    std::size_t queue_capacity;
+    std::function<uint64_t()> queue_max;
+    std::function<double()> queue_mean;
+};
+
+// a chain of stages, each with its own worker threads, connected by
+// bounded queues. A stage closes its output once all its workers have
+// finished. If a stage throws, sources stop and the other stages drain
+// their queues without doing further work; wait() then rethrows
+class Pipeline {
+public:
+    Pipeline() : failed_{false} { }
+    ~Pipeline();
+
+    // f(Out&) fills in the next item, returning false when there are no
+    // more; sources run on a single thread
+    template <typename Out, typename F>
+    void add_source(const char* name, BoundedQueue<Out>& out, F f);
+
+    // Out f(In) for each item
+    template <typename In, typename Out, typename F>
+    void add_stage(const char* name, unsigned workers, BoundedQueue<In>& in, BoundedQueue<Out>& out, F f);
+
+    // void f(In) for each item
+    template <typename In, typename F>
+    void add_sink(const char* name, unsigned workers, BoundedQueue<In>& in, F f);
+
+    void wait();
+
+    void write_stats(std::ostream& s) const;
+
+private:
+    static uint64_t now();
+
+    template <typename In>
+    StageStats& add_stats(const char* name, unsigned workers, BoundedQueue<In>* in);
+
+    void fail(std::exception_ptr e);
+
+    std::vector<std::thread> threads_;
+    std::deque<StageStats> stats_;
+
+    std::atomic<bool> failed_;
+    std::mutex mutex_;
+    std::exception_ptr exception_;
+};
+
+template <typename In>
+StageStats& Pipeline::add_stats(const char* name, unsigned workers, BoundedQueue<In>* in)
+{
+    stats_.emplace_back(name, workers);
+    auto& stats = stats_.back();
+    if (in) {
+        stats.queue_capacity = in->capacity();
+        stats.queue_max = [in]() { return in->occupancy_max(); };
+        stats.queue_mean = [in]() { return in->occupancy_mean(); };
+    }
+
+    return stats;
+}
+
+template <typename Out, typename F>
+void Pipeline::add_source(const char* name, BoundedQueue<Out>& out, F f)
+{
+    auto& stats = add_stats<Out>(name, 1, nullptr);
+
+    threads_.emplace_back([this, &out, &stats, f]() mutable {
+        for (;;) {
+            auto start = now();
+
+            Out item;
+            try {
+                if (failed_ || !f(item)) {
+                    break;
+                }
+            } catch (...) {
+                fail(std::current_exception());
+                break;
+            }
+
+            auto done = now();
+            stats.busy_ns += done - start;
+            ++stats.items;
+
+            out.push(std::move(item));
+            stats.blocked_ns += now() - done;
+        }
+
+        out.close();
+    });
+}
+
+template <typename In, typename Out, typename F>
+void Pipeline::add_stage(const char* name, unsigned workers, BoundedQueue<In>& in, BoundedQueue<Out>& out, F f)
+{
+    auto& stats = add_stats(name, workers, &in);
+    auto remaining = std::make_shared<std::atomic<unsigned>>(workers);
+
+    for (auto i = 0u; i < workers; ++i) {
+        threads_.emplace_back([this, &in, &out, &stats, remaining, f]() mutable {
+            In item;
+            for (;;) {
+                auto start = now();
+                if (!in.pop(item)) {
+                    break;
+                }
+
+                auto popped = now();
+                stats.starved_ns += popped - start;
+                if (failed_) {
+                    continue;
+                }
+
+                Out result;
+                try {
+                    result = f(std::move(item));
+                } catch (...) {
+                    fail(std::current_exception());
+                    continue;
+                }
+
+                auto done = now();
+                stats.busy_ns += done - popped;
+                ++stats.items;
+
+                out.push(std::move(result));
+                stats.blocked_ns += now() - done;
+            }
+
+            if (--*remaining == 0) {
+                out.close();
+            }
+        });
+    }
+}
+
+template <typename In, typename F>
+void Pipeline::add_sink(const char* name, unsigned workers, BoundedQueue<In>& in, F f)
+{
+    auto& stats = add_stats(name, workers, &in);
+
+    for (auto i = 0u; i < workers; ++i) {
+        threads_.emplace_back([this, &in, &stats, f]() mutable {
+            In item;
+            for (;;) {
+                auto start = now();
+                if (!in.pop(item)) {
+                    break;
+                }
+
+                auto popped = now();
+                stats.starved_ns += popped - start;
+                if (failed_) {
+                    continue;
+                }
+
+                try {
+                    f(std::move(item));
+                } catch (...) {
+                    fail(std::current_exception());
+                    continue;
+                }
+
+                stats.busy_ns += now() - popped;
+                ++stats.items;
+            }
+        });
+    }
+}
+
+#endif
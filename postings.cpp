@@ -0,0 +1,101 @@
+/*
+    postings.cpp: compressed sets of engine ids
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "postings.h"
+
+#include "varint.h"
+
+enum PostingsKind : uint8_t {
+    gap_postings,
+    bitmap_postings,
+};
+
+std::string encode_postings(const std::vector<uint32_t>& ids, uint32_t count)
+{
+    std::string gaps(1, static_cast<char>(gap_postings));
+    put_varint(gaps, ids.size());
+
+    auto next = 0u;
+    for (auto id : ids) {
+        put_varint(gaps, id - next);
+        next = id + 1;
+    }
+
+    auto bitmap_size = 1 + (count + 7) / 8;
+    if (gaps.size() <= bitmap_size) {
+        return gaps;
+    }
+
+    std::string bitmap(bitmap_size, '\0');
+    bitmap[0] = static_cast<char>(bitmap_postings);
+    for (auto id : ids) {
+        bitmap[1 + id / 8] |= static_cast<char>(1 << (id % 8));
+    }
+
+    return bitmap;
+}
+
+bool decode_postings(Span data, std::vector<bool>& bits)
+{
+    if (data.empty()) {
+        return false;
+    }
+
+    auto p = data.data + 1;
+    auto end = data.data + data.size;
+    if (data.data[0] == bitmap_postings) {
+        if (static_cast<std::size_t>(end - p) != (bits.size() + 7) / 8) {
+            return false;
+        }
+
+        for (auto id = 0u; id < bits.size(); ++id) {
+            if (p[id / 8] & (1 << (id % 8))) {
+                bits[id] = true;
+            }
+        }
+
+        return true;
+    }
+
+    if (data.data[0] != gap_postings) {
+        return false;
+    }
+
+    uint32_t size;
+    if (!get_varint(p, end, size)) {
+        return false;
+    }
+
+    uint64_t id = 0;
+    for (auto i = 0u; i < size; ++i) {
+        uint32_t gap;
+        if (!get_varint(p, end, gap)) {
+            return false;
+        }
+
+        id += gap;
+        if (id >= bits.size()) {
+            return false;
+        }
+
+        bits[id] = true;
+        ++id;
+    }
+
+    return p == end;
+}
@@ -0,0 +1,38 @@
+/*
+    postings.h: compressed sets of engine ids
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSTINGS_H
+#define POSTINGS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// ids, which must be sorted and below count, as whichever is smaller: a
+// kind byte then the number of ids and the gaps between them as varints,
+// or a kind byte then a bit for each id below count. Rare keys take a few
+// bytes and common ones count / 8
+std::string encode_postings(const std::vector<uint32_t>& ids, uint32_t count);
+
+// sets the bit of each id encoded in data, which must have been encoded
+// with the same count as bits.size(); false if data is malformed
+bool decode_postings(Span data, std::vector<bool>& bits);
+
+#endif
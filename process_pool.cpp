@@ -0,0 +1,392 @@
+/*
+    process_pool.cpp: batch workers as forked processes
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "process_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+using namespace boost::endian;
+
+// indices a worker holds at once; enough that it never waits on the
+// parent, few enough that little is requeued when it dies
+static const std::size_t worker_window = 4;
+
+// a result record is its index, its status, the length of its body, then
+// the body: the result, or the error's offset, the length of where, where
+// and the reason
+static const std::size_t record_header_size = 13;
+
+enum RecordStatus : uint8_t {
+    record_ok,
+    record_error,
+};
+
+namespace {
+
+struct Worker {
+    Worker() : pid{-1}, tasks{-1}, results{-1} { }
+
+    pid_t pid;
+
+    // the parent's ends of the pipes
+    int tasks;
+    int results;
+
+    // indices sent and not yet answered, in the order sent
+    std::deque<std::size_t> in_flight;
+
+    // a partly received record
+    std::string buffer;
+};
+
+}
+
+static bool read_fully(int fd, void* data, std::size_t size)
+{
+    auto p = static_cast<uint8_t*>(data);
+    while (size) {
+        auto n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_fully(int fd, const void* data, std::size_t size)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    while (size) {
+        auto n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static std::string encode_record(std::size_t index, const Expected<std::string>& result)
+{
+    std::string body;
+    if (result) {
+        body = *result;
+    } else {
+        auto& error = result.error();
+        uint8_t header[12];
+        store_little_s64(header, error.offset);
+        store_little_u32(header + 8, error.where.size());
+        body.assign(reinterpret_cast<const char*>(header), sizeof(header));
+        body += error.where;
+        body += error.reason;
+    }
+
+    uint8_t header[record_header_size];
+    store_little_u64(header, index);
+    header[8] = result ? record_ok : record_error;
+    store_little_u32(header + 9, body.size());
+
+    return std::string(reinterpret_cast<const char*>(header), sizeof(header)) + body;
+}
+
+static Expected<std::string> decode_result(uint8_t status, const std::string& body)
+{
+    if (status == record_ok) {
+        return body;
+    }
+
+    auto p = reinterpret_cast<const uint8_t*>(body.data());
+    if (body.size() < 12 || body.size() - 12 < load_little_u32(p + 8)) {
+        return Error{"Malformed error record from worker"};
+    }
+
+    auto where_size = load_little_u32(p + 8);
+    return Error{body.substr(12 + where_size), load_little_s64(p), body.substr(12, where_size)};
+}
+
+// a worker's life: run each index the parent sends until it closes the
+// pipe
+[[noreturn]] static void serve(int tasks, int results, const ProcessTask& task)
+{
+    for (;;) {
+        uint8_t index_bytes[8];
+        if (!read_fully(tasks, index_bytes, sizeof(index_bytes))) {
+            _exit(0);
+        }
+
+        auto index = load_little_u64(index_bytes);
+        Expected<std::string> result{Error{}};
+        try {
+            result = task(index);
+        } catch (const std::exception& e) {
+            result = Error{e.what()};
+        }
+
+        auto record = encode_record(index, result);
+        if (!write_fully(results, record.data(), record.size())) {
+            _exit(1);
+        }
+    }
+}
+
+static std::string describe_exit(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return "Worker killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+    }
+
+    if (WIFEXITED(status)) {
+        return "Worker exited with status " + std::to_string(WEXITSTATUS(status));
+    }
+
+    return "Worker died";
+}
+
+static void close_worker(Worker& worker)
+{
+    for (auto fd : {&worker.tasks, &worker.results}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+static void start_worker(Worker& worker, std::vector<Worker>& workers, const ProcessTask& task)
+{
+    int tasks[2];
+    int results[2];
+    if (pipe(tasks) < 0) {
+        throw std::runtime_error(std::string{"Unable to create pipe: "} + std::strerror(errno));
+    }
+    if (pipe(results) < 0) {
+        close(tasks[0]);
+        close(tasks[1]);
+        throw std::runtime_error(std::string{"Unable to create pipe: "} + std::strerror(errno));
+    }
+
+    // anything buffered would otherwise be written twice
+    std::cout.flush();
+    std::cerr.flush();
+
+    auto pid = fork();
+    if (pid < 0) {
+        for (auto fd : {tasks[0], tasks[1], results[0], results[1]}) {
+            close(fd);
+        }
+        throw std::runtime_error(std::string{"Unable to start worker: "} + std::strerror(errno));
+    }
+
+    if (pid == 0) {
+        // a worker holding another's task pipe would keep it from seeing
+        // the end of its work
+        for (auto& other : workers) {
+            close_worker(other);
+        }
+        close(tasks[1]);
+        close(results[0]);
+        signal(SIGPIPE, SIG_DFL);
+
+        serve(tasks[0], results[1], task);
+    }
+
+    close(tasks[0]);
+    close(results[1]);
+
+    worker.pid = pid;
+    worker.tasks = tasks[1];
+    worker.results = results[0];
+    worker.buffer.clear();
+}
+
+std::size_t run_in_processes(std::size_t count, unsigned workers, const ProcessTask& task, const ProcessResult& done)
+{
+    std::vector<Worker> pool(std::max(1u, std::min<unsigned>(workers, std::max<std::size_t>(count, 1))));
+    std::size_t lost = 0;
+
+    // a worker that dies leaves its pipe broken; that is noticed when its
+    // results end, rather than by signal
+    auto old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+    // inputs sent to workers that died before reaching them go first
+    std::size_t next = 0;
+    std::deque<std::size_t> requeued;
+    auto remaining = count;
+
+    auto has_work = [&]() {
+        return !requeued.empty() || next < count;
+    };
+
+    auto take = [&]() {
+        if (!requeued.empty()) {
+            auto index = requeued.front();
+            requeued.pop_front();
+            return index;
+        }
+        return next++;
+    };
+
+    auto reap = [&](Worker& worker) {
+        close_worker(worker);
+
+        int status = 0;
+        while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        worker.pid = -1;
+
+        // the worker answers in order, so the first input it had not
+        // answered is the one it died on
+        if (!worker.in_flight.empty()) {
+            auto crashed = worker.in_flight.front();
+            worker.in_flight.pop_front();
+            requeued.insert(requeued.begin(), worker.in_flight.begin(), worker.in_flight.end());
+            worker.in_flight.clear();
+
+            --remaining;
+            done(crashed, Error{describe_exit(status)});
+        }
+    };
+
+    try {
+        while (remaining) {
+            for (auto& worker : pool) {
+                if (worker.pid < 0 && has_work()) {
+                    start_worker(worker, pool, task);
+                }
+
+                while (worker.pid >= 0 && worker.in_flight.size() < worker_window && has_work()) {
+                    auto index = take();
+                    worker.in_flight.push_back(index);
+
+                    uint8_t index_bytes[8];
+                    store_little_u64(index_bytes, index);
+                    if (!write_fully(worker.tasks, index_bytes, sizeof(index_bytes))) {
+                        // its results will end presently
+                        break;
+                    }
+                }
+            }
+
+            std::vector<pollfd> fds;
+            std::vector<Worker*> polled;
+            for (auto& worker : pool) {
+                if (worker.pid >= 0) {
+                    fds.push_back(pollfd{worker.results, POLLIN, 0});
+                    polled.push_back(&worker);
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string{"Unable to wait for workers: "} + std::strerror(errno));
+            }
+
+            for (auto i = 0u; i < fds.size(); ++i) {
+                if (!fds[i].revents) {
+                    continue;
+                }
+
+                auto& worker = *polled[i];
+                char chunk[64 * 1024];
+                auto n = read(worker.results, chunk, sizeof(chunk));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    ++lost;
+                    reap(worker);
+                    continue;
+                }
+
+                worker.buffer.append(chunk, n);
+
+                std::size_t offset = 0;
+                while (worker.buffer.size() - offset >= record_header_size) {
+                    auto p = reinterpret_cast<const uint8_t*>(worker.buffer.data() + offset);
+                    auto size = load_little_u32(p + 9);
+                    if (worker.buffer.size() - offset - record_header_size < size) {
+                        break;
+                    }
+
+                    auto index = load_little_u64(p);
+                    auto result = decode_result(p[8], worker.buffer.substr(offset + record_header_size, size));
+                    offset += record_header_size + size;
+
+                    auto it = std::find(worker.in_flight.begin(), worker.in_flight.end(), index);
+                    if (it != worker.in_flight.end()) {
+                        worker.in_flight.erase(it);
+                        --remaining;
+                        done(index, std::move(result));
+                    }
+                }
+                worker.buffer.erase(0, offset);
+            }
+        }
+    } catch (...) {
+        for (auto& worker : pool) {
+            if (worker.pid >= 0) {
+                kill(worker.pid, SIGKILL);
+                close_worker(worker);
+                waitpid(worker.pid, nullptr, 0);
+            }
+        }
+        signal(SIGPIPE, old_sigpipe);
+        throw;
+    }
+
+    // closing the task pipes lets the workers finish
+    for (auto& worker : pool) {
+        if (worker.pid >= 0) {
+            close_worker(worker);
+            while (waitpid(worker.pid, nullptr, 0) < 0 && errno == EINTR) {
+            }
+        }
+    }
+
+    signal(SIGPIPE, old_sigpipe);
+    return lost;
+}
@@ -0,0 +1,46 @@
+/*
+    process_pool.h: batch workers as forked processes
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROCESS_POOL_H
+#define PROCESS_POOL_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+#include "expected.h"
+
+// what a worker makes of input index, and what becomes of it back in the
+// parent
+using ProcessTask = std::function<Expected<std::string>(std::size_t index)>;
+using ProcessResult = std::function<void(std::size_t index, Expected<std::string> result)>;
+
+// runs task for every index below count in up to workers forked
+// processes, so an input that crashes its worker cannot take down the run.
+// Workers inherit everything the parent loaded beforehand, such as the
+// base, and share it copy-on-write instead of each reading it again.
+// Indices go to workers over a pipe a few at a time, and results come back
+// over another as length-prefixed records, for done to handle in the
+// calling process in the order they arrive. A worker that dies is
+// replaced: the input it was working on fails with how it died, and those
+// queued behind it go to the next worker. Returns how many workers died
+// before their work was done; throws std::runtime_error if workers cannot
+// be started
+std::size_t run_in_processes(std::size_t count, unsigned workers, const ProcessTask& task, const ProcessResult& done);
+
+#endif
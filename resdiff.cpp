@@ -17,480 +17,1035 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
 #include <exception>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
-#include <boost/crc.hpp>
 #include <boost/endian/arithmetic.hpp>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-
-#include "macroman.h"
+#include <boost/endian/conversion.hpp>
+
+#include "batch.h"
+#include "batch_reader.h"
+#include "cache.h"
+#include "container.h"
+#include "crc32.h"
+#include "daemon.h"
+#include "dictionary.h"
+#include "expected.h"
+#include "journal.h"
+#include "hash.h"
+#include "macbinary.h"
+#include "mapped_file.h"
+#include "memory_budget.h"
+#include "pipeline.h"
+#include "process_pool.h"
+#include "sketch.h"
+#include "store.h"
+#include "thread_pool.h"
 
 using namespace boost::endian;
-namespace pt = boost::property_tree;
 
-using ResourceType = std::array<char, 4>;
-using ResourceId = std::pair<ResourceType, int>;
+// structural problems with a resource fork: anything outside its area of
+// the fork, overlapping data, duplicate ids
+static std::vector<std::string> verify_resource_map(Span fork)
+{
+    std::vector<std::string> problems;
+    auto problem = [&](const std::string& what) {
+        problems.push_back(what);
+        return problems;
+    };
 
-struct ResourceForkHeader {
-    big_uint32_t data_offset;
-    big_uint32_t map_offset;
-    big_uint32_t data_length;
-    big_uint32_t map_length;
-};
+    if (fork.size < sizeof(ResourceForkHeader)) {
+        return problem("fork shorter than its header");
+    }
 
-struct TypeListEntry {
-    ResourceType type;
-    big_int16_t num_refs;
-    big_int16_t ref_list_offset;
-};
+    auto header = reinterpret_cast<const ResourceForkHeader*>(fork.data);
+    uint64_t data_offset = header->data_offset;
+    uint64_t data_length = header->data_length;
+    uint64_t map_offset = header->map_offset;
+    uint64_t map_length = header->map_length;
 
-struct RefListEntry {
-    big_int16_t id;
-    big_int16_t name_list_offset;
-    big_uint32_t data_offset;
-    big_uint32_t unused;
-};
+    if (data_offset + data_length > fork.size) {
+        return problem("data extends past end of fork");
+    }
+    if (map_offset + map_length > fork.size || map_length < 30) {
+        return problem("map extends past end of fork");
+    }
+    if (data_offset < map_offset + map_length && map_offset < data_offset + data_length) {
+        problem("data and map overlap");
+    }
+
+    auto map = fork.data + map_offset;
+    uint64_t type_list_offset = load_big_u16(map + 24);
+    uint64_t name_list_offset = load_big_u16(map + 26);
+    if (type_list_offset + 2 > map_length) {
+        return problem("type list outside map");
+    }
+    if (name_list_offset > map_length) {
+        problem("name list outside map");
+    }
+
+    auto type_list = map + type_list_offset;
+    auto num_types = load_big_s16(type_list) + 1;
+    if (type_list_offset + 2 + num_types * 8 > map_length) {
+        return problem("type list extends past end of map");
+    }
 
-struct RGBColor {
-    pt::ptree diff(const RGBColor& other) {
-        pt::ptree tree;
+    struct Extent {
+        uint64_t begin;
+        uint64_t end;
+        ResourceId id;
+    };
+    std::vector<Extent> extents;
+    std::map<ResourceId, int> seen;
+
+    for (auto i = 0; i < num_types; ++i) {
+        auto type_list_entry = reinterpret_cast<const TypeListEntry*>(type_list + 2 + i * 8);
+        auto type = std::string(type_list_entry->type.data(), 4);
 
-        if (r != other.r ||
-            g != other.g ||
-            b != other.b)
-        {
-            tree.put("color.<xmlattr>.red", other.r / 65535.0);
-            tree.put("color.<xmlattr>.green", other.g / 65535.0);
-            tree.put("color.<xmlattr>.blue", other.b / 65535.0);
+        auto num_refs = type_list_entry->num_refs + 1;
+        uint64_t ref_list_offset = type_list_offset + type_list_entry->ref_list_offset;
+        if (ref_list_offset + num_refs * 12 > map_length) {
+            problem("'" + type + "' reference list extends past end of map");
+            continue;
         }
 
-        return tree;
-    }
+        for (auto j = 0; j < num_refs; ++j) {
+            auto ref_list_entry = reinterpret_cast<const RefListEntry*>(map + ref_list_offset + j * 12);
+            ResourceId id{type_list_entry->type, ref_list_entry->id.value()};
+            auto name = "'" + type + "' " + std::to_string(id.second);
 
-    pt::ptree diff(int index, const RGBColor& other) {
-        pt::ptree tree;
+            if (seen[id]++ == 1) {
+                problem(name + " appears more than once");
+            }
+
+            if (ref_list_entry->name_list_offset != -1) {
+                auto name_offset = name_list_offset + static_cast<uint16_t>(ref_list_entry->name_list_offset);
+                if (name_offset >= map_length || name_offset + 1 + map[name_offset] > map_length) {
+                    problem(name + " name outside map");
+                }
+            }
 
-        if (r != other.r ||
-            g != other.g ||
-            b != other.b)
-        {
-            tree.put("color.<xmlattr>.index", index);
-            tree.put("color.<xmlattr>.red", other.r / 65535.0);
-            tree.put("color.<xmlattr>.green", other.g / 65535.0);
-            tree.put("color.<xmlattr>.blue", other.b / 65535.0);
+            uint64_t offset = ref_list_entry->data_offset & 0x00ffffff;
+            if (offset + 4 > data_length ||
+                offset + 4 + load_big_u32(fork.data + data_offset + offset) > data_length)
+            {
+                problem(name + " data extends past end of data");
+                continue;
+            }
+
+            extents.push_back(Extent{offset, offset + 4 + load_big_u32(fork.data + data_offset + offset), id});
         }
+    }
 
-        return tree;
+    std::sort(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) {
+        return a.begin < b.begin;
+    });
+    for (auto i = 1u; i < extents.size(); ++i) {
+        if (extents[i].begin < extents[i - 1].end) {
+            auto& a = extents[i - 1].id;
+            auto& b = extents[i].id;
+            problem("'" + std::string(a.first.data(), 4) + "' " + std::to_string(a.second) +
+                    " overlaps '" + std::string(b.first.data(), 4) + "' " + std::to_string(b.second));
+        }
     }
-    
-    big_uint16_t r;
-    big_uint16_t g;
-    big_uint16_t b;
-};
 
-bool operator==(const RGBColor& a, const RGBColor& b)
-{
-    return a.r == b.r && a.g == b.g && a.b == b.b;
+    return problems;
 }
 
-bool operator!=(const RGBColor& a, const RGBColor& b)
+// writes one tab-separated integrity record for the file: container,
+// header check, size and CRC-32 of each fork, and the map's structure
+static bool verify(const char* filename, std::ostream& out)
 {
-    return !(a == b);
+    out << filename;
+
+    try {
+        std::unique_ptr<MappedFile> file;
+        std::vector<uint8_t> input;
+        Span span;
+        if (std::string{filename} == "-") {
+            input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+            span = Span{input.data(), input.size()};
+        } else {
+            file.reset(new MappedFile{filename});
+            span = file->span();
+        }
+
+        std::vector<uint8_t> buffer;
+        auto found = find_forks(span, buffer);
+        auto& forks = found.value();
+
+        auto crc = [](Span fork) {
+            std::ostringstream oss;
+            oss << fork.size << ":" << std::hex << std::setw(8) << std::setfill('0') << crc32(fork.data, fork.size);
+            return oss.str();
+        };
+
+        out << "\tcontainer=" << container_name(forks.container)
+            << "\theader=" << (forks.header_checked ? "ok" : "none")
+            << "\tdata=" << crc(forks.data)
+            << "\tresource=" << crc(forks.resource);
+
+        auto problems = verify_resource_map(forks.resource);
+        if (problems.empty()) {
+            out << "\tmap=ok\n";
+            return true;
+        }
+
+        out << "\tmap=";
+        for (auto i = 0u; i < problems.size(); ++i) {
+            out << (i ? "; " : "") << problems[i];
+        }
+        out << "\n";
+    } catch (const std::exception& e) {
+        out << "\terror=" << e.what() << "\n";
+    }
+
+    return false;
 }
 
-struct Rect {
-    pt::ptree diff(int index, const Rect& other) {
-        pt::ptree tree;
-
-        if (top != other.top ||
-            left != other.left ||
-            bottom != other.bottom ||
-            right != other.right)
-        {
-            tree.put("rect.<xmlattr>.index", index);
-            tree.put("rect.<xmlattr>.top", other.top);
-            tree.put("rect.<xmlattr>.left", other.left);
-            tree.put("rect.<xmlattr>.bottom", other.bottom);
-            tree.put("rect.<xmlattr>.right", other.right);
-        }
-
-        return tree;
-    }
-    
-    big_uint16_t top;
-    big_uint16_t left;
-    big_uint16_t bottom;
-    big_uint16_t right;
+// an engine others are stored as deltas against, each resource against
+// the base's resource of the same type and id
+struct DeltaBase {
+    explicit DeltaBase(const char* filename)
+    {
+        std::unique_ptr<MappedFile> file{new MappedFile{filename}};
+        auto span = file->span();
+        if (is_manifest(span)) {
+            throw std::runtime_error(std::string{filename} + " is a manifest; give the engine itself");
+        }
+
+        engine = std::move(MacBinary::create(std::move(file), nullptr, true).value());
+        for (auto& resource : engine->stored_resources(span)) {
+            resources.insert(resource);
+        }
+    }
+
+    std::unique_ptr<MacBinary> engine;
+    std::map<ResourceId, Span> resources;
 };
 
-bool operator==(const Rect& a, const Rect& b)
+// adds the file to the object store, split into its resources so that
+// those it shares with other engines are kept once, or if there is a base
+// those changed from it are kept as deltas, and writes a tab-separated
+// record of the manifest and how many new bytes it took
+static bool store(ObjectStore& store, const char* filename, const DeltaBase* base, std::ostream& out)
 {
-    return a.top == b.top && a.left == b.left &&
-        a.bottom == b.bottom && a.right == b.right;
-}
+    out << filename;
+
+    try {
+        std::unique_ptr<MappedFile> file{new MappedFile{filename}};
+        auto span = file->span();
+        if (is_manifest(span)) {
+            out << "\terror=already a manifest\n";
+            return false;
+        }
+
+        auto binary = MacBinary::create(std::move(file), nullptr, true);
+        auto& engine = binary.value();
+
+        std::vector<Span> payloads;
+        std::vector<Span> references;
+        for (auto& resource : engine->stored_resources(span)) {
+            payloads.push_back(resource.second);
+            if (base) {
+                auto it = base->resources.find(resource.first);
+                references.push_back(it != base->resources.end() ? it->second : Span{nullptr, 0});
+            }
+        }
+
+        auto added = store.add(flatten_path(filename) + ".manifest", span, payloads, references).value();
+        out << "\tmanifest=" << added.manifest
+            << "\tsize=" << span.size
+            << "\tnew=" << added.bytes << "\n";
+        return true;
+    } catch (const std::exception& e) {
+        out << "\terror=" << e.what() << "\n";
+    }
 
-bool operator!=(const Rect& a, const Rect& b) {
-    return !(a == b);
+    return false;
 }
 
-class MacBinary {
-public:
-    class Exception : public std::runtime_error {
-    public:
-        Exception(const char* what) : std::runtime_error{what} { }
-    };
-    
-    MacBinary(const char* filename) : stream_{filename} {
-        load();
+// gathers the strings of every engine into a dictionary at path, decoding
+// each on pool; engines that cannot be read are reported and left out
+static int build_dictionary(const char* path, const std::vector<std::string>& files, ThreadPool* pool)
+{
+    DictionaryWriter writer;
+    auto result = 0;
+    for (auto& filename : files) {
+        try {
+            std::unique_ptr<MappedFile> file{new MappedFile{filename.c_str()}};
+            auto engine = MacBinary::create(std::move(file), pool);
+            if (!engine) {
+                std::cerr << filename << ": " << engine.error().message() << "\n";
+                result = 1;
+                continue;
+            }
+
+            auto id = writer.add_engine(filename);
+            (*engine)->for_each_string([&](int stringset, std::size_t index, const std::string& s) {
+                writer.add(id, stringset, index, s);
+            });
+        } catch (const std::exception& e) {
+            std::cerr << filename << ": " << e.what() << "\n";
+            result = 1;
+        }
     }
 
-    const std::vector<uint8_t>& GetResource(uint32_t type, int16_t id);
+    auto written = writer.write(path);
+    if (!written) {
+        std::cerr << path << ": " << written.error().message() << "\n";
+        return -1;
+    }
 
-    void diff(MacBinary& other);
+    return result;
+}
 
-private:
-    void load();
-    void load_resources();
+// tabs and line breaks would break up the tab-separated lines
+static std::string escape_tsv(const std::string& s)
+{
+    std::string escaped;
+    for (auto c : s) {
+        switch (c) {
+        case '\t': escaped += "\\t"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\\': escaped += "\\\\"; break;
+        default: escaped += c;
+        }
+    }
 
-    std::map<int, std::vector<std::string>> strings_;
-    std::array<RGBColor, 26> interface_colors_;
-    std::array<Rect, 18> interface_rects_;
-    std::map<int, std::vector<std::string>> menu_strings_;
+    return escaped;
+}
 
-    std::ifstream stream_;
-};
+// writes a tab-separated line for every place each string containing (or
+// equal to) one of texts was found: the engine, the stringset, the index
+// and the string
+static int find_strings(const char* path, const std::vector<std::string>& texts, bool exact)
+{
+    Dictionary dictionary{path};
+
+    auto found = false;
+    for (auto& text : texts) {
+        for (auto id : exact ? dictionary.find_exact(text) : dictionary.find_substring(text)) {
+            auto s = escape_tsv(dictionary.string(id));
+            for (auto& occurrence : dictionary.occurrences(id)) {
+                std::cout << dictionary.engine(occurrence.engine) << "\t"
+                          << occurrence.stringset << "\t"
+                          << occurrence.index << "\t"
+                          << s << "\n";
+                found = true;
+            }
+        }
+    }
 
-void MacBinary::load()
+    return found ? 0 : 1;
+}
+
+// made from the resource map alone, so nothing is decoded
+static Expected<Sketch> sketch_engine(const char* filename)
 {
-    std::array<uint8_t, 128> header;
     try {
-        stream_.read(reinterpret_cast<char*>(header.data()), header.size());
-    } catch (std::ios_base::failure) {
-        throw Exception("File not long enough");
+        std::unique_ptr<MappedFile> file{new MappedFile{filename}};
+        auto engine = MacBinary::create(std::move(file), nullptr, true);
+        if (!engine) {
+            return engine.error();
+        }
+
+        return make_sketch((*engine)->resource_fingerprints());
+    } catch (const std::exception& e) {
+        return Error{e.what()};
     }
+}
 
-    if (header[0] || header[1] > 63 || header[74] || header[123] > 0x81) {
-        throw Exception("Header magic mismatch");
+// the cache is keyed on this rather than the build, so rebuilding the
+// same sources keeps its entries; bump it with any change to the MML
+// resdiff writes, or stale results will be reused
+static const char* version = "resdiff output 1";
+
+// diffs base_filename against mod_filename through cache. Both are mapped
+// and hashed first; if no earlier run left the result, only resources
+// whose part of it is missing are decoded
+static int diff_cached(const char* base_filename, const char* mod_filename, const char* cache_dir, ThreadPool* pool)
+{
+    ResultCache cache{cache_dir, version};
+
+    std::unique_ptr<MappedFile> base_file{new MappedFile{base_filename}};
+    std::unique_ptr<MappedFile> mod_file{new MappedFile{mod_filename}};
+
+    auto key = cache.key(hash64(base_file->data(), base_file->size()), hash64(mod_file->data(), mod_file->size()));
+    if (cache.fetch(key, std::cout)) {
+        return 0;
     }
-    
-    boost::crc_optimal<16, 0x1021, 0, 0, false, false> crc;
-    crc.process_bytes(header.data(), 124);
-    if (crc.checksum() != ((header[124] << 8) | header[125])) {
-        throw Exception("Header CRC mismatch");
+
+    auto base = MacBinary::create(std::move(base_file), pool, true);
+    if (!base) {
+        std::cerr << base_filename << ": " << base.error().message() << "\n";
+        return -1;
+    }
+
+    auto mod = MacBinary::create(std::move(mod_file), pool, true);
+    if (!mod) {
+        std::cerr << mod_filename << ": " << mod.error().message() << "\n";
+        return -1;
     }
 
-    big_uint32_t data_length;
-    std::copy_n(&header[83], 4, reinterpret_cast<uint8_t*>(&data_length));
+    std::ostringstream oss;
+    auto diffed = (*base)->diff(**mod, cache, oss);
+    if (!diffed) {
+        std::cerr << mod_filename << ": " << diffed.error().message() << "\n";
+        return -1;
+    }
 
-    big_uint32_t resource_length;
-    std::copy_n(&header[87], 4, reinterpret_cast<uint8_t*>(&resource_length));
+    auto mml = oss.str();
+    std::cout << mml;
 
-    uint32_t resource_offset = 128 + ((data_length.value() + 0x7f) & ~0x7f);
+    auto stored = cache.store(key, mml);
+    if (!stored) {
+        std::cerr << stored.error().message() << "\n";
+        return 1;
+    }
 
-    stream_.seekg(resource_offset, stream_.beg);
-    load_resources();
+    return 0;
 }
 
-static std::string read_pstring(std::istream& stream)
-{
-    uint8_t len;
-    stream.read(reinterpret_cast<char*>(&len), 1);
+// an input as it moves through the batch pipeline; each stage fills in
+// the next part, or the error that stops it
+struct BatchItem {
+    BatchItem() : hash{0}, key{0}, skipped{false}, cached{false}, base{nullptr}, failed{false} { }
 
-    std::string s;
-    s.resize(len);
-    stream.read(&s[0], len);
+    BatchFile file;
+    std::string output;
 
-    return s;
-}
+    // only filled in when there is a journal or a cache
+    uint64_t hash;
+    uint64_t key;
+    bool skipped;
 
-void MacBinary::load_resources()
-{
-    std::streampos start = stream_.tellg();
+    // mml came from the cache
+    bool cached;
 
-    ResourceForkHeader header;
-    stream_.read(reinterpret_cast<char*>(&header), 16);
+    std::unique_ptr<MacBinary> mod;
+    MacBinary* base;
+    std::string mml;
 
-    header.data_offset += start;
-    header.map_offset += start;
+    bool failed;
+    Error error;
+};
 
-    stream_.seekg(header.map_offset.value() + 24);
+using BatchItemPtr = std::unique_ptr<BatchItem>;
 
-    big_uint16_t type_list_offset;
-    stream_.read(reinterpret_cast<char*>(&type_list_offset), 2);
+// the engines --auto-base chooses among in a batch run, each read the
+// first time an input resembles it and shared from then on
+class References {
+public:
+    explicit References(const char* index_path)
+    {
+        index_.load(index_path).value();
+        if (!index_.size()) {
+            throw std::runtime_error(std::string{index_path} + " holds no references");
+        }
+    }
 
-    type_list_offset += header.map_offset.value();
+    Expected<MacBinary*> nearest(const Sketch& sketch)
+    {
+        auto i = index_.nearest(sketch);
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto& engine = engines_[i];
+        if (!engine) {
+            try {
+                engine.reset(new MacBinary{index_.name(i).c_str()});
+            } catch (const std::exception& e) {
+                return Error{index_.name(i) + ": " + e.what()};
+            }
+        }
 
-    stream_.seekg(2, stream_.cur);
+        return engine.get();
+    }
 
-    big_uint16_t num_types;
-    stream_.read(reinterpret_cast<char*>(&num_types), 2);
-    ++num_types;
+private:
+    SketchIndex index_;
+    std::mutex mutex_;
+    std::map<int, std::unique_ptr<MacBinary>> engines_;
+};
 
-    std::vector<TypeListEntry> type_list(num_types);
-    stream_.read(reinterpret_cast<char*>(type_list.data()), num_types * 8);
+// as run_batch(), with each input read and diffed in a worker process
+// rather than a pipeline stage. The base is read once, before the workers
+// start, and they share it: its resources stay in the mapped file, and
+// what was decoded from them is shared copy-on-write
+static int run_process_batch(const char* base_filename, const std::vector<std::string>& inputs, const BatchOptions& options)
+{
+    if (options.auto_base || options.journal || options.cache) {
+        throw std::runtime_error("--processes cannot be combined with --auto-base, --journal or --cache");
+    }
 
-    std::map<int16_t, uint32_t> str_offsets;
-    uint32_t clut_130_offset = 0;
-    uint32_t nrct_128_offset = 0;
-    std::map<int16_t, uint32_t> menu_offsets;
+    MacBinary base{base_filename};
+    ErrorReport report{options.error_report_path()};
 
-    for (auto& type_list_entry : type_list) {
-        if (type_list_entry.type == ResourceType{'S','T','R','#'}) {
-            for (auto i = 0; i < type_list_entry.num_refs + 1; ++i) {
-                RefListEntry ref_list_entry;
-                stream_.read(reinterpret_cast<char*>(&ref_list_entry), 12);
-                str_offsets[ref_list_entry.id] = ref_list_entry.data_offset & 0x00ffffff;
-            }
-        } else if (type_list_entry.type == ResourceType{'c','l','u','t'}) {
-            for (auto i = 0; i < type_list_entry.num_refs + 1; ++i) {
-                RefListEntry ref_list_entry;
-                stream_.read(reinterpret_cast<char*>(&ref_list_entry), 12);
-                if (ref_list_entry.id == 130) {
-                    clut_130_offset = ref_list_entry.data_offset & 0x00ffffff;
-                }
-            }
-        } else if (type_list_entry.type == ResourceType{'n','r','c','t'}) {
-            for (auto i = 0; i < type_list_entry.num_refs + 1; ++i) {
-                RefListEntry ref_list_entry;
-                stream_.read(reinterpret_cast<char*>(&ref_list_entry), 12);
-                if (ref_list_entry.id == 128) {
-                    nrct_128_offset = ref_list_entry.data_offset & 0x00ffffff;
-                }
-            }
-        } else if (type_list_entry.type == ResourceType{'M','E','N','U'}) {
-            for (auto i = 0; i < type_list_entry.num_refs + 1; ++i) {
-                RefListEntry ref_list_entry;
-                stream_.read(reinterpret_cast<char*>(&ref_list_entry), 12);
-                if (ref_list_entry.id == 1000 ||
-                    ref_list_entry.id == 2004)
-                {
-                    menu_offsets[ref_list_entry.id] = ref_list_entry.data_offset & 0x00ffffff;
-                }
+    auto lost = run_in_processes(inputs.size(), options.processes, [&](std::size_t i) -> Expected<std::string> {
+        auto mod = MacBinary::create(std::unique_ptr<MappedFile>{new MappedFile{inputs[i].c_str()}});
+        if (!mod) {
+            return mod.error();
+        }
+
+        std::ostringstream oss;
+        base.diff(**mod, oss);
+        return oss.str();
+    }, [&](std::size_t i, Expected<std::string> mml) {
+        if (mml) {
+            auto written = write_file_atomically(batch_output_path(options.output_dir, inputs[i]), *mml);
+            if (!written) {
+                report.add(inputs[i], written.error());
             }
         } else {
-            stream_.seekg((type_list_entry.num_refs + 1) * 12, stream_.cur);
+            report.add(inputs[i], mml.error());
         }
+    });
+
+    if (lost) {
+        std::cerr << lost << (lost == 1 ? " worker" : " workers") << " died and had to be replaced\n";
     }
 
-    for (auto& str : str_offsets) {
-        stream_.seekg(str.second + header.data_offset);
+    return report.summarize(std::cerr) ? 0 : 1;
+}
 
-        big_uint32_t length;
-        stream_.read(reinterpret_cast<char*>(&length), 4);
+// diffs each input against base, or the reference it most resembles,
+// writing one MML file per input to the output directory. Reading,
+// decoding, diffing and writing overlap as pipeline stages; an input that
+// fails is recorded in the error report and skipped rather than ending
+// the run
+static int run_batch(const char* base_filename, std::vector<std::string> inputs, const BatchOptions& options)
+{
+    check_output_paths(options.output_dir, inputs);
 
-        big_int16_t num_strings;
-        stream_.read(reinterpret_cast<char*>(&num_strings), 2);
+    if (options.processes) {
+        return run_process_batch(base_filename, inputs, options);
+    }
 
-        auto& v = strings_[str.first];
-        v.clear();
-        
-        for (auto i = 0; i < num_strings; ++i) {
-            uint8_t string_length;
-            stream_.read(reinterpret_cast<char*>(&string_length), 1);
+    std::unique_ptr<MacBinary> base;
+    std::unique_ptr<References> references;
+    if (options.auto_base) {
+        // the journal and cache are keyed by the base, which is not known
+        // until each input has been read
+        if (options.journal || options.cache) {
+            throw std::runtime_error("--auto-base cannot be combined with --journal or --cache in batch mode");
+        }
+        references.reset(new References{options.auto_base});
+    } else {
+        base.reset(new MacBinary{base_filename});
+    }
 
-            std::string s;
-            s.resize(string_length);
-            stream_.read(&s[0], s.size());
+    ErrorReport report{options.error_report_path()};
 
-            v.push_back(s);
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<ResultCache> cache;
+    std::atomic<std::size_t> skipped{0};
+    uint64_t base_hash = 0;
+    if (options.journal || options.cache) {
+        if (std::string{base_filename} == "-") {
+            throw std::runtime_error("--journal and --cache need the base in a file");
         }
+        base_hash = hash_file(base_filename).value();
     }
 
-    {
-        // clut id 130 sets interface colors
-        stream_.seekg(clut_130_offset + header.data_offset);
+    if (options.journal) {
+        // a journal kept by the other tool, or against another base, has
+        // nothing in common with this run
+        journal.reset(new Journal{options.journal, options.output_dir, hash64(std::string{"resdiff"}, base_hash), options.journal_sync});
+    }
+
+    if (options.cache) {
+        cache.reset(new ResultCache{options.cache, version});
+    }
+
+    MemoryBudget budget{options.memory_limit};
+    std::atomic<std::size_t> past_decode{0};
+    std::atomic<std::size_t> past_diff{0};
+
+    // an engine's index and decoded resources take about as much again as
+    // the file itself
+    BatchReader reader{std::move(inputs), options.queue_depth, &budget, 2};
 
-        big_uint32_t length;
-        stream_.read(reinterpret_cast<char*>(&length), 4);
+    BoundedQueue<BatchItemPtr> read{options.queue_size};
+    BoundedQueue<BatchItemPtr> decoded{options.queue_size};
+    BoundedQueue<BatchItemPtr> diffed{options.queue_size};
 
-        big_uint32_t seed;
-        stream_.read(reinterpret_cast<char*>(&length), 4);
+    Pipeline pipeline;
 
-        big_uint16_t flags;
-        stream_.read(reinterpret_cast<char*>(&flags), 2);
+    pipeline.add_source("read", read, [&](BatchItemPtr& item) {
+        item.reset(new BatchItem);
+        if (!reader.next(item->file)) {
+            return false;
+        }
+        item->output = batch_output_path(options.output_dir, item->file.path);
+
+        if (item->file.error) {
+            item->failed = true;
+            item->error = Error{std::strerror(item->file.error)};
+        }
+        return true;
+    });
+
+    // files are decoded one to a worker, so no pool is needed
+    pipeline.add_stage("decode", options.decode_threads, read, decoded, [&](BatchItemPtr item) {
+        if (!item->failed && (journal || cache)) {
+            auto hash = item->file.oversized ? hash_file(item->file.path.c_str()) : Expected<uint64_t>{hash64(item->file.data.data(), item->file.data.size())};
+            if (hash) {
+                item->hash = *hash;
+            } else {
+                item->failed = true;
+                item->error = hash.error();
+            }
+        }
 
-        big_uint16_t num_colors;
-        stream_.read(reinterpret_cast<char*>(&num_colors), 2);
+        if (!item->failed && journal) {
+            item->key = journal->key(item->file.path, item->output, item->hash);
+            if (journal->finished(item->key, item->output)) {
+                item->skipped = true;
+                std::vector<uint8_t>().swap(item->file.data);
+                ++skipped;
+            }
+        }
 
-        if (num_colors != 25) {
+        if (!item->failed && !item->skipped && cache) {
             std::ostringstream oss;
-            oss << "Unexpected number colors in clut 130: " << num_colors;
-            throw std::runtime_error(oss.str());
+            if (cache->fetch(cache->key(base_hash, item->hash), oss)) {
+                item->mml = oss.str();
+                item->cached = true;
+                std::vector<uint8_t>().swap(item->file.data);
+
+                auto charged = recharge(budget, item->file, item->mml.size(), past_decode);
+                if (!charged) {
+                    item->failed = true;
+                    item->error = charged.error();
+                }
+            }
         }
 
-        for (auto i = 0; i < num_colors; ++i) {
-            big_uint16_t pixel_value;
-            stream_.read(reinterpret_cast<char*>(&pixel_value), 2);
-            stream_.read(reinterpret_cast<char*>(&interface_colors_[i]), 6);
+        // a manifest is small enough never to be streamed
+        if (!item->failed && !item->skipped && !item->cached && !item->file.oversized) {
+            auto expanded = expand_manifest(item->file.path, item->file.data);
+            if (!expanded) {
+                item->failed = true;
+                item->error = expanded.error();
+            }
         }
-    }
 
-    {
-        // ntct 128 sets interface rectangles
-        stream_.seekg(nrct_128_offset + header.data_offset);
+        if (!item->failed && !item->skipped && !item->cached) {
+            Expected<std::unique_ptr<MacBinary>> mod{nullptr};
+            if (item->file.oversized) {
+                // indexed in place, so the fork is never copied to the heap
+                try {
+                    mod = MacBinary::create(std::unique_ptr<MappedFile>{new MappedFile{item->file.path.c_str()}}, nullptr, cache != nullptr);
+                } catch (const std::exception& e) {
+                    mod = Error{e.what()};
+                }
+            } else {
+                mod = MacBinary::create(std::move(item->file.data), nullptr, cache != nullptr);
+            }
 
-        big_uint32_t length;
-        stream_.read(reinterpret_cast<char*>(&length), 4);
+            if (mod) {
+                item->mod = std::move(*mod);
 
-        big_uint16_t num_rects;
-        stream_.read(reinterpret_cast<char*>(&num_rects), 2);
+                auto charged = recharge(budget, item->file, item->mod->memory_usage(), past_decode);
+                if (!charged) {
+                    item->failed = true;
+                    item->error = charged.error();
+                    item->mod.reset();
+                }
+            } else {
+                item->failed = true;
+                item->error = mod.error();
+            }
+        }
+
+        if (item->mod && references) {
+            auto nearest = references->nearest(make_sketch(item->mod->resource_fingerprints()));
+            if (nearest) {
+                item->base = *nearest;
+            } else {
+                item->failed = true;
+                item->error = nearest.error();
+                item->mod.reset();
+            }
+        } else {
+            item->base = base.get();
+        }
 
-        if (num_rects != 18) {
+        ++past_decode;
+        return item;
+    });
+
+    // bases are only read while diffing, so they are shared by every
+    // worker
+    pipeline.add_stage("diff", options.diff_threads, decoded, diffed, [&](BatchItemPtr item) {
+        if (item->mod) {
             std::ostringstream oss;
-            oss << "Unexpected number of colors in nrct 128: " << num_rects;
-            throw std::runtime_error(oss.str());
+            if (cache) {
+                auto diffed = item->base->diff(*item->mod, *cache, oss);
+                if (!diffed) {
+                    item->failed = true;
+                    item->error = diffed.error();
+                }
+            } else {
+                item->base->diff(*item->mod, oss);
+            }
+            item->mml = oss.str();
+            item->mod.reset();
+
+            auto charged = recharge(budget, item->file, item->mml.size(), past_diff);
+            if (!charged) {
+                item->failed = true;
+                item->error = charged.error();
+            }
         }
 
-        for (auto i = 0; i < num_rects; ++i) {
-            stream_.read(reinterpret_cast<char*>(&interface_rects_[i]), 8);
+        ++past_diff;
+        return item;
+    });
+
+    pipeline.add_sink("write", options.write_threads, diffed, [&](BatchItemPtr item) {
+        if (!item->failed && !item->skipped) {
+            auto written = write_file_atomically(item->output, item->mml);
+            if (written && cache && !item->cached) {
+                written = cache->store(cache->key(base_hash, item->hash), item->mml);
+            }
+
+            if (written && journal) {
+                written = journal->record(item->key, item->hash, item->file.path, item->output, hash64(item->mml));
+            }
+
+            if (!written) {
+                item->failed = true;
+                item->error = written.error();
+            }
         }
-    }
 
-    for (auto& menu : menu_offsets)
-    {
-        // MENU 1000 sets player color strings
-        // MENU 2004 sets difficulty level strings
-        stream_.seekg(menu.second + header.data_offset);
+        if (item->failed) {
+            report.add(item->file.path, item->error);
+        }
 
-        big_uint32_t length;
-        stream_.read(reinterpret_cast<char*>(&length), 4);
+        // before the release, so a worker waiting on it sees it coming
+        --past_decode;
+        --past_diff;
+        budget.release(item->file.charged);
+    });
 
-        // skip width, height, proc, enableFlags
-        stream_.seekg(14, std::ios_base::cur);
+    pipeline.wait();
 
-        auto title = read_pstring(stream_);
-        auto& v = menu_strings_[menu.first];
-        v.clear();
-        
-        auto item = read_pstring(stream_);
-        while (item.size()) {
-            v.push_back(item);
+    if (journal) {
+        auto synced = journal->sync();
+        if (!synced) {
+            report.add(options.journal, synced.error());
+        }
 
-            // skip icon number, item command key, item mark, item style
-            stream_.seekg(4, std::ios_base::cur);
-            
-            item = read_pstring(stream_);
+        if (skipped) {
+            std::cerr << skipped << (skipped == 1 ? " input" : " inputs") << " already in " << options.journal << "; skipped\n";
         }
     }
+
+    if (options.stats) {
+        pipeline.write_stats(std::cerr);
+    }
+
+    if (options.stats || options.memory_limit) {
+        std::cerr << "Peak accounted memory: " << budget.peak() << " bytes\n";
+    }
+
+    return report.summarize(std::cerr) ? 0 : 1;
 }
 
-void MacBinary::diff(MacBinary& other)
+// serves diffs against bases parsed once, for callers that would otherwise
+// start a process per diff
+static int run_diff_daemon(const char* socket_path, std::vector<std::string> bases, unsigned threads)
 {
-    pt::ptree tree;
-    tree.add("<xmlcomment>", "Generated by resdiff");
+    ResidentBases<MacBinary> resident{std::move(bases), [](const std::string& path, Sketch& sketch) -> Expected<std::unique_ptr<MacBinary>> {
+        try {
+            std::unique_ptr<MappedFile> file{new MappedFile{path.c_str()}};
+            auto base = MacBinary::create(std::move(file));
+            if (base) {
+                sketch = make_sketch((*base)->resource_fingerprints());
+            }
+            return base;
+        } catch (const std::exception& e) {
+            return Error{e.what()};
+        }
+    }};
+    resident.reload().value();
+
+    DaemonHandlers handlers;
+    handlers.diff = [&](const std::string& name, Span modified) -> Expected<std::string> {
+        auto mod = MacBinary::create(std::vector<uint8_t>(modified.data, modified.data + modified.size));
+        if (!mod) {
+            return mod.error();
+        }
 
-    for (auto i = 0; i < 25; ++i) {
-        if (interface_colors_[i] != other.interface_colors_[i]) {
-            auto color_tree = interface_colors_[i].diff(i, other.interface_colors_[i]);
-            tree.add_child("marathon.interface.color", color_tree.get_child("color"));
+        auto set = resident.current();
+        auto base = set->find(name, name.empty() ? make_sketch((*mod)->resource_fingerprints()) : Sketch{});
+        if (!base) {
+            return Error{"No base " + name};
         }
-    }
-    
-    for (auto i = 0; i < 18; ++i) {
-        if (interface_rects_[i] != other.interface_rects_[i]) {
-            auto rect_tree = interface_rects_[i].diff(i, other.interface_rects_[i]);
-            tree.add_child("marathon.interface.rect", rect_tree.get_child("rect"));
+
+        std::ostringstream oss;
+        base->diff(**mod, oss);
+        return oss.str();
+    };
+    handlers.reload = [&]() {
+        return resident.reload();
+    };
+
+    return run_daemon(socket_path, threads, handlers);
+}
+
+int main(int argv, char* argc[])
+{
+    auto threads = std::thread::hardware_concurrency();
+    auto verify_only = false;
+    const char* store_dir = nullptr;
+    const char* delta_base = nullptr;
+    const char* sketch_index = nullptr;
+    auto cluster = false;
+    auto threshold = 0.7;
+    const char* dictionary_path = nullptr;
+    const char* find_path = nullptr;
+    auto exact = false;
+    const char* socket_path = nullptr;
+    BatchOptions batch;
+
+    auto arg = 1;
+    for (; arg < argv && argc[arg][0] == '-' && argc[arg][1]; ++arg) {
+        std::string option{argc[arg]};
+        if (option == "-j" && arg + 1 < argv) {
+            threads = std::max(1, std::atoi(argc[++arg]));
+            batch.decode_threads = batch.diff_threads = threads;
+        } else if (option == "--verify") {
+            verify_only = true;
+        } else if (option == "--store" && arg + 1 < argv) {
+            store_dir = argc[++arg];
+        } else if (option == "--delta-base" && arg + 1 < argv) {
+            delta_base = argc[++arg];
+        } else if (option == "--sketch" && arg + 1 < argv) {
+            sketch_index = argc[++arg];
+        } else if (option == "--cluster") {
+            cluster = true;
+        } else if (option == "--threshold" && arg + 1 < argv) {
+            threshold = std::atof(argc[++arg]);
+        } else if (option == "--dictionary" && arg + 1 < argv) {
+            dictionary_path = argc[++arg];
+        } else if (option == "--find" && arg + 1 < argv) {
+            find_path = argc[++arg];
+        } else if (option == "--exact") {
+            exact = true;
+        } else if (option == "--daemon" && arg + 1 < argv) {
+            socket_path = argc[++arg];
+        } else if (!parse_batch_option(arg, argv, argc, batch)) {
+            break;
         }
     }
-    
-    for (auto& id : strings_) {
-        if (id.first == 129) {
-            // skip filenames
-            continue;
-        }
-        auto found_diff = false;
-        pt::ptree stringset_tree;
 
-        stringset_tree.put("stringset.<xmlattr>.index", id.first);
-        
-        if (id.second.size() != other.strings_[id.first].size()) {
-            std::ostringstream oss;
-            oss << "Not yet implemented: different num strings for id " << id.first;
-            throw std::runtime_error(oss.str());
+    if (verify_only) {
+        if (arg == argv) {
+            std::cerr << "Usage: resdiff --verify <file>...\n";
+            return -1;
         }
-        
-        auto& v = id.second;
-        auto& other_v = other.strings_[id.first];
-        for (auto i = 0; i < v.size(); ++i) {
-            if (v[i] != other_v[i]) {
-                pt::ptree string_tree;
-                
-                string_tree.put("string", mac_roman_to_utf8(other_v[i]));
-                string_tree.put("string.<xmlattr>.index", i);
-                
-                found_diff = true;
-                
-                stringset_tree.add_child("stringset.string", string_tree.get_child("string"));
+
+        auto result = 0;
+        for (; arg < argv; ++arg) {
+            if (!verify(argc[arg], std::cout)) {
+                result = 1;
             }
         }
 
-        if (found_diff) {
-            tree.add_child("marathon.stringset", stringset_tree.get_child("stringset"));
-        }
+        return result;
     }
 
-    for (auto& id : menu_strings_) {
-        if (id.first != 1000 && id.first != 2004) {
-            continue;
+    if (store_dir) {
+        if (arg == argv) {
+            std::cerr << "Usage: resdiff --store <dir> [--delta-base <engine>] <file>...\n";
+            return -1;
         }
-        
-        auto found_diff = false;
-        pt::ptree stringset_tree;
 
-        if (id.first == 1000) {
-            stringset_tree.put("stringset.<xmlattr>.index", 152);
-        } else if (id.first == 2004) {
-            stringset_tree.put("stringset.<xmlattr>.index", 145);
+        try {
+            ObjectStore objects{store_dir};
+
+            std::unique_ptr<DeltaBase> base;
+            if (delta_base) {
+                base.reset(new DeltaBase{delta_base});
+            }
+
+            auto result = 0;
+            for (; arg < argv; ++arg) {
+                if (!store(objects, argc[arg], base.get(), std::cout)) {
+                    result = 1;
+                }
+            }
+
+            return result;
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
+    }
 
-        if (id.second.size() != other.menu_strings_[id.first].size()) {
-            std::ostringstream oss;
-            oss << "Not yet implemented: different num menu strings for id " << id.first;
-            throw std::runtime_error(oss.str());
+    if (socket_path) {
+        try {
+            std::vector<std::string> bases(argc + arg, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                bases.insert(bases.end(), listed.begin(), listed.end());
+            }
+
+            if (bases.empty()) {
+                std::cerr << "Usage: resdiff [-j threads] --daemon <socket> <base>...\n";
+                return -1;
+            }
+
+            return run_diff_daemon(socket_path, std::move(bases), threads);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
+    }
 
-        auto& v = id.second;
-        auto& other_v = other.menu_strings_[id.first];
-        for (auto i = 0; i < v.size(); ++i) {
-            if (v[i] != other_v[i]) {
-                pt::ptree string_tree;
+    if (dictionary_path || find_path) {
+        try {
+            std::vector<std::string> args(argc + arg, argc + argv);
+            if (dictionary_path && batch.list) {
+                auto listed = read_path_list(batch.list);
+                args.insert(args.end(), listed.begin(), listed.end());
+            }
 
-                string_tree.put("string", mac_roman_to_utf8(other_v[i]));
-                string_tree.put("string.<xmlattr>.index", i);
+            if (args.empty()) {
+                std::cerr << "Usage: resdiff [-j threads] --dictionary <file> <engine>...\n";
+                std::cerr << "       resdiff --find <file> [--exact] <text>...\n";
+                return -1;
+            }
 
-                found_diff = true;
+            if (dictionary_path) {
+                ThreadPool pool{threads ? threads - 1 : 0};
+                return build_dictionary(dictionary_path, args, &pool);
+            }
+
+            return find_strings(find_path, args, exact);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
+        }
+    }
+
+    if (sketch_index || cluster) {
+        try {
+            std::vector<std::string> files(argc + arg, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                files.insert(files.end(), listed.begin(), listed.end());
+            }
+
+            if (files.empty()) {
+                std::cerr << "Usage: resdiff --sketch <index> <file>...\n";
+                std::cerr << "       resdiff --cluster [--threshold similarity] <file>...\n";
+                return -1;
+            }
 
-                stringset_tree.add_child("stringset.string", string_tree.get_child("string"));
+            if (sketch_index) {
+                return update_sketch_index(sketch_index, files, sketch_engine, std::cerr) ? 0 : 1;
             }
+
+            return write_families(files, threshold, sketch_engine, std::cout, std::cerr) ? 0 : 1;
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
+    }
 
-        if (found_diff) {
-            tree.add_child("marathon.stringset", stringset_tree.get_child("stringset"));
+    if (!batch.output_dir.empty()) {
+        if (arg == argv && !(batch.auto_base && batch.list)) {
+            std::cerr << "Usage: resdiff [-j threads] " << batch_usage << " <base> <modified>...\n";
+            return -1;
+        }
+
+        try {
+            // with --auto-base, every argument is an input
+            auto first = batch.auto_base ? arg : arg + 1;
+            std::vector<std::string> inputs(argc + first, argc + argv);
+            if (batch.list) {
+                auto listed = read_path_list(batch.list);
+                inputs.insert(inputs.end(), listed.begin(), listed.end());
+            }
+
+            return run_batch(batch.auto_base ? nullptr : argc[arg], std::move(inputs), batch);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+            return -1;
         }
     }
 
-    pt::xml_writer_settings<std::string> settings(' ', 4, "utf-8");
-    pt::write_xml(std::cout, tree, settings);
-}
+    if (argv - arg != (batch.auto_base ? 1 : 2)) {
+        std::cerr << "Usage: resdiff [-j threads] [--cache <dir>] <base> <modified>\n";
+        std::cerr << "       resdiff [-j threads] [--cache <dir>] --auto-base <index> <modified>\n";
+        std::cerr << "       resdiff [-j threads] " << batch_usage << " <base> <modified>...\n";
+        std::cerr << "       resdiff --verify <file>...\n";
+        std::cerr << "       resdiff --store <dir> [--delta-base <engine>] <file>...\n";
+        std::cerr << "       resdiff --sketch <index> <file>...\n";
+        std::cerr << "       resdiff --cluster [--threshold similarity] <file>...\n";
+        std::cerr << "       resdiff [-j threads] --dictionary <file> <engine>...\n";
+        std::cerr << "       resdiff --find <file> [--exact] <text>...\n";
+        std::cerr << "       resdiff [-j threads] --daemon <socket> <base>...\n";
+        return -1;
+    }
 
-int main(int argv, char* argc[])
-{
-    if (argv != 3) {
-        std::cerr << "Usage: strdiff <base> <modified>\n";
-        return- 1;
+    std::string base_filename;
+    const char* mod_filename = argc[argv - 1];
+    if (batch.auto_base) {
+        if (std::string{mod_filename} == "-") {
+            std::cerr << "--auto-base needs <modified> in a file\n";
+            return -1;
+        }
+
+        double found_similarity;
+        auto nearest = nearest_reference(batch.auto_base, mod_filename, sketch_engine, &found_similarity);
+        if (!nearest) {
+            std::cerr << nearest.error().message() << "\n";
+            return -1;
+        }
+
+        base_filename = *nearest;
+        std::cerr << "Using " << base_filename << " as the base (similarity " << std::fixed << std::setprecision(2) << found_similarity << ")\n";
+    } else {
+        base_filename = argc[arg];
+    }
+
+    if (base_filename == "-" && std::string{mod_filename} == "-") {
+        std::cerr << "Only one of <base> and <modified> can be read from stdin\n";
+        return -1;
     }
 
     try {
-        MacBinary base{argc[1]};
-        MacBinary mod{argc[2]};
+        // the calling thread decodes too
+        ThreadPool pool{threads ? threads - 1 : 0};
+
+        if (batch.cache && base_filename != "-" && std::string{mod_filename} != "-") {
+            return diff_cached(base_filename.c_str(), mod_filename, batch.cache, &pool);
+        }
+
+        MacBinary base{base_filename.c_str(), &pool};
+        MacBinary mod{mod_filename, &pool};
 
-        base.diff(mod);
+        base.diff(mod, std::cout);
     } catch (const std::exception& e) {
         std::cerr << "Exception: " << e.what() << "\n";
         return -1;
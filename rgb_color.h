@@ -0,0 +1,89 @@
+/*
+    rgb_color.h: colors as engines and Fux! states store them
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RGB_COLOR_H
+#define RGB_COLOR_H
+
+#include <cstdint>
+
+#include <boost/property_tree/ptree.hpp>
+
+// 16-bit components, as a clut holds them once decoded (T = uint16_t) or
+// as a Fux! state lays them out on disk (T = big_uint16_t), so a color
+// can be read straight into place and compared with memcmp
+template <typename T>
+struct BasicRGBColor {
+    boost::property_tree::ptree diff(const BasicRGBColor& other) const {
+        boost::property_tree::ptree tree;
+
+        if (r != other.r ||
+            g != other.g ||
+            b != other.b)
+        {
+            tree.put("color.<xmlattr>.red", other.r / 65535.0);
+            tree.put("color.<xmlattr>.green", other.g / 65535.0);
+            tree.put("color.<xmlattr>.blue", other.b / 65535.0);
+        }
+
+        return tree;
+    }
+
+    boost::property_tree::ptree diff(int index, const BasicRGBColor& other) const {
+        boost::property_tree::ptree tree;
+
+        if (r != other.r ||
+            g != other.g ||
+            b != other.b)
+        {
+            tree = other.tree(index);
+        }
+
+        return tree;
+    }
+
+    boost::property_tree::ptree tree(int index) const {
+        boost::property_tree::ptree tree;
+
+        tree.put("color.<xmlattr>.index", index);
+        tree.put("color.<xmlattr>.red", r / 65535.0);
+        tree.put("color.<xmlattr>.green", g / 65535.0);
+        tree.put("color.<xmlattr>.blue", b / 65535.0);
+
+        return tree;
+    }
+
+    T r;
+    T g;
+    T b;
+};
+
+template <typename T>
+bool operator==(const BasicRGBColor<T>& a, const BasicRGBColor<T>& b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+template <typename T>
+bool operator!=(const BasicRGBColor<T>& a, const BasicRGBColor<T>& b)
+{
+    return !(a == b);
+}
+
+using RGBColor = BasicRGBColor<uint16_t>;
+
+#endif
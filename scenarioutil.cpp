@@ -0,0 +1,238 @@
+/*
+    scenarioutil.cpp: C interface to the engine and Fux! state diffs
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scenarioutil.h"
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "expected.h"
+#include "fuxstate.h"
+#include "macbinary.h"
+#include "mapped_file.h"
+
+namespace pt = boost::property_tree;
+
+struct scenarioutil_file {
+    scenarioutil_kind kind;
+    std::unique_ptr<MacBinary> engine;
+    std::unique_ptr<Fuxstate> state;
+};
+
+struct scenarioutil_diff {
+    std::string mml;
+
+    // parent and elements
+    std::vector<std::pair<std::string, std::string>> records;
+};
+
+static thread_local std::string last_error;
+
+// nothing thrown may cross into C
+template <typename T, typename F>
+static T* guard(F f)
+{
+    try {
+        auto result = f();
+        if (!result) {
+            last_error = result.error().message();
+            return nullptr;
+        }
+
+        return result->release();
+    } catch (const std::exception& e) {
+        last_error = e.what();
+    } catch (...) {
+        last_error = "Unknown exception";
+    }
+
+    return nullptr;
+}
+
+static Expected<std::unique_ptr<scenarioutil_file>> open_state(std::unique_ptr<Fuxstate> state, Expected<void> loaded)
+{
+    if (!loaded) {
+        return loaded.error();
+    }
+
+    std::unique_ptr<scenarioutil_file> file{new scenarioutil_file{SCENARIOUTIL_FUX_STATE, nullptr, std::move(state)}};
+    return file;
+}
+
+static Expected<std::unique_ptr<scenarioutil_file>> open_engine(Expected<std::unique_ptr<MacBinary>> engine)
+{
+    if (!engine) {
+        return engine.error();
+    }
+
+    std::unique_ptr<scenarioutil_file> file{new scenarioutil_file{SCENARIOUTIL_ENGINE, std::move(*engine), nullptr}};
+    return file;
+}
+
+// the sections of a Fux! state's diff, each written as write_xml places
+// it in the document
+static void add_sections(scenarioutil_diff& diff, const pt::ptree& tree)
+{
+    auto marathon = tree.get_child_optional("marathon");
+    if (!marathon) {
+        return;
+    }
+
+    pt::xml_writer_settings<std::string> settings(' ', 4);
+    for (auto& section : *marathon) {
+        std::ostringstream oss;
+        pt::xml_parser::write_xml_element(oss, section.first, section.second, 1, settings);
+        diff.records.push_back(std::make_pair("marathon", oss.str()));
+    }
+}
+
+static Expected<std::unique_ptr<scenarioutil_diff>> diff_files(scenarioutil_file& base, scenarioutil_file& modified)
+{
+    if (base.kind != modified.kind) {
+        return Error{"Cannot diff an engine against a Fux! state"};
+    }
+
+    std::unique_ptr<scenarioutil_diff> diff{new scenarioutil_diff};
+    std::ostringstream oss;
+
+    if (base.kind == SCENARIOUTIL_ENGINE) {
+        auto fragments = base.engine->diff_fragments(*modified.engine);
+        for (auto& fragment : fragments) {
+            if (!fragment.interface.empty()) {
+                diff->records.push_back(std::make_pair("marathon/interface", fragment.interface));
+            }
+            if (!fragment.marathon.empty()) {
+                diff->records.push_back(std::make_pair("marathon", fragment.marathon));
+            }
+        }
+
+        write_mml(oss, fragments);
+    } else {
+        auto tree = base.state->diff_tree(*modified.state);
+        if (!tree) {
+            return tree.error();
+        }
+
+        add_sections(*diff, *tree);
+
+        pt::xml_writer_settings<std::string> settings(' ', 4);
+        pt::write_xml(oss, *tree, settings);
+    }
+
+    diff->mml = oss.str();
+    return diff;
+}
+
+int scenarioutil_version(void)
+{
+    return SCENARIOUTIL_VERSION;
+}
+
+const char* scenarioutil_last_error(void)
+{
+    return last_error.c_str();
+}
+
+scenarioutil_file* scenarioutil_open_path(scenarioutil_kind kind, const char* path)
+{
+    return guard<scenarioutil_file>([&]() -> Expected<std::unique_ptr<scenarioutil_file>> {
+        if (kind == SCENARIOUTIL_ENGINE) {
+            return open_engine(MacBinary::create(std::unique_ptr<MappedFile>{new MappedFile{path}}));
+        } else if (kind == SCENARIOUTIL_FUX_STATE) {
+            std::unique_ptr<Fuxstate> state{new Fuxstate};
+            auto loaded = state->load(path);
+            return open_state(std::move(state), loaded);
+        }
+
+        return Error{"Unknown kind " + std::to_string(kind)};
+    });
+}
+
+scenarioutil_file* scenarioutil_open_buffer(scenarioutil_kind kind, const void* data, size_t size)
+{
+    return guard<scenarioutil_file>([&]() -> Expected<std::unique_ptr<scenarioutil_file>> {
+        auto p = static_cast<const uint8_t*>(data);
+        if (kind == SCENARIOUTIL_ENGINE) {
+            return open_engine(MacBinary::create(std::vector<uint8_t>(p, p + size)));
+        } else if (kind == SCENARIOUTIL_FUX_STATE) {
+            std::unique_ptr<Fuxstate> state{new Fuxstate};
+            auto loaded = state->load(Span{p, size});
+            return open_state(std::move(state), loaded);
+        }
+
+        return Error{"Unknown kind " + std::to_string(kind)};
+    });
+}
+
+scenarioutil_kind scenarioutil_file_kind(const scenarioutil_file* file)
+{
+    return file->kind;
+}
+
+void scenarioutil_free_file(scenarioutil_file* file)
+{
+    delete file;
+}
+
+scenarioutil_diff* scenarioutil_diff_files(scenarioutil_file* base, scenarioutil_file* modified)
+{
+    return guard<scenarioutil_diff>([&]() {
+        return diff_files(*base, *modified);
+    });
+}
+
+const char* scenarioutil_diff_mml(const scenarioutil_diff* diff, size_t* size)
+{
+    if (size) {
+        *size = diff->mml.size();
+    }
+
+    return diff->mml.c_str();
+}
+
+size_t scenarioutil_diff_record_count(const scenarioutil_diff* diff)
+{
+    return diff->records.size();
+}
+
+int scenarioutil_diff_record(const scenarioutil_diff* diff, size_t index, scenarioutil_record* record)
+{
+    if (index >= diff->records.size()) {
+        last_error = "Record " + std::to_string(index) + " out of range";
+        return -1;
+    }
+
+    auto& r = diff->records[index];
+    record->parent = r.first.c_str();
+    record->mml = r.second.c_str();
+    record->size = r.second.size();
+    return 0;
+}
+
+void scenarioutil_free_diff(scenarioutil_diff* diff)
+{
+    delete diff;
+}
@@ -0,0 +1,92 @@
+/*
+    scenarioutil.h: C interface to the engine and Fux! state diffs
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCENARIOUTIL_H
+#define SCENARIOUTIL_H
+
+#include <stddef.h>
+
+// what resdiff and fuxdiff do, for programs that would rather link
+// libscenarioutil than run them. Only plain C types cross this interface,
+// so it can be called through any FFI; functions that fail return NULL or
+// nonzero and leave a message for scenarioutil_last_error()
+
+#if defined(__GNUC__)
+#define SCENARIOUTIL_API __attribute__((visibility("default")))
+#else
+#define SCENARIOUTIL_API
+#endif
+
+// raised when the interface changes incompatibly
+#define SCENARIOUTIL_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum scenarioutil_kind {
+    // a Marathon engine, in any container resdiff reads
+    SCENARIOUTIL_ENGINE = 0,
+    // a Fux! state file
+    SCENARIOUTIL_FUX_STATE = 1
+} scenarioutil_kind;
+
+typedef struct scenarioutil_file scenarioutil_file;
+typedef struct scenarioutil_diff scenarioutil_diff;
+
+// part of a diff: one or more sibling elements, laid out as they are in
+// the whole document, and the path of the element they go in
+typedef struct scenarioutil_record {
+    const char* parent;
+    const char* mml;
+    size_t size;
+} scenarioutil_record;
+
+// SCENARIOUTIL_VERSION as the library was built
+SCENARIOUTIL_API int scenarioutil_version(void);
+
+// the reason the last call on this thread failed
+SCENARIOUTIL_API const char* scenarioutil_last_error(void);
+
+// a path may name a manifest in an object store. A buffer is copied, so
+// it can be released once the call returns
+SCENARIOUTIL_API scenarioutil_file* scenarioutil_open_path(scenarioutil_kind kind, const char* path);
+SCENARIOUTIL_API scenarioutil_file* scenarioutil_open_buffer(scenarioutil_kind kind, const void* data, size_t size);
+SCENARIOUTIL_API scenarioutil_kind scenarioutil_file_kind(const scenarioutil_file* file);
+SCENARIOUTIL_API void scenarioutil_free_file(scenarioutil_file* file);
+
+// the MML that turns base into modified, which must be of the same kind.
+// One base may be diffed against several files on different threads at
+// once. Changes MML cannot express are noted on stderr, as the tools do
+SCENARIOUTIL_API scenarioutil_diff* scenarioutil_diff_files(scenarioutil_file* base, scenarioutil_file* modified);
+
+// the whole document, NUL terminated, as resdiff or fuxdiff writes it
+SCENARIOUTIL_API const char* scenarioutil_diff_mml(const scenarioutil_diff* diff, size_t* size);
+
+// the document's records in order; pointers stay valid until the diff
+// is freed. Returns nonzero if index is out of range
+SCENARIOUTIL_API size_t scenarioutil_diff_record_count(const scenarioutil_diff* diff);
+SCENARIOUTIL_API int scenarioutil_diff_record(const scenarioutil_diff* diff, size_t index, scenarioutil_record* record);
+
+SCENARIOUTIL_API void scenarioutil_free_diff(scenarioutil_diff* diff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,386 @@
+/*
+    sketch.cpp: MinHash sketches for finding which reference a file derives from
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sketch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <numeric>
+
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include "batch.h"
+#include "hash.h"
+
+using namespace boost::endian;
+
+static const char sketch_magic[4] = {'R','S','K','1'};
+
+// 16 bands of 4 minimums: two files sharing half their fingerprints
+// have a band in common 64% of the time, and at 80% all but certainly
+static const std::size_t band_count = 16;
+static const std::size_t band_size = std::tuple_size<Sketch>::value / band_count;
+
+// below this, a band in common is too unlikely for the bands to be
+// worth consulting when clustering
+static const double band_threshold = 0.5;
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+Sketch make_sketch(const std::vector<uint64_t>& fingerprints)
+{
+    // the seeds are part of the file format; changing them invalidates
+    // every saved index
+    static const Sketch seeds = [] {
+        Sketch s;
+        for (auto i = 0u; i < s.size(); ++i) {
+            s[i] = splitmix64(i);
+        }
+        return s;
+    }();
+
+    Sketch sketch;
+    sketch.fill(UINT64_MAX);
+    for (auto f : fingerprints) {
+        for (auto i = 0u; i < sketch.size(); ++i) {
+            sketch[i] = std::min(sketch[i], splitmix64(f ^ seeds[i]));
+        }
+    }
+
+    return sketch;
+}
+
+double similarity(const Sketch& a, const Sketch& b)
+{
+    auto same = 0;
+    for (auto i = 0u; i < a.size(); ++i) {
+        same += a[i] == b[i];
+    }
+
+    return static_cast<double>(same) / a.size();
+}
+
+static uint64_t band_hash(const Sketch& sketch, std::size_t band)
+{
+    return hash64(&sketch[band * band_size], band_size * sizeof(uint64_t), band);
+}
+
+SketchIndex::SketchIndex() : bands_(band_count) { }
+
+void SketchIndex::add(const std::string& name, const Sketch& sketch)
+{
+    auto it = by_name_.find(name);
+    if (it != by_name_.end()) {
+        auto i = it->second;
+        for (auto b = 0u; b < band_count; ++b) {
+            auto range = bands_[b].equal_range(band_hash(sketches_[i], b));
+            for (auto e = range.first; e != range.second; ++e) {
+                if (e->second == i) {
+                    bands_[b].erase(e);
+                    break;
+                }
+            }
+        }
+
+        sketches_[i] = sketch;
+        index(i);
+        return;
+    }
+
+    by_name_[name] = names_.size();
+    names_.push_back(name);
+    sketches_.push_back(sketch);
+    index(names_.size() - 1);
+}
+
+void SketchIndex::index(std::size_t i)
+{
+    for (auto b = 0u; b < band_count; ++b) {
+        bands_[b].emplace(band_hash(sketches_[i], b), i);
+    }
+}
+
+std::vector<std::size_t> SketchIndex::candidates(const Sketch& sketch) const
+{
+    std::vector<std::size_t> found;
+    for (auto b = 0u; b < band_count; ++b) {
+        auto range = bands_[b].equal_range(band_hash(sketch, b));
+        for (auto e = range.first; e != range.second; ++e) {
+            found.push_back(e->second);
+        }
+    }
+
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
+
+int SketchIndex::nearest(const Sketch& sketch, double* found_similarity) const
+{
+    auto found = candidates(sketch);
+    if (found.empty()) {
+        found.resize(size());
+        std::iota(found.begin(), found.end(), 0);
+    }
+
+    auto best = -1;
+    auto best_similarity = -1.0;
+    for (auto i : found) {
+        auto s = similarity(sketch, sketches_[i]);
+        if (s > best_similarity) {
+            best = i;
+            best_similarity = s;
+        }
+    }
+
+    if (found_similarity) {
+        *found_similarity = best_similarity;
+    }
+
+    return best;
+}
+
+static std::size_t find_root(std::vector<std::size_t>& parent, std::size_t i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
+
+std::vector<std::vector<std::size_t>> SketchIndex::cluster(double threshold) const
+{
+    std::vector<std::size_t> parent(size());
+    std::iota(parent.begin(), parent.end(), 0);
+
+    auto join = [&](std::size_t i, std::size_t j) {
+        if (similarity(sketches_[i], sketches_[j]) >= threshold) {
+            parent[find_root(parent, i)] = find_root(parent, j);
+        }
+    };
+
+    for (auto i = 0u; i < size(); ++i) {
+        if (threshold >= band_threshold) {
+            for (auto j : candidates(sketches_[i])) {
+                if (j < i) {
+                    join(i, j);
+                }
+            }
+        } else {
+            for (auto j = 0u; j < i; ++j) {
+                join(i, j);
+            }
+        }
+    }
+
+    std::unordered_map<std::size_t, std::size_t> family_of;
+    std::vector<std::vector<std::size_t>> families;
+    for (auto i = 0u; i < size(); ++i) {
+        auto root = find_root(parent, i);
+        auto it = family_of.find(root);
+        if (it == family_of.end()) {
+            it = family_of.emplace(root, families.size()).first;
+            families.emplace_back();
+        }
+
+        families[it->second].push_back(i);
+    }
+
+    for (auto& family : families) {
+        // the member closest to all the others typifies the family
+        std::vector<double> total(family.size());
+        for (auto a = 0u; a < family.size(); ++a) {
+            for (auto b = a + 1; b < family.size(); ++b) {
+                auto s = similarity(sketches_[family[a]], sketches_[family[b]]);
+                total[a] += s;
+                total[b] += s;
+            }
+        }
+
+        auto typical = family[std::max_element(total.begin(), total.end()) - total.begin()];
+        std::stable_sort(family.begin(), family.end(), [&](std::size_t a, std::size_t b) {
+            if (a == typical || b == typical) {
+                return a == typical && b != typical;
+            }
+            return similarity(sketches_[a], sketches_[typical]) > similarity(sketches_[b], sketches_[typical]);
+        });
+    }
+
+    std::stable_sort(families.begin(), families.end(), [](const std::vector<std::size_t>& a, const std::vector<std::size_t>& b) {
+        return a.size() > b.size();
+    });
+
+    return families;
+}
+
+Expected<void> SketchIndex::load(const std::string& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        return Error{"Unable to open " + path + ": " + std::strerror(errno)};
+    }
+
+    std::vector<uint8_t> data{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+    if (data.size() < 8 || std::memcmp(data.data(), sketch_magic, sizeof(sketch_magic))) {
+        return Error{path + " is not a sketch index"};
+    }
+
+    auto count = load_little_u32(&data[4]);
+    auto p = data.data() + 8;
+    auto end = data.data() + data.size();
+    for (auto i = 0u; i < count; ++i) {
+        if (end - p < 2) {
+            return Error{"Sketch index truncated", p - data.data()};
+        }
+
+        auto length = load_little_u16(p);
+        p += 2;
+        if (static_cast<std::size_t>(end - p) < length + sizeof(Sketch)) {
+            return Error{"Sketch index truncated", p - data.data()};
+        }
+
+        std::string name(reinterpret_cast<const char*>(p), length);
+        p += length;
+
+        Sketch sketch;
+        for (auto& h : sketch) {
+            h = load_little_u64(p);
+            p += sizeof(uint64_t);
+        }
+
+        add(name, sketch);
+    }
+
+    return Expected<void>{};
+}
+
+Expected<void> SketchIndex::save(const std::string& path) const
+{
+    std::string data(sketch_magic, sizeof(sketch_magic));
+    uint8_t buf[8];
+    store_little_u32(buf, names_.size());
+    data.append(reinterpret_cast<char*>(buf), 4);
+
+    for (auto i = 0u; i < size(); ++i) {
+        if (names_[i].size() > UINT16_MAX) {
+            return Error{"Name too long for a sketch index: " + names_[i]};
+        }
+
+        store_little_u16(buf, names_[i].size());
+        data.append(reinterpret_cast<char*>(buf), 2);
+        data += names_[i];
+
+        for (auto h : sketches_[i]) {
+            store_little_u64(buf, h);
+            data.append(reinterpret_cast<char*>(buf), 8);
+        }
+    }
+
+    return write_file_atomically(path, data);
+}
+
+bool update_sketch_index(const std::string& path, const std::vector<std::string>& files, const Sketcher& sketcher, std::ostream& err)
+{
+    SketchIndex index;
+    if (access(path.c_str(), F_OK) == 0) {
+        auto loaded = index.load(path);
+        if (!loaded) {
+            err << path << ": " << loaded.error().message() << "\n";
+            return false;
+        }
+    }
+
+    auto result = true;
+    for (auto& file : files) {
+        auto sketch = sketcher(file.c_str());
+        if (sketch) {
+            index.add(file, *sketch);
+        } else {
+            err << file << ": " << sketch.error().message() << "\n";
+            result = false;
+        }
+    }
+
+    auto saved = index.save(path);
+    if (!saved) {
+        err << path << ": " << saved.error().message() << "\n";
+        return false;
+    }
+
+    return result;
+}
+
+Expected<std::string> nearest_reference(const std::string& path, const char* filename, const Sketcher& sketcher, double* found_similarity)
+{
+    SketchIndex index;
+    auto loaded = index.load(path);
+    if (!loaded) {
+        return loaded.error();
+    }
+
+    if (!index.size()) {
+        return Error{path + " holds no references"};
+    }
+
+    auto sketch = sketcher(filename);
+    if (!sketch) {
+        return sketch.error();
+    }
+
+    return index.name(index.nearest(*sketch, found_similarity));
+}
+
+bool write_families(const std::vector<std::string>& files, double threshold, const Sketcher& sketcher, std::ostream& out, std::ostream& err)
+{
+    SketchIndex index;
+    auto result = true;
+    for (auto& file : files) {
+        auto sketch = sketcher(file.c_str());
+        if (sketch) {
+            index.add(file, *sketch);
+        } else {
+            err << file << ": " << sketch.error().message() << "\n";
+            result = false;
+        }
+    }
+
+    auto families = index.cluster(threshold);
+    out << std::fixed << std::setprecision(2);
+    for (auto f = 0u; f < families.size(); ++f) {
+        auto& first = index.sketch(families[f].front());
+        for (auto i : families[f]) {
+            out << f + 1 << "\t" << index.name(i) << "\t" << similarity(index.sketch(i), first) << "\n";
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,98 @@
+/*
+    sketch.h: MinHash sketches for finding which reference a file derives from
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expected.h"
+
+// the minimum of each of 64 hashes over a set of fingerprints, such as
+// one per resource of an engine; the share of minimums two sketches have
+// in common estimates how much of their sets they share
+using Sketch = std::array<uint64_t, 64>;
+
+Sketch make_sketch(const std::vector<uint64_t>& fingerprints);
+
+double similarity(const Sketch& a, const Sketch& b);
+
+// sketches of named files, such as the stock engines, with the sketches
+// cut into bands and each band hashed, so that files likely to be similar
+// are found without comparing against every entry
+class SketchIndex {
+public:
+    SketchIndex();
+
+    // replaces any entry already under name
+    void add(const std::string& name, const Sketch& sketch);
+
+    std::size_t size() const { return names_.size(); }
+    const std::string& name(std::size_t i) const { return names_[i]; }
+    const Sketch& sketch(std::size_t i) const { return sketches_[i]; }
+
+    // the entry most similar to sketch, or -1 if there are none. Entries
+    // sharing a band are tried first, and the rest only if none does
+    int nearest(const Sketch& sketch, double* found_similarity = nullptr) const;
+
+    // entries grouped into families, each holding the entries similar to
+    // one another by at least threshold, directly or through other
+    // members; largest first, with each family's most typical member
+    // first, followed by the rest in order of similarity to it
+    std::vector<std::vector<std::size_t>> cluster(double threshold) const;
+
+    // stored as a magic number and the entry count, then for each entry
+    // the name's length, the name and the sketch, all little-endian
+    Expected<void> load(const std::string& path);
+    Expected<void> save(const std::string& path) const;
+
+private:
+    void index(std::size_t i);
+    std::vector<std::size_t> candidates(const Sketch& sketch) const;
+
+    std::vector<std::string> names_;
+    std::vector<Sketch> sketches_;
+    std::unordered_map<std::string, std::size_t> by_name_;
+
+    // for each band, the entries holding each band hash
+    std::vector<std::unordered_multimap<uint64_t, std::size_t>> bands_;
+};
+
+// how each tool sketches a file; resource maps for engines, tags for
+// Fux! states
+using Sketcher = std::function<Expected<Sketch>(const char* filename)>;
+
+// adds each file to the index saved at path, which is created if need
+// be; files that cannot be sketched are reported on err and left out
+bool update_sketch_index(const std::string& path, const std::vector<std::string>& files, const Sketcher& sketcher, std::ostream& err);
+
+// the file in the index saved at path that filename most resembles
+Expected<std::string> nearest_reference(const std::string& path, const char* filename, const Sketcher& sketcher, double* found_similarity = nullptr);
+
+// writes a tab-separated line for each file: its family, numbered from
+// the largest, the file, and its similarity to the family's first member
+bool write_families(const std::vector<std::string>& files, double threshold, const Sketcher& sketcher, std::ostream& out, std::ostream& err);
+
+#endif
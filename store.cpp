@@ -0,0 +1,318 @@
+/*
+    store.cpp: content-addressed store for engines and Fux! states
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "store.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include "batch.h"
+#include "delta.h"
+#include "hash.h"
+
+using namespace boost::endian;
+
+// a manifest is the magic, the size and hash of the file it describes and
+// its number of chunks, then for each chunk a kind byte and its size,
+// followed by the chunk itself if inline, its hash if an object, or the
+// hash and size of the object it was derived from and the delta from that
+// if a delta; all little-endian
+static const char manifest_magic[4] = {'R','S','M','1'};
+const std::size_t manifest_header_size = 24;
+
+enum ChunkKind : uint8_t {
+    inline_chunk,
+    object_chunk,
+    delta_chunk,
+};
+
+// chunks smaller than this cost less to keep in the manifest than to
+// refer to
+static const std::size_t min_object_size = 64;
+
+static std::string object_path(const std::string& dir, uint64_t hash)
+{
+    char name[20];
+    std::snprintf(name, sizeof(name), "%02x/%014" PRIx64, static_cast<unsigned>(hash >> 56), hash & UINT64_C(0x00ffffffffffffff));
+    return dir + "/objects/" + name;
+}
+
+static void make_directory(const std::string& dir)
+{
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+        throw std::runtime_error("Unable to create " + dir + ": " + std::strerror(errno));
+    }
+}
+
+ObjectStore::ObjectStore(const std::string& dir) : dir_{dir}
+{
+    make_directory(dir);
+    make_directory(dir + "/objects");
+}
+
+Expected<bool> ObjectStore::put(Span data, uint64_t hash, Added& added)
+{
+    auto path = object_path(dir_, hash);
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        if (static_cast<std::size_t>(st.st_size) != data.size) {
+            return false;
+        }
+
+        try {
+            MappedFile existing{path.c_str()};
+            return std::memcmp(existing.data(), data.data, data.size) == 0;
+        } catch (const std::exception& e) {
+            return Error{e.what()};
+        }
+    }
+
+    auto slash = path.rfind('/');
+    if (mkdir(path.substr(0, slash).c_str(), 0777) < 0 && errno != EEXIST) {
+        return Error{"Unable to create " + path.substr(0, slash) + ": " + std::strerror(errno)};
+    }
+
+    auto written = write_file_atomically(path, std::string(reinterpret_cast<const char*>(data.data), data.size));
+    if (!written) {
+        return written.error();
+    }
+
+    ++added.objects;
+    added.bytes += data.size;
+    return true;
+}
+
+Expected<ObjectStore::Added> ObjectStore::add(const std::string& name, Span file, const std::vector<Span>& payloads,
+                                               const std::vector<Span>& references)
+{
+    Added added{dir_ + "/" + name, 0, 0};
+
+    std::string manifest(manifest_header_size, '\0');
+    uint32_t count = 0;
+
+    auto chunk = [&](Span data, Span reference) -> Expected<void> {
+        if (data.empty()) {
+            return Expected<void>{};
+        }
+
+        uint8_t header[21];
+        header[0] = inline_chunk;
+        store_little_u32(header + 1, data.size);
+
+        if (data.size >= min_object_size) {
+            auto hash = hash64(data.data, data.size);
+
+            // a payload stored whole already, or unchanged from its
+            // reference, costs nothing more as an object
+            struct stat st;
+            if (!reference.empty() &&
+                !(reference.size == data.size && std::memcmp(reference.data, data.data, data.size) == 0) &&
+                stat(object_path(dir_, hash).c_str(), &st) < 0)
+            {
+                auto delta = make_delta(reference, data);
+                if (delta.size() <= data.size / 2) {
+                    auto reference_hash = hash64(reference.data, reference.size);
+                    auto stored = put(reference, reference_hash, added);
+                    if (!stored) {
+                        return stored.error();
+                    }
+
+                    if (*stored) {
+                        header[0] = delta_chunk;
+                        store_little_u64(header + 5, reference_hash);
+                        store_little_u32(header + 13, reference.size);
+                        store_little_u32(header + 17, delta.size());
+                        manifest.append(reinterpret_cast<const char*>(header), sizeof(header));
+                        manifest += delta;
+                        added.bytes += delta.size();
+                        ++count;
+                        return Expected<void>{};
+                    }
+                }
+            }
+
+            auto stored = put(data, hash, added);
+            if (!stored) {
+                return stored.error();
+            }
+
+            // on the rare clash of hashes the chunk is kept inline
+            if (*stored) {
+                header[0] = object_chunk;
+                store_little_u64(header + 5, hash);
+                manifest.append(reinterpret_cast<const char*>(header), 13);
+                ++count;
+                return Expected<void>{};
+            }
+        }
+
+        manifest.append(reinterpret_cast<const char*>(header), 5);
+        manifest.append(reinterpret_cast<const char*>(data.data), data.size);
+        ++count;
+        return Expected<void>{};
+    };
+
+    if (!references.empty() && references.size() != payloads.size()) {
+        return Error{"References do not match payloads"};
+    }
+
+    auto p = file.data;
+    auto end = file.data + file.size;
+    for (auto i = 0u; i < payloads.size(); ++i) {
+        auto& payload = payloads[i];
+        if (payload.data < p || payload.data + payload.size > end) {
+            return Error{"Chunk outside file", payload.data - file.data};
+        }
+
+        auto gap = chunk(Span{p, static_cast<std::size_t>(payload.data - p)}, Span{nullptr, 0});
+        auto stored = gap ? chunk(payload, references.empty() ? Span{nullptr, 0} : references[i]) : gap;
+        if (!stored) {
+            return stored.error();
+        }
+        p = payload.data + payload.size;
+    }
+
+    auto rest = chunk(Span{p, static_cast<std::size_t>(end - p)}, Span{nullptr, 0});
+    if (!rest) {
+        return rest.error();
+    }
+
+    auto header = reinterpret_cast<unsigned char*>(&manifest[0]);
+    std::memcpy(header, manifest_magic, sizeof(manifest_magic));
+    store_little_u64(header + 4, file.size);
+    store_little_u64(header + 12, hash64(file.data, file.size));
+    store_little_u32(header + 20, count);
+
+    auto written = write_file_atomically(added.manifest, manifest);
+    if (!written) {
+        return written.error();
+    }
+
+    return added;
+}
+
+bool is_manifest(Span data)
+{
+    return data.size >= manifest_header_size && std::memcmp(data.data, manifest_magic, sizeof(manifest_magic)) == 0;
+}
+
+Expected<void> expand_manifest(const std::string& path, std::vector<uint8_t>& data)
+{
+    if (!is_manifest(Span{data.data(), data.size()})) {
+        return Expected<void>{};
+    }
+
+    auto slash = path.rfind('/');
+    auto dir = slash == std::string::npos ? std::string{"."} : path.substr(0, slash);
+
+    auto p = data.data();
+    auto end = data.data() + data.size();
+
+    auto size = load_little_u64(p + 4);
+    auto hash = load_little_u64(p + 12);
+    auto count = load_little_u32(p + 20);
+    p += manifest_header_size;
+
+    auto offset = [&]() {
+        return static_cast<int64_t>(p - data.data());
+    };
+
+    std::vector<uint8_t> file;
+    file.reserve(size);
+
+    for (auto i = 0u; i < count; ++i) {
+        if (end - p < 5) {
+            return Error{"Manifest truncated", offset()};
+        }
+
+        auto kind = p[0];
+        auto chunk_size = load_little_u32(p + 1);
+        if (file.size() + chunk_size > size) {
+            return Error{"Manifest chunks exceed file size", offset()};
+        }
+        p += 5;
+
+        if (kind == inline_chunk) {
+            if (static_cast<std::size_t>(end - p) < chunk_size) {
+                return Error{"Manifest truncated", offset()};
+            }
+            file.insert(file.end(), p, p + chunk_size);
+            p += chunk_size;
+        } else if (kind == object_chunk) {
+            if (end - p < 8) {
+                return Error{"Manifest truncated", offset()};
+            }
+
+            auto object = object_path(dir, load_little_u64(p));
+            std::ifstream ifs(object, std::ios::binary);
+            auto start = file.size();
+            file.resize(start + chunk_size);
+            if (!ifs.read(reinterpret_cast<char*>(file.data() + start), chunk_size) || ifs.peek() != std::ifstream::traits_type::eof()) {
+                return Error{"Missing or damaged object " + object, offset() - 5};
+            }
+            p += 8;
+        } else if (kind == delta_chunk) {
+            if (end - p < 16) {
+                return Error{"Manifest truncated", offset()};
+            }
+
+            auto object = object_path(dir, load_little_u64(p));
+            auto reference_size = load_little_u32(p + 8);
+            auto delta_size = load_little_u32(p + 12);
+            p += 16;
+            if (static_cast<std::size_t>(end - p) < delta_size) {
+                return Error{"Manifest truncated", offset()};
+            }
+
+            std::ifstream ifs(object, std::ios::binary);
+            std::vector<uint8_t> reference(reference_size);
+            if (!ifs.read(reinterpret_cast<char*>(reference.data()), reference_size) || ifs.peek() != std::ifstream::traits_type::eof()) {
+                return Error{"Missing or damaged object " + object, offset() - 21};
+            }
+
+            auto start = file.size();
+            auto applied = apply_delta(Span{reference.data(), reference.size()}, Span{p, delta_size}, file);
+            if (!applied) {
+                return Error{applied.error().reason, offset()};
+            }
+
+            if (file.size() - start != chunk_size) {
+                return Error{"Delta does not match its chunk size", offset() - 21};
+            }
+            p += delta_size;
+        } else {
+            return Error{"Unknown manifest chunk kind " + std::to_string(kind), offset() - 5};
+        }
+    }
+
+    if (file.size() != size || hash64(file.data(), file.size()) != hash) {
+        return Error{"Stored file does not match its manifest"};
+    }
+
+    data = std::move(file);
+    return Expected<void>{};
+}
@@ -0,0 +1,74 @@
+/*
+    store.h: content-addressed store for engines and Fux! states
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expected.h"
+#include "mapped_file.h"
+
+// a directory holding each distinct chunk of the files added to it once,
+// under objects/, named by hash, and a manifest per file listing the
+// chunks it is made of. Manifests can be given to either tool in place of
+// the file they describe
+class ObjectStore {
+public:
+    // creates dir if need be; throws std::runtime_error if it cannot
+    explicit ObjectStore(const std::string& dir);
+
+    // what adding a file cost
+    struct Added {
+        std::string manifest;
+        std::size_t objects;
+        uint64_t bytes;
+    };
+
+    // adds file under name. payloads are the parts of file likely to be
+    // shared with other files, such as resources or Fux! tags, in order and
+    // not overlapping; what lies between them is stored as well, and chunks
+    // too small to be worth an object go in the manifest itself.
+    // references, if given, has an entry for each payload: what it was
+    // likely derived from, such as the base engine's copy of a resource,
+    // or an empty span. A payload not stored already is kept as a delta
+    // against its reference when that takes at most half the space
+    Expected<Added> add(const std::string& name, Span file, const std::vector<Span>& payloads,
+                        const std::vector<Span>& references = std::vector<Span>{});
+
+private:
+    // the object for data, written if new; false if a different object
+    // already has its name
+    Expected<bool> put(Span data, uint64_t hash, Added& added);
+
+    std::string dir_;
+};
+
+// enough of the start of a file to tell whether it is a manifest
+extern const std::size_t manifest_header_size;
+
+bool is_manifest(Span data);
+
+// if data, read from path, is a manifest, replaces it with the file it
+// describes, read from the store the manifest lies in
+Expected<void> expand_manifest(const std::string& path, std::vector<uint8_t>& data);
+
+#endif
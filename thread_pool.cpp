@@ -0,0 +1,136 @@
+/*
+    thread_pool.cpp: fixed-size worker pool
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned threads) : stopping_{false}
+{
+    for (auto i = 0u; i < threads; ++i) {
+        workers_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPool::work()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        task();
+    }
+}
+
+namespace {
+
+struct ParallelFor {
+    ParallelFor(std::size_t count, const std::function<void(std::size_t)>& f) :
+        count{count}, f(f), next{0}, done{0} { }
+
+    // claims indices until none are left
+    void run() {
+        std::size_t finished = 0;
+        for (auto i = next++; i < count; i = next++) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            ++finished;
+        }
+
+        if (finished && (done += finished) == count) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_all();
+        }
+    }
+
+    const std::size_t count;
+    const std::function<void(std::size_t)>& f;
+    std::atomic<std::size_t> next;
+    std::atomic<std::size_t> done;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+};
+
+}
+
+void ThreadPool::parallel_for(std::size_t count, const std::function<void(std::size_t)>& f)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // helpers may be dequeued after the loop is over, so they share
+    // ownership of the state
+    auto state = std::make_shared<ParallelFor>(count, f);
+
+    auto helpers = std::min<std::size_t>(workers_.size(), count - 1);
+    for (auto i = 0u; i < helpers; ++i) {
+        post([state] { state->run(); });
+    }
+
+    state->run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&] { return state->done == count; });
+
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
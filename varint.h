@@ -0,0 +1,55 @@
+/*
+    varint.h: LEB128 integers for compact on-disk formats
+    Copyright (C) 2022 Gregory Smith
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstdint>
+#include <string>
+
+// seven bits to a byte, low first, with the top bit set on all but the last
+inline void put_varint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// false if the varint runs past end or is too long for value
+template <typename T>
+bool get_varint(const uint8_t*& p, const uint8_t* end, T& value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < sizeof(T) * 8; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+
+        auto byte = *p++;
+        value |= static_cast<T>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#endif